@@ -0,0 +1,85 @@
+// Parse throughput on a generated circuit, through the mapped file path and
+// the line by line path used for pipes.
+//	make bench && ./parsebench [megabytes]
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "main.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t generate(FILE * out, size_t bytes)
+{
+	static const char * lines[] = {
+		"H 0..9\n",
+		"X 3 : 0 1 2\n",
+		"Z 7 : 4..6 # phase kickback\n",
+		"W 2 5 : 8\n",
+		"Uf 0 1 2 9 : 4\n",
+		"-----a\n",
+		"H 4 5 : 0\n",
+		"X 9 : 0..8\n",
+		"-----a 3\n",
+		"M 0..3\n",
+	};
+	size_t n = 0;
+	int i = 0;
+
+	n += fprintf(out, "f = ab ^ c\n");
+	while (n < bytes)
+	{
+		n += fputs(lines[i], out) >= 0? strlen(lines[i]): 0;
+		i = (i + 1) % (sizeof(lines) / sizeof(*lines));
+	}
+	return n;
+}
+
+static void bench(const char * name, FILE * in, size_t bytes)
+{
+	struct qsim_ctx * ctx = ctx_new();
+	double t;
+
+	if (!ctx)
+		error("Out of memory");
+	t = now();
+	parse_circuit(ctx, in);
+	t = now() - t;
+	printf("%-8s %8d gates %8.1f MB/s\n", name, ctx->ngates, bytes / t / 1e6);
+	ctx_free(ctx);
+}
+
+int main(int argc, char ** argv)
+{
+	size_t mb = argc > 1? strtoul(argv[1], NULL, 10): 32;
+	FILE * file = tmpfile();
+	FILE * mem;
+	char * buf;
+	size_t bytes;
+
+	if (!file)
+		error("Failed to create temporary file");
+	bytes = generate(file, mb << 20);
+	fflush(file);
+
+	rewind(file);
+	bench("mmap", file, bytes);
+
+	if (!(buf = malloc(bytes)))
+		error("Out of memory");
+	rewind(file);
+	if (fread(buf, 1, bytes, file) != bytes || !(mem = fmemopen(buf, bytes, "r")))
+		error("Failed to read back circuit");
+	bench("getline", mem, bytes);
+
+	fclose(mem);
+	fclose(file);
+	free(buf);
+}
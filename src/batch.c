@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include "main.h"
+#include "qsim.h"
+
+#define MAXSWEEPS 8
+
+// a barrier whose repeat count is swept over [start, stop]
+struct sweep {
+	int name;
+	int start, stop;
+};
+
+// one line of the batch list, parsed once and run for every sweep value
+struct entry {
+	char * path;
+	struct qsim_ctx * ctx;
+	int status;
+	struct sweep sweeps[MAXSWEEPS];
+	int nsweeps;
+	int firstjob;
+	int lineno;
+};
+
+struct job {
+	int entry;
+	int repeat[MAXSWEEPS];
+	char * buf;
+	size_t len;
+	int failed;
+};
+
+struct batch {
+	struct entry * entries;
+	int nentries;
+	struct job * jobs;
+	int njobs;
+	struct qsim_ctx ** workers;
+	uint64_t seed;
+};
+
+static void parse_sweep(const char * s, int * sidx, struct entry * e, int lineno)
+{
+	struct sweep * sw;
+	char * endptr;
+	long l;
+
+	if (e->nsweeps >= MAXSWEEPS)
+		error("Line %d: Too many sweeps. The limit is %d\n%s\n%*s~~~ Here",
+				lineno, MAXSWEEPS, s, *sidx + 1, "^");
+	sw = &e->sweeps[e->nsweeps];
+
+	if (is_lower(s[*sidx]))
+		sw->name = s[*sidx];
+	else if (s[*sidx] == '-')
+		sw->name = 0;
+	else error("Line %d: Expected barrier name or '-'\n%s\n%*s~~~ Here",
+			lineno, s, *sidx + 1, "^");
+	++*sidx;
+
+	if (s[*sidx] != '=')
+		error("Line %d: Expected '=' after barrier name\n%s\n%*s~~~ Here",
+				lineno, s, *sidx + 1, "^");
+	++*sidx;
+
+	errno = 0;
+	l = strtol(s + *sidx, &endptr, 10);
+	if (endptr == s + *sidx || errno || l < 0 || l > INT_MAX)
+		error("Line %d: Expected repeat count\n%s\n%*s~~~ Here",
+				lineno, s, *sidx + 1, "^");
+	*sidx = endptr - s;
+	sw->start = sw->stop = (int)l;
+
+	if (s[*sidx] == '.' && s[*sidx + 1] == '.')
+	{
+		*sidx += 2;
+		errno = 0;
+		l = strtol(s + *sidx, &endptr, 10);
+		if (endptr == s + *sidx || errno || l < 0 || l > INT_MAX)
+			error("Line %d: Expected repeat count at end of range\n%s\n%*s~~~ Here",
+					lineno, s, *sidx + 1, "^");
+		if (l < sw->start)
+			error("Line %d: End of sweep cannot be smaller than start\n%s\n%*s~~~ Here",
+					lineno, s, *sidx + 1, "^");
+		*sidx = endptr - s;
+		sw->stop = (int)l;
+	}
+
+	if (s[*sidx] && !is_space(s[*sidx]) && s[*sidx] != '#')
+		error("Line %d: Unexpected symbol in sweep\n%s\n%*s~~~ Here",
+				lineno, s, *sidx + 1, "^");
+	e->nsweeps++;
+}
+
+static void parse_list(struct batch * b, FILE * in)
+{
+	char * s = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	int lineno = 0;
+	int entcap = 0;
+
+	while ((len = getline(&s, &cap, in)) >= 0)
+	{
+		struct entry * e;
+		int sidx = 0;
+		int start;
+
+		lineno++;
+		while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r'))
+			s[--len] = 0;
+		while (is_space(s[sidx]))
+			sidx++;
+		if (!s[sidx] || s[sidx] == '#')
+			continue;
+
+		if (b->nentries == entcap)
+		{
+			entcap = entcap? entcap * 2: 16;
+			if (!(b->entries = realloc(b->entries, entcap * sizeof(*b->entries))))
+				error("Out of memory");
+		}
+		e = &b->entries[b->nentries++];
+		memset(e, 0, sizeof(*e));
+		e->lineno = lineno;
+
+		start = sidx;
+		while (s[sidx] && !is_space(s[sidx]))
+			sidx++;
+		if (!(e->path = strndup(s + start, sidx - start)))
+			error("Out of memory");
+
+		while (1)
+		{
+			while (is_space(s[sidx]))
+				sidx++;
+			if (!s[sidx] || s[sidx] == '#')
+				break;
+			parse_sweep(s, &sidx, e, lineno);
+		}
+	}
+	free(s);
+}
+
+// fails e if one of its sweeps names no repeated barrier of the circuit, which
+// would otherwise run the same circuit for every value
+static void check_sweeps(struct entry * e)
+{
+	for (int k = 0; k < e->nsweeps; k++)
+	{
+		int found = 0;
+
+		for (int i = 0; i < e->ctx->ngates && !found; i++)
+			found = (e->ctx->gates[i].type == GATE_BARRIER_BEGIN || e->ctx->gates[i].type == GATE_BARRIER_END)
+				&& e->ctx->gates[i].barrier.end && e->ctx->gates[i].barrier.name == e->sweeps[k].name;
+		if (!found)
+		{
+			snprintf(e->ctx->errmsg, ERRBUFSIZ, "Line %d: No barrier named %c",
+					e->lineno, e->sweeps[k].name? e->sweeps[k].name: '-');
+			e->status = QSIM_EPARSE;
+			return;
+		}
+	}
+}
+
+// every combination of sweep values becomes a job
+static void make_jobs(struct batch * b)
+{
+	for (int i = 0; i < b->nentries; i++)
+	{
+		struct entry * e = &b->entries[i];
+		long long n = 1;
+
+		// an entry that failed to load only reports its error once
+		for (int j = 0; j < e->nsweeps && !e->status; j++)
+		{
+			n *= e->sweeps[j].stop - e->sweeps[j].start + 1;
+			if (n > INT_MAX - b->njobs)
+				error("%s: Too many sweep combinations", e->path);
+		}
+		e->firstjob = b->njobs;
+		b->njobs += (int)n;
+	}
+
+	if (!(b->jobs = calloc(b->njobs, sizeof(*b->jobs))))
+		error("Out of memory");
+
+	for (int i = 0; i < b->nentries; i++)
+	{
+		struct entry * e = &b->entries[i];
+		int end = i + 1 < b->nentries? b->entries[i + 1].firstjob: b->njobs;
+
+		for (int j = e->firstjob; j < end; j++)
+		{
+			int rest = j - e->firstjob;
+
+			b->jobs[j].entry = i;
+			for (int k = e->nsweeps - 1; k >= 0; k--)
+			{
+				int span = e->sweeps[k].stop - e->sweeps[k].start + 1;
+				b->jobs[j].repeat[k] = e->sweeps[k].start + rest % span;
+				rest /= span;
+			}
+		}
+	}
+}
+
+static void set_repeats(struct gate * gates, int ngates, const struct entry * e, const struct job * job)
+{
+	for (int i = 0; i < ngates; i++)
+	{
+		if (gates[i].type != GATE_BARRIER_BEGIN && gates[i].type != GATE_BARRIER_END)
+			continue;
+		if (!gates[i].barrier.end)
+			continue;
+		for (int k = 0; k < e->nsweeps; k++)
+			if (gates[i].barrier.name == e->sweeps[k].name)
+				gates[i].barrier.repeat = job->repeat[k];
+	}
+}
+
+static void run_job(struct pool * pool, void * arg, int jobidx, int worker)
+{
+	struct batch * b = arg;
+	struct job * job = &b->jobs[jobidx];
+	struct entry * e = &b->entries[job->entry];
+	struct qsim_ctx * ctx = b->workers[worker];
+	FILE * out;
+
+	if (!(out = open_memstream(&job->buf, &job->len)))
+		error("Failed to allocate output buffer: %s", strerror(errno));
+
+	if (e->status)
+	{
+		fprintf(out, "%s\n", qsim_errmsg(e->ctx));
+		job->failed = 1;
+		fclose(out);
+		return;
+	}
+
+	ctx_copy_gates(ctx, e->ctx);
+	set_repeats(ctx->gates, ctx->ngates, e, job);
+	ctx_reset(ctx);
+	rng_seed(&ctx->rng, b->seed + jobidx);
+	ctx->out = out;
+
+	if (setjmp(ctx->jmp))
+	{
+		fprintf(out, "%s\n", ctx->errmsg);
+		job->failed = 1;
+	}
+	else
+	{
+		qsim_active = ctx;
+		run(ctx, ctx->gates, ctx->ngates, 0);
+	}
+	qsim_active = NULL;
+
+	fclose(out);
+}
+
+// returns number of failed jobs. Job j is seeded with seed + j.
+int run_batch(const char * path, int nthreads, uint64_t seed)
+{
+	struct batch b = {0};
+	int failed = 0;
+	FILE * in;
+
+	if (!(in = fopen(path, "r")))
+		error("Failed to open %s: %s", path, strerror(errno));
+	parse_list(&b, in);
+	fclose(in);
+
+	for (int i = 0; i < b.nentries; i++)
+		if ((b.entries[i].status = qsim_load(&b.entries[i].ctx, b.entries[i].path)) == QSIM_ENOMEM)
+			error("Out of memory");
+		else if (b.entries[i].status == QSIM_OK)
+			check_sweeps(&b.entries[i]);
+
+	make_jobs(&b);
+	b.seed = seed;
+
+	if (nthreads > b.njobs)
+		nthreads = b.njobs;
+	if (nthreads < 1)
+		nthreads = 1;
+	if (!(b.workers = calloc(nthreads, sizeof(*b.workers))))
+		error("Out of memory");
+	for (int i = 0; i < nthreads; i++)
+		if (!(b.workers[i] = ctx_new()))
+			error("Out of memory");
+
+	pool_run(nthreads, b.njobs, run_job, &b);
+
+	for (int i = 0; i < b.njobs; i++)
+	{
+		struct job * job = &b.jobs[i];
+		struct entry * e = &b.entries[job->entry];
+
+		printf("==> %s", e->path);
+		for (int k = 0; k < e->nsweeps && !e->status; k++)
+			printf(" %c=%d", e->sweeps[k].name? e->sweeps[k].name: '-', job->repeat[k]);
+		printf(" <==\n");
+		fwrite(job->buf, 1, job->len, stdout);
+		puts("");
+
+		failed += job->failed;
+		free(job->buf);
+	}
+
+	for (int i = 0; i < nthreads; i++)
+		ctx_free(b.workers[i]);
+	for (int i = 0; i < b.nentries; i++)
+	{
+		qsim_free(b.entries[i].ctx);
+		free(b.entries[i].path);
+	}
+	free(b.workers);
+	free(b.entries);
+	free(b.jobs);
+
+	return failed;
+}
@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "main.h"
+
+// State buffers are shared between the two children of a measurement until
+// one of them writes, and recycled through a free list instead of freed.
+struct sbuf {
+	atomic_int refs;
+	struct sbuf * next;
+	struct amp amps[NAMPS];
+};
+
+struct branch {
+	struct sbuf * buf;
+	struct cursor cur;
+	double prob;
+	char * record;  // outcome of every measurement so far, as '0'/'1'
+	int pending;    // outcome to collapse the measurement under cur to, or -1
+	int mprob;      // measure_probs() entry of that outcome
+};
+
+struct result {
+	char * record;
+	double prob;
+	int basis;      // final basis state, or -1 if in superposition
+	int nonzero;
+};
+
+struct tree {
+	struct qsim_ctx * ctx;
+	pthread_mutex_t lock;
+	struct sbuf * free;
+	struct branch ** branches;
+	int nbranches, cap;
+	struct result * results;
+	int nresults, rescap;
+	int * mqubits; // qubit of every measurement, in execution order
+	int nmqubits;
+	struct qsim_ctx ** workers;
+	struct amp ** own; // workers' own state, swapped out for pooled buffers
+};
+
+static struct sbuf * sbuf_get(struct tree * t)
+{
+	struct sbuf * b;
+
+	pthread_mutex_lock(&t->lock);
+	if ((b = t->free))
+		t->free = b->next;
+	pthread_mutex_unlock(&t->lock);
+
+	if (!b && !(b = malloc(sizeof(*b))))
+		error("Out of memory");
+	atomic_init(&b->refs, 1);
+	return b;
+}
+
+static void sbuf_put(struct tree * t, struct sbuf * b)
+{
+	if (atomic_fetch_sub(&b->refs, 1) > 1)
+		return;
+	pthread_mutex_lock(&t->lock);
+	b->next = t->free;
+	t->free = b;
+	pthread_mutex_unlock(&t->lock);
+}
+
+static int add_branch(struct tree * t, struct branch * br)
+{
+	int idx;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->nbranches == t->cap)
+	{
+		t->cap = t->cap? t->cap * 2: 64;
+		if (!(t->branches = realloc(t->branches, t->cap * sizeof(*t->branches))))
+			error("Out of memory");
+	}
+	idx = t->nbranches++;
+	t->branches[idx] = br;
+	pthread_mutex_unlock(&t->lock);
+	return idx;
+}
+
+static struct branch * get_branch(struct tree * t, int idx)
+{
+	struct branch * br;
+
+	pthread_mutex_lock(&t->lock);
+	br = t->branches[idx];
+	t->branches[idx] = NULL;
+	pthread_mutex_unlock(&t->lock);
+	return br;
+}
+
+static struct branch * fork_branch(const struct branch * parent, int nbits, int outcome, int mprob, double p)
+{
+	struct branch * br = malloc(sizeof(*br));
+	size_t len = strlen(parent->record);
+
+	if (!br || !(br->record = malloc(len + nbits + 1)))
+		error("Out of memory");
+	memcpy(br->record, parent->record, len);
+	for (int b = 0; b < nbits; b++)
+		br->record[len + b] = '0' + (outcome >> nbits - 1 - b & 1);
+	br->record[len + nbits] = 0;
+	br->buf = parent->buf;
+	atomic_fetch_add(&br->buf->refs, 1);
+	br->cur = parent->cur;
+	br->prob = parent->prob * p;
+	br->pending = outcome;
+	br->mprob = mprob;
+	return br;
+}
+
+static void add_result(struct tree * t, struct branch * br)
+{
+	struct result * r;
+	const struct amp * s = br->buf->amps;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->nresults == t->rescap)
+	{
+		t->rescap = t->rescap? t->rescap * 2: 64;
+		if (!(t->results = realloc(t->results, t->rescap * sizeof(*t->results))))
+			error("Out of memory");
+	}
+	r = &t->results[t->nresults++];
+	pthread_mutex_unlock(&t->lock);
+
+	r->record = br->record;
+	r->prob = br->prob;
+	r->basis = -1;
+	r->nonzero = 0;
+	for (int i = 0; i < NAMPS; i++)
+	{
+		if (!s[i].ones && !s[i].root2s)
+			continue;
+		r->basis = r->nonzero++? -1: i;
+	}
+}
+
+static void note_mqubit(struct tree * t, int n, int qubit)
+{
+	pthread_mutex_lock(&t->lock);
+	if (n == t->nmqubits)
+	{
+		if (!(t->mqubits = realloc(t->mqubits, (n + 1) * sizeof(int))))
+			error("Out of memory");
+		t->mqubits[t->nmqubits++] = qubit;
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+// Runs a branch up to its next measurement with more than one possible
+// outcome and queues a child for each, or to the end of the circuit.
+static void explore(struct pool * pool, void * arg, int idx, int worker)
+{
+	struct tree * t = arg;
+	struct branch * br = get_branch(t, idx);
+	struct qsim_ctx * ctx = t->workers[worker];
+	struct gate * gates = ctx->gates;
+
+	if (atomic_load(&br->buf->refs) > 1)
+	{
+		struct sbuf * copy = sbuf_get(t);
+
+		memcpy(copy->amps, br->buf->amps, sizeof(copy->amps));
+		sbuf_put(t, br->buf);
+		br->buf = copy;
+	}
+	ctx->state = br->buf->amps;
+
+	while (1)
+	{
+		struct gate * g;
+		int probs[NAMPS];
+		int n = 0, last = 0;
+
+		if (br->pending >= 0)
+		{
+			g = &gates[br->cur.pc];
+			project(ctx, g->bits, g->nbits, br->pending, br->mprob);
+			for (int b = 0; b < g->nbits; b++)
+				note_mqubit(t, (int)strlen(br->record) - g->nbits + b, g->bits[b]);
+			br->pending = -1;
+			g->cnt++;
+			br->cur.pc++;
+		}
+
+		if (!run_until(ctx, gates, ctx->ngates, &br->cur, GATE_MEASURE))
+			break;
+
+		g = &gates[br->cur.pc];
+		measure_probs(ctx, g->bits, g->nbits, probs);
+		if (ctx->flags & RUN_POSTSELECT && g->post >= 0)
+		{
+			struct branch * next;
+
+			if (probs[g->post] <= 0)
+			{
+				// this record cannot happen
+				sbuf_put(t, br->buf);
+				free(br->record);
+				free(br);
+				return;
+			}
+			next = fork_branch(br, g->nbits, g->post, probs[g->post],
+					(double)probs[g->post] / DENOMINATOR);
+			sbuf_put(t, br->buf);
+			free(br->record);
+			free(br);
+			br = next;
+			continue;
+		}
+
+		for (int o = 0; o < 1 << g->nbits; o++)
+			if (probs[o] > 0)
+			{
+				n++;
+				last = o;
+			}
+		if (n > 1)
+		{
+			for (int o = 0; o < 1 << g->nbits; o++)
+				if (probs[o] > 0)
+					pool_push(pool, worker, add_branch(t, fork_branch(br, g->nbits, o, probs[o],
+							(double)probs[o] / DENOMINATOR)));
+			sbuf_put(t, br->buf);
+			free(br->record);
+			free(br);
+			return;
+		}
+
+		// only one outcome is possible, prune the others
+		struct branch * next = fork_branch(br, g->nbits, last, probs[last], 1);
+		sbuf_put(t, br->buf);
+		free(br->record);
+		free(br);
+		br = next;
+	}
+
+	add_result(t, br);
+	sbuf_put(t, br->buf);
+	free(br);
+}
+
+static int cmp_results(const void * a, const void * b)
+{
+	return strcmp(((const struct result *)a)->record, ((const struct result *)b)->record);
+}
+
+static void print_results(FILE * out, struct tree * t)
+{
+	qsort(t->results, t->nresults, sizeof(*t->results), cmp_results);
+
+	fprintf(out, "Branches: %d\n", t->nresults);
+	for (int i = 0; i < t->nmqubits; i++)
+		fprintf(out, " q%d", t->mqubits[i]);
+	fprintf(out, "\n");
+
+	for (int i = 0; i < t->nresults; i++)
+	{
+		struct result * r = &t->results[i];
+
+		fprintf(out, "%s: %lf ", r->record, r->prob);
+		if (r->basis >= 0)
+		{
+			fprintf(out, "|");
+			for (int j = NQBITS - 1; j >= 0; j--)
+				putc(0x30 | (r->basis >> j & 1), out);
+			fprintf(out, ">\n");
+		}
+		else fprintf(out, "(%d nonzero amplitudes)\n", r->nonzero);
+	}
+}
+
+// Enumerates every measurement record with its exact probability. Each
+// measurement with more than one possible outcome forks the run, and the
+// forks are explored in parallel over nthreads.
+void run_branches(struct qsim_ctx * ctx, int nthreads)
+{
+	struct tree t = {.ctx = ctx};
+	struct branch * root = malloc(sizeof(*root));
+	unsigned flags = ctx->flags;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	pthread_mutex_init(&t.lock, NULL);
+	if (!root || !(root->record = calloc(1, 1))
+			|| !(t.workers = calloc(nthreads, sizeof(*t.workers)))
+			|| !(t.own = calloc(nthreads, sizeof(*t.own))))
+		error("Out of memory");
+
+	ctx->flags |= RUN_QUIET;
+	root->buf = sbuf_get(&t);
+	memcpy(root->buf->amps, ctx->state, sizeof(root->buf->amps));
+	cursor_init(&root->cur, 0);
+	root->prob = 1;
+	root->pending = -1;
+
+	for (int i = 0; i < nthreads; i++)
+	{
+		struct qsim_ctx * w;
+
+		if (!(w = t.workers[i] = ctx_new()))
+			error("Out of memory");
+		ctx_copy_gates(w, ctx);
+		w->flags = ctx->flags;
+		t.own[i] = w->state;
+	}
+
+	add_branch(&t, root);
+	pool_run(nthreads, 1, explore, &t);
+	ctx->flags = flags;
+
+	print_results(ctx->out, &t);
+
+	for (int i = 0; i < nthreads; i++)
+	{
+		t.workers[i]->state = t.own[i];
+		ctx_free(t.workers[i]);
+	}
+	for (int i = 0; i < t.nresults; i++)
+		free(t.results[i].record);
+	while (t.free)
+	{
+		struct sbuf * next = t.free->next;
+		free(t.free);
+		t.free = next;
+	}
+	pthread_mutex_destroy(&t.lock);
+	free(t.workers);
+	free(t.own);
+	free(t.branches);
+	free(t.results);
+	free(t.mqubits);
+}
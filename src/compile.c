@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "main.h"
+
+// A compiled circuit is a header, the gate array exactly as the interpreter
+// uses it, the function tables, the matrices and the noise channels. The gate array is mapped
+// copy-on-write and run in place, so the only thing that is not position
+// independent, a gate's func or mat pointer, is stored as an index and
+// relocated on load. The image is
+// only valid for the build that wrote it: NQBITS, the gate layout and the
+// byte order are all checked.
+
+#define QSIMC_MAGIC "QSIMC\r\n\x1a"
+#define QSIMC_VERSION 7
+#define QSIMC_ALIGN 64
+
+struct qsimc_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;     // 0x01020304 in the writer's byte order
+	uint32_t nqbits;
+	uint32_t gatesize;  // sizeof(struct gate)
+	uint32_t ngates;
+	uint32_t nfuncs;
+	uint32_t nmats;     // following the functions
+	uint32_t nnoise;    // following the matrices
+	uint64_t gates;     // offset of the gate array
+	uint64_t funcs;     // offset of the first function
+	uint64_t size;      // of the whole file
+};
+
+// Followed by its table: one bit per input when every value is 0 or 1, as
+// for any function used by U, else a 32 bit int per input.
+struct qsimc_func {
+	int32_t name;
+	int32_t argc;
+	int32_t width;
+	int32_t pad;
+};
+
+// followed by its 4^k entries, ones and root2s as 32 bit ints
+struct qsimc_mat {
+	int32_t name;
+	int32_t k;
+};
+
+struct qsimc_noise {
+	int32_t gate;
+	int32_t channel;
+	double p;
+};
+
+static size_t align(size_t n)
+{
+	return n + QSIMC_ALIGN - 1 & ~(size_t)(QSIMC_ALIGN - 1);
+}
+
+static int func_width(const struct func * f)
+{
+	return f->vals? 32: 1;
+}
+
+static size_t table_size(int argc, int width)
+{
+	return width == 1? ((1 << argc) + 63) / 64 * sizeof(uint64_t): (1 << argc) * sizeof(int32_t);
+}
+
+static size_t mat_size(int k)
+{
+	return ((size_t)1 << 2 * k) * 2 * sizeof(int32_t);
+}
+
+// whether the k qubit matrix m is orthogonal, as parse_matrix() made sure of
+static int is_orthogonal(const struct amp * m, int k)
+{
+	int n = 1 << k;
+
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < n; j++)
+		{
+			double dot = 0;
+
+			for (int r = 0; r < n; r++)
+				dot += amp_value(m[r * n + i]) * amp_value(m[r * n + j]);
+			if (fabs(dot - (i == j)) > 1e-6)
+				return 0;
+		}
+	return 1;
+}
+
+static int has_func(enum gatetype type)
+{
+	return type == GATE_Uf || type == GATE_Pf || type == GATE_PFUNC;
+}
+
+static void write_all(FILE * out, const void * p, size_t n, const char * path)
+{
+	if (fwrite(p, 1, n, out) != n)
+		error("Failed to write %s: %s", path, strerror(errno));
+}
+
+static void write_pad(FILE * out, size_t * off, const char * path)
+{
+	static const char zeros[QSIMC_ALIGN];
+	size_t n = align(*off) - *off;
+
+	write_all(out, zeros, n, path);
+	*off += n;
+}
+
+void compile_circuit(struct qsim_ctx * ctx, const char * path)
+{
+	struct qsimc_header h = {.magic = QSIMC_MAGIC};
+	size_t off = sizeof(h);
+	FILE * out;
+
+	h.version = QSIMC_VERSION;
+	h.order = 0x01020304;
+	h.nqbits = NQBITS;
+	h.gatesize = sizeof(struct gate);
+	h.ngates = ctx->ngates;
+	h.gates = align(off);
+	h.funcs = align(h.gates + (uint64_t)ctx->ngates * sizeof(struct gate));
+	h.size = h.funcs;
+	for (int f = 0; f < NFUNCS; f++)
+	{
+		if (!ctx->funcs[f].name)
+			continue;
+		h.nfuncs++;
+		h.size += sizeof(struct qsimc_func)
+			+ table_size(ctx->funcs[f].argc, func_width(&ctx->funcs[f]));
+	}
+	for (int m = 0; m < NMATS; m++)
+	{
+		if (!ctx->mats[m].name)
+			continue;
+		h.nmats++;
+		h.size += sizeof(struct qsimc_mat) + mat_size(ctx->mats[m].k);
+	}
+	h.nnoise = ctx->nnoise;
+	h.size += ctx->nnoise * sizeof(struct qsimc_noise);
+
+	if (!(out = fopen(path, "wb")))
+		error("Failed to open %s: %s", path, strerror(errno));
+
+	write_all(out, &h, sizeof(h), path);
+	write_pad(out, &off, path);
+
+	for (int i = 0; i < ctx->ngates; i++)
+	{
+		struct gate g = ctx->gates[i];
+
+		g.cnt = 0;
+		if (has_func(g.type))
+			g.funcidx = g.func - ctx->funcs;
+		else if (g.type == GATE_G)
+			g.funcidx = g.mat - ctx->mats;
+		else if (g.type == GATE_MEASURE)
+			g.mstate = MSTATE_UNKNOWN;
+		write_all(out, &g, sizeof(g), path);
+	}
+	off += (size_t)ctx->ngates * sizeof(struct gate);
+	write_pad(out, &off, path);
+
+	for (int f = 0; f < NFUNCS; f++)
+	{
+		const struct func * func = &ctx->funcs[f];
+		struct qsimc_func hf = {func->name, func->argc, 0, 0};
+
+		if (!func->name)
+			continue;
+		hf.width = func_width(func);
+		write_all(out, &hf, sizeof(hf), path);
+		if (hf.width == 1)
+			write_all(out, func->map, table_size(func->argc, 1), path);
+		else
+		{
+			int32_t vals[NAMPS];
+
+			for (int i = 0; i < 1 << func->argc; i++)
+				vals[i] = func->vals[i];
+			write_all(out, vals, table_size(func->argc, 32), path);
+		}
+	}
+
+	for (int m = 0; m < NMATS; m++)
+	{
+		const struct gmat * mat = &ctx->mats[m];
+		struct qsimc_mat hm = {mat->name, mat->k};
+
+		if (!mat->name)
+			continue;
+		write_all(out, &hm, sizeof(hm), path);
+		for (int i = 0; i < 1 << 2 * mat->k; i++)
+		{
+			int32_t e[2] = {mat->m[i].ones, mat->m[i].root2s};
+
+			write_all(out, e, sizeof(e), path);
+		}
+	}
+
+	for (int n = 0; n < ctx->nnoise; n++)
+	{
+		struct qsimc_noise hn = {ctx->noise[n].gate, ctx->noise[n].channel, ctx->noise[n].p};
+
+		write_all(out, &hn, sizeof(hn), path);
+	}
+
+	if (fclose(out))
+		error("Failed to write %s: %s", path, strerror(errno));
+}
+
+// whether in, which is left where it is, holds a compiled circuit
+int is_compiled(FILE * in)
+{
+	char magic[sizeof(QSIMC_MAGIC) - 1];
+	off_t off = ftello(in);
+
+	return off >= 0 && pread(fileno(in), magic, sizeof(magic), off) == sizeof(magic)
+		&& memcmp(magic, QSIMC_MAGIC, sizeof(magic)) == 0;
+}
+
+// Checks that every gate is one the parser could have made, so nothing in the
+// image can send a kernel or the printer out of bounds, and relocates their
+// functions and matrices.
+static void check_gates(struct qsim_ctx * ctx)
+{
+	int open[NBARRIERS]; // ends of the barrier blocks open at each gate, innermost last
+	int depth = 0;
+
+	for (int i = 0; i < ctx->ngates; i++)
+	{
+		struct gate * g = &ctx->gates[i];
+		int n = 0, used = 0;
+
+		if (g->type <= GATE_NONE || g->type > GATE_PFUNC)
+			error("Compiled circuit: gate %d has bad type %d", i, g->type);
+
+		if (g->type == GATE_BARRIER_BEGIN || g->type == GATE_BARRIER_END)
+		{
+			// an end closes the innermost block, and may open the next one
+			if (g->type == GATE_BARRIER_END && (!depth || open[--depth] != i))
+				error("Compiled circuit: barrier %d closes no block", i);
+			if (g->barrier.name && (g->barrier.name < 'a' || g->barrier.name > 'z')
+					|| g->barrier.repeat < 0)
+				error("Compiled circuit: barrier %d is malformed", i);
+			if (g->barrier.end)
+			{
+				if (g->barrier.end <= i || g->barrier.end >= ctx->ngates
+						|| ctx->gates[g->barrier.end].type != GATE_BARRIER_END
+						|| depth && g->barrier.end > open[depth - 1] || depth == NBARRIERS)
+					error("Compiled circuit: barrier %d has bad end", i);
+				open[depth++] = g->barrier.end;
+			}
+			continue;
+		}
+
+		// state and prob take every qubit as -1
+		if (g->ctrl & ~(NAMPS - 1) && !(g->ctrl == -1 && (g->type == GATE_STATE || g->type == GATE_PROBS))
+				|| g->type == GATE_MEASURE && g->ctrl)
+			error("Compiled circuit: gate %d has bad controls", i);
+		for (int b = 0; b < NQBITS; b++)
+			if (g->bits[b] < 0 || g->bits[b] >= NQBITS)
+				error("Compiled circuit: gate %d has bad qubit", i);
+
+		if (has_func(g->type))
+		{
+			if (g->funcidx >= NFUNCS || !ctx->funcs[g->funcidx].name)
+				error("Compiled circuit: gate %d uses an undefined function", i);
+			g->func = &ctx->funcs[g->funcidx];
+			if (g->type == GATE_Uf && (g->nout < 0 || g->func->argc + (g->nout? g->nout: 1) > NQBITS)
+					|| g->type == GATE_Pf && !g->func->argc)
+				error("Compiled circuit: gate %d has the wrong number of inputs", i);
+		}
+		if (g->type == GATE_G)
+		{
+			if (g->funcidx >= NMATS || !ctx->mats[g->funcidx].name)
+				error("Compiled circuit: gate %d uses an undefined matrix", i);
+			g->mat = &ctx->mats[g->funcidx];
+		}
+		if ((g->type == GATE_MEASURE || g->type == GATE_D || g->type == GATE_F)
+				&& (g->nbits < 1 || g->nbits > NQBITS))
+			error("Compiled circuit: gate %d has a malformed register", i);
+		if (g->type == GATE_MEASURE && (g->post < -1 || g->post >= 1 << g->nbits))
+			error("Compiled circuit: measurement %d is malformed", i);
+
+		switch (g->type)
+		{
+			case GATE_X:
+			case GATE_H:
+			case GATE_Z:
+				n = 1;
+				break;
+			case GATE_SWAP:
+				n = 2;
+				break;
+			case GATE_Uf:
+				n = g->func->argc + (g->nout? g->nout: 1);
+				break;
+			case GATE_Pf:
+				n = g->func->argc;
+				break;
+			case GATE_D:
+			case GATE_F:
+			case GATE_MEASURE:
+				n = g->nbits;
+				break;
+			case GATE_G:
+				n = g->mat->k;
+				break;
+			default:
+				break;
+		}
+		// as the parser requires, no qubit is used twice or as a control too
+		for (int b = 0; b < n; b++)
+		{
+			if ((used | g->ctrl) & ctrlbit(g->bits[b]))
+				error("Compiled circuit: gate %d uses qubit %d twice", i, g->bits[b]);
+			used |= ctrlbit(g->bits[b]);
+		}
+
+		if (g->type == GATE_Uf || g->type == GATE_Pf)
+			plan_Uf(ctx, g, "Gate", i);
+	}
+}
+
+// Maps the compiled circuit in into ctx. The gates stay in the mapping, which
+// ctx keeps until it is freed.
+void load_compiled(struct qsim_ctx * ctx, FILE * in)
+{
+	struct qsimc_header h;
+	struct stat st;
+	const char * base;
+	size_t off;
+
+	if (fstat(fileno(in), &st) || (size_t)st.st_size < sizeof(h))
+		error("Compiled circuit is truncated");
+	if ((ctx->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fileno(in), 0)) == MAP_FAILED)
+	{
+		ctx->map = NULL;
+		error("Failed to map compiled circuit: %s", strerror(errno));
+	}
+	ctx->maplen = st.st_size;
+	base = ctx->map;
+
+	memcpy(&h, base, sizeof(h));
+	if (h.order != 0x01020304)
+		error("Compiled circuit was written on a machine of another byte order");
+	if (h.version != QSIMC_VERSION)
+		error("Compiled circuit has version %u, expected %u", h.version, QSIMC_VERSION);
+	if (h.nqbits != NQBITS || h.gatesize != sizeof(struct gate))
+		error("Compiled circuit was written by an incompatible build of qsim");
+	if (h.size != (uint64_t)st.st_size || h.gates % QSIMC_ALIGN || h.ngates > INT_MAX
+			|| h.gates + (uint64_t)h.ngates * sizeof(struct gate) > h.funcs || h.funcs > h.size)
+		error("Compiled circuit is corrupt");
+
+	off = h.funcs;
+	for (uint32_t f = 0; f < h.nfuncs; f++)
+	{
+		struct qsimc_func hf;
+		struct func * func;
+
+		if (off + sizeof(hf) > h.size)
+			error("Compiled circuit is corrupt");
+		memcpy(&hf, base + off, sizeof(hf));
+		off += sizeof(hf);
+		if (hf.name < 'a' || hf.name >= 'a' + NFUNCS || hf.argc < 0 || hf.argc > NQBITS
+				|| hf.width != 1 && hf.width != 32
+				|| off + table_size(hf.argc, hf.width) > h.size)
+			error("Compiled circuit is corrupt");
+
+		func = &ctx->funcs[hf.name - 'a'];
+		if (func->name)
+			error("Compiled circuit is corrupt");
+		func->name = hf.name;
+		func->argc = hf.argc;
+		if (hf.width == 1)
+		{
+			memcpy(func->map, base + off, table_size(hf.argc, 1));
+			if (hf.argc < 6)
+				func->map[0] &= ((uint64_t)1 << (1 << hf.argc)) - 1;
+		}
+		else
+		{
+			if (!(func->vals = malloc(sizeof(int) << hf.argc)))
+				error("Out of memory");
+			for (int i = 0; i < 1 << hf.argc; i++)
+			{
+				int32_t val;
+
+				memcpy(&val, base + off + i * sizeof(val), sizeof(val));
+				func->vals[i] = val;
+				func->map[i / 64] |= (uint64_t)(val != 0) << i % 64;
+			}
+		}
+		analyze_func(func);
+		off += table_size(hf.argc, hf.width);
+	}
+
+	for (uint32_t m = 0; m < h.nmats; m++)
+	{
+		struct qsimc_mat hm;
+		struct gmat * mat;
+
+		if (off + sizeof(hm) > h.size)
+			error("Compiled circuit is corrupt");
+		memcpy(&hm, base + off, sizeof(hm));
+		off += sizeof(hm);
+		if (hm.name < 'a' || hm.name >= 'a' + NMATS || hm.k < 1 || hm.k > NQBITS || 1 << hm.k > GMAXSIZE
+				|| off + mat_size(hm.k) > h.size)
+			error("Compiled circuit is corrupt");
+
+		mat = &ctx->mats[hm.name - 'a'];
+		if (mat->name)
+			error("Compiled circuit is corrupt");
+		if (!(mat->m = malloc(sizeof(struct amp) << 2 * hm.k)))
+			error("Out of memory");
+		for (int i = 0; i < 1 << 2 * hm.k; i++)
+		{
+			int32_t e[2];
+
+			memcpy(e, base + off + i * sizeof(e), sizeof(e));
+			mat->m[i] = (struct amp){e[0], e[1]};
+		}
+		if (!is_orthogonal(mat->m, hm.k))
+			error("Compiled circuit is corrupt");
+		mat->name = hm.name;
+		mat->k = hm.k;
+		off += mat_size(hm.k);
+	}
+
+	if (h.nnoise > NNOISE || off + h.nnoise * sizeof(struct qsimc_noise) > h.size)
+		error("Compiled circuit is corrupt");
+	for (uint32_t n = 0; n < h.nnoise; n++)
+	{
+		struct qsimc_noise hn;
+
+		memcpy(&hn, base + off, sizeof(hn));
+		off += sizeof(hn);
+		if (!is_unitary(hn.gate) && hn.gate != GATE_MEASURE || hn.channel < CH_DEPOLARIZE
+				|| hn.channel > CH_READOUT || (hn.channel == CH_READOUT) != (hn.gate == GATE_MEASURE)
+				|| !(hn.p >= 0 && hn.p <= 1))
+			error("Compiled circuit is corrupt");
+		ctx->noise[n] = (struct noise){hn.gate, hn.channel, hn.p};
+	}
+	ctx->nnoise = (int)h.nnoise;
+
+	ctx->gates = (struct gate *)(ctx->map + h.gates);
+	ctx->ngates = (int)h.ngates;
+	ctx->gatecap = 0;
+	check_gates(ctx);
+}
@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "main.h"
+
+#define TBLOCK 32 // side of the tiles rho is transposed in
+#define ROWBLOCK 16 // fewest rows of rho per worker
+
+// Under --density the state is a density matrix rho, NAMPS by NAMPS by rows,
+// with the same fixed point entries as amplitudes. Amplitudes are real, so a
+// gate U maps rho to U rho U^T. Each row of rho is a state vector, and running
+// U's kernel on every row gives rho U^T. Transposing that gives U rho, and
+// running the kernel on the rows again gives U rho U^T, so every gate works on
+// rho through its usual kernel. The rows are independent, so they are split
+// into one contiguous range per worker. The workers are started once, each
+// pinned for good to the node that holds its range, and every pass of a
+// kernel over the rows is handed to all of them at once.
+
+struct rhopool {
+	pthread_mutex_t lock;
+	pthread_cond_t go, done;
+	const struct gate * g; // whose kernel the pass under way runs
+	long pass; // passes handed out so far
+	int busy; // workers still in the pass
+	int quit;
+	int nworkers;
+	struct rhoworker {
+		struct rhopool * pool;
+		struct qsim_ctx * ctx; // runs the kernel, its state set to each row in turn
+		struct amp * rho;
+		int first, end; // rows
+		int node;
+		pthread_t thread;
+	} * workers;
+};
+
+static void * rho_work(void * arg)
+{
+	struct rhoworker * w = arg;
+	struct rhopool * pool = w->pool;
+	struct amp * state = w->ctx->state;
+	long seen = 0;
+
+	numa_pin(w->node);
+	pthread_mutex_lock(&pool->lock);
+	while (1)
+	{
+		while (pool->pass == seen && !pool->quit)
+			pthread_cond_wait(&pool->go, &pool->lock);
+		if (pool->quit)
+			break;
+		seen = pool->pass;
+		pthread_mutex_unlock(&pool->lock);
+
+		for (int r = w->first; r < w->end; r++)
+		{
+			w->ctx->state = w->rho + (size_t)r * NAMPS;
+			apply_unitary(w->ctx, pool->g);
+		}
+		w->ctx->state = state;
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->busy)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// maps rho from huge pages and places it over the NUMA nodes, and starts
+// nthreads workers on its rows
+void rho_init(struct qsim_ctx * ctx, int nthreads)
+{
+	struct rhopool * pool;
+
+	ctx->rholen = (size_t)NAMPS * NAMPS * sizeof(struct amp);
+	if (!(ctx->rho = huge_alloc(&ctx->rholen, &ctx->rhopage)))
+		error("Out of memory");
+	first_touch(ctx->rho, ctx->rholen, ctx->rhopage);
+	ctx->rho[0].ones = DENOMINATOR;
+
+	if (nthreads > NAMPS / ROWBLOCK)
+		nthreads = NAMPS / ROWBLOCK;
+	if (nthreads < 1)
+		nthreads = 1;
+	if (!(pool = ctx->rhopool = calloc(1, sizeof(*pool)))
+			|| !(pool->workers = calloc(nthreads, sizeof(*pool->workers))))
+		error("Out of memory");
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->go, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (int i = 0; i < nthreads; i++)
+	{
+		struct rhoworker * w = &pool->workers[i];
+
+		w->pool = pool;
+		w->rho = ctx->rho;
+		w->first = (int)((long)i * NAMPS / nthreads);
+		w->end = (int)((long)(i + 1) * NAMPS / nthreads);
+		// the node holding the middle of the range, most of it when a node
+		// boundary falls inside
+		w->node = numa_node_at((size_t)(w->first + w->end) / 2 * NAMPS * sizeof(struct amp),
+				ctx->rholen, ctx->rhopage);
+		if (!(w->ctx = ctx_new()))
+			error("Out of memory");
+		if (pthread_create(&w->thread, NULL, rho_work, w))
+			error("Failed to start worker thread %d", i);
+		pool->nworkers++;
+	}
+}
+
+void rho_free(struct qsim_ctx * ctx)
+{
+	struct rhopool * pool = ctx->rhopool;
+
+	if (!ctx->rho)
+		return;
+	munmap(ctx->rho, ctx->rholen);
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->go);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->nworkers; i++)
+	{
+		pthread_join(pool->workers[i].thread, NULL);
+		ctx_free(pool->workers[i].ctx);
+	}
+	pthread_cond_destroy(&pool->go);
+	pthread_cond_destroy(&pool->done);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+// back to |0...0><0...0|
+void rho_reset(struct qsim_ctx * ctx)
+{
+	memset(ctx->rho, 0, (size_t)NAMPS * NAMPS * sizeof(struct amp));
+	ctx->rho[0].ones = DENOMINATOR;
+}
+
+static void transpose(struct amp * rho)
+{
+	for (int r0 = 0; r0 < NAMPS; r0 += TBLOCK)
+		for (int c0 = r0; c0 < NAMPS; c0 += TBLOCK)
+			for (int r = r0; r < r0 + TBLOCK; r++)
+				for (int c = c0 == r0? r + 1: c0; c < c0 + TBLOCK; c++)
+				{
+					struct amp temp = rho[(size_t)r * NAMPS + c];
+
+					rho[(size_t)r * NAMPS + c] = rho[(size_t)c * NAMPS + r];
+					rho[(size_t)c * NAMPS + r] = temp;
+				}
+}
+
+// runs g's kernel on every row of rho, and returns once all the workers are
+// done
+static void rows(struct qsim_ctx * ctx, const struct gate * g)
+{
+	struct rhopool * pool = ctx->rhopool;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->g = g;
+	pool->busy = pool->nworkers;
+	pool->pass++;
+	pthread_cond_broadcast(&pool->go);
+	while (pool->busy)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Applies a channel on qubit bit, given as the map sop from each 2 by 2 block
+// of rho on that qubit to sum K B K^T over its Kraus operators K, in one pass.
+// Blocks are the entries at one setting of the other qubits in the row and one
+// in the column, index 2a + b holding row bit a and column bit b.
+static void channel(struct amp * rho, const double sop[4][4], int bit)
+{
+	int m = ctrlbit(bit);
+
+	for (int r = 0; r < NAMPS; r++)
+	{
+		if (r & m)
+			continue;
+		for (int c = 0; c < NAMPS; c++)
+		{
+			struct amp * b[4];
+			struct amp x[4];
+
+			if (c & m)
+				continue;
+			b[0] = &rho[(size_t)r * NAMPS + c];
+			b[1] = &rho[(size_t)r * NAMPS + (c | m)];
+			b[2] = &rho[(size_t)(r | m) * NAMPS + c];
+			b[3] = &rho[(size_t)(r | m) * NAMPS + (c | m)];
+			for (int i = 0; i < 4; i++)
+				x[i] = *b[i];
+			for (int i = 0; i < 4; i++)
+			{
+				double ones = 0, root2s = 0;
+
+				for (int j = 0; j < 4; j++)
+				{
+					ones += sop[i][j] * x[j].ones;
+					root2s += sop[i][j] * x[j].root2s;
+				}
+				b[i]->ones = (int)lround(ones);
+				b[i]->root2s = (int)lround(root2s);
+			}
+		}
+	}
+}
+
+// applies the noise declared for g's type to each qubit g touches
+static void add_noise(struct qsim_ctx * ctx, const struct gate * g)
+{
+	int qubits = 0;
+
+	for (int n = 0; n < ctx->nnoise; n++)
+	{
+		double k[4][2][2];
+		double sop[4][4] = {{0}};
+		int nk;
+
+		if (ctx->noise[n].gate != g->type)
+			continue;
+		if (!qubits)
+			qubits = gate_qubits(g);
+
+		nk = noise_kraus(&ctx->noise[n], k);
+		for (int i = 0; i < nk; i++)
+			for (int ab = 0; ab < 4; ab++)
+				for (int cd = 0; cd < 4; cd++)
+					sop[ab][cd] += k[i][ab >> 1][cd >> 1] * k[i][ab & 1][cd & 1];
+
+		for (int q = 0; q < NQBITS; q++)
+			if (qubits & ctrlbit(q))
+				channel(ctx->rho, sop, q);
+	}
+}
+
+void rho_gate(struct qsim_ctx * ctx, const struct gate * g)
+{
+	rows(ctx, g);
+	transpose(ctx->rho);
+	rows(ctx, g);
+	if (ctx->flags & RUN_NOISY)
+		add_noise(ctx, g);
+}
+
+// Measures the bits of g together and returns the outcome, or forces g's
+// outcome under --postselect. rho is projected onto the outcome and scaled
+// back to trace 1.
+int rho_measure(struct qsim_ctx * ctx, const struct gate * g)
+{
+	struct amp * rho = ctx->rho;
+	double probs[NAMPS] = {0};
+	char keep[NAMPS];
+	double total = 0, factor;
+	int outcome = -1;
+
+	for (int i = 0; i < NAMPS; i++)
+		probs[outcome_of(i, g->bits, g->nbits)] += amp_value(rho[(size_t)i * NAMPS + i]);
+	for (int o = 0; o < 1 << g->nbits; o++)
+		if (probs[o] > 0)
+			total += probs[o];
+
+	if (ctx->flags & RUN_POSTSELECT && g->post >= 0)
+	{
+		outcome = g->post;
+		if (probs[outcome] <= 0)
+			error("Postselected outcome %d of qubit %d%s has probability 0",
+					outcome, g->bits[0], g->nbits > 1? " onwards": "");
+		ctx->weight *= probs[outcome];
+	}
+	else
+	{
+		double u = rng_double(&ctx->rng) * total;
+
+		for (int o = 0; o < 1 << g->nbits; o++)
+		{
+			if (probs[o] <= 0)
+				continue;
+			outcome = o;
+			if (u < probs[o])
+				break;
+			u -= probs[o];
+		}
+		if (outcome < 0)
+			error("Measured a state with no probability");
+	}
+
+	factor = 1 / probs[outcome];
+	for (int i = 0; i < NAMPS; i++)
+		keep[i] = outcome_of(i, g->bits, g->nbits) == outcome;
+	for (int r = 0; r < NAMPS; r++)
+		for (int c = 0; c < NAMPS; c++)
+		{
+			struct amp * a = &rho[(size_t)r * NAMPS + c];
+
+			if (keep[r] && keep[c])
+			{
+				a->ones = (int)lround(a->ones * factor);
+				a->root2s = (int)lround(a->root2s * factor);
+			}
+			else
+				a->ones = a->root2s = 0;
+		}
+	return outcome;
+}
+
+// the probability of each basis state, for print_probs()
+void rho_diag(const struct qsim_ctx * ctx, struct amp * diag)
+{
+	for (int i = 0; i < NAMPS; i++)
+		diag[i] = ctx->rho[(size_t)i * NAMPS + i];
+}
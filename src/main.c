@@ -1,391 +1,252 @@
-#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <limits.h>
 #include <errno.h>
-#include <ctype.h>
-#include <stdbool.h>
 #include <time.h>
 #include "main.h"
 
-struct amp state[NAMPS] = {{DENOMINATOR}};
-struct amp temp[NAMPS];
-
-// ctrl bits must come before bit
-void X2(int bit, int ctrl)
+static void usage(const char * prog)
 {
-	int size = NAMPS >> bit;
-	int half = size >> 1;
-	for (int i = 0; i < NAMPS; i += size)
-	{
-		if ((i & ctrl) != ctrl)
-			continue;
-
-		memcpy(temp, &state[i], half * sizeof(struct amp));
-		memcpy(&state[i], &state[i + half], half * sizeof(struct amp));
-		memcpy(&state[i + half], temp, half * sizeof(struct amp));
-	}
+	fprintf(stderr, "Usage: %s [--shots <n> | --branch | --stream | --density | --palette] [-j <threads>] [--seed <n>] [--postselect] [--numa] [-v] <file>\n"
+			"       %s [--stream] [--state-file <path>] [--seed <n>] [--postselect] [-v] <file>\n"
+			"       %s --shards <p> [--seed <n>] [--postselect] [-v] <file>\n"
+			"       %s --trajectories <n> [--tol <e>] [-j <threads>] [--seed <n>] [-v] <file>\n"
+			"       %s --batch <list> [-j <threads>] [--seed <n>]\n"
+			"       %s --compile <file> -o <out> [-v]\n", prog, prog, prog, prog, prog, prog);
+	exit(EXIT_FAILURE);
 }
 
-void X(int bit, int ctrl)
+static long parse_count(const char * prog, const char * opt, const char * s, long max)
 {
-	int jctrl = ctrl & ((1 << NQBITS - 1 - bit) - 1);
-	if (!jctrl)
-	{
-		X2(bit, ctrl);
-		return;
-	}
-
-	int ictrl = ctrl & ~jctrl;
-	int size = NAMPS >> bit;
-	int half = size >> 1;
-	for (int i = 0; i < NAMPS; i += size)
-	{
-		if ((i & ictrl) != ictrl)
-			continue;
-
-		for (int j = 0; j < half; j++)
-		{
-			struct amp temp;
-
-			if ((j & jctrl) != jctrl)
-				continue;
-
-			temp = state[i + j];
-			state[i + j] = state[i + half + j];
-			state[i + half + j] = temp;
-		}
-	}
+	char * endptr;
+	long l;
+
+	if (!s)
+		usage(prog);
+	l = strtol(s, &endptr, 10);
+	if (!*s || *endptr || l < 1 || l > max)
+		error("Bad value for %s: '%s'", opt, s);
+	return l;
 }
 
-void H(int bit, int ctrl)
+int main(int argc, char ** argv)
 {
-	int jctrl = ctrl & ((1 << NQBITS - 1 - bit) - 1);
-	int ictrl = ctrl & ~jctrl;
-	int size = NAMPS >> bit;
-	int half = size >> 1;
-	for (int i = 0; i < NAMPS; i += size)
-	{
-		if ((i & ictrl) != ictrl)
-			continue;
-
-		for (int j = 0; j < half; j++)
+	struct qsim_ctx * ctx;
+	const char * path = NULL;
+	const char * batch = NULL;
+	const char * compile = NULL;
+	const char * outpath = NULL;
+	const char * statefile = NULL;
+	int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	long shots = 0;
+	long trajectories = 0;
+	int shards = 0;
+	double tol = 0;
+	int branch = 0;
+	int stream = 0;
+	int density = 0;
+	int numa = 0;
+	int palette = 0;
+	int post = 0;
+	int verbose = 0;
+	const char * seed = NULL;
+	uint64_t seedval = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--batch") == 0)
 		{
-			struct amp temp;
-
-			if ((j & jctrl) != jctrl)
-				continue;
-
-			mult(&state[i + j], &iroot2);
-			mult(&state[i + half + j], &iroot2);
-
-			temp = state[i + j];
-			add(&state[i + j], &state[i + half + j]);
-			neg(&state[i + half + j]);
-			add(&state[i + half + j], &temp);
+			if (!(batch = argv[++i]))
+				usage(argv[0]);
 		}
-	}
-}
-
-void Z(int bit, int ctrl)
-{
-	int jctrl = ctrl & ((1 << NQBITS - 1 - bit) - 1);
-	int ictrl = ctrl & ~jctrl;
-	int size = NAMPS >> bit;
-	int half = size >> 1;
-	for (int i = 0; i < NAMPS; i += size)
-	{
-		if ((i & ictrl) != ictrl)
-			continue;
-
-		for (int j = 0; j < half; j++)
+		else if (strcmp(argv[i], "--compile") == 0)
 		{
-			if ((j & jctrl) != jctrl)
-				continue;
-
-			neg(&state[i + half + j]);
+			if (!(compile = argv[++i]))
+				usage(argv[0]);
 		}
-	}
-}
-
-// a < b
-// ctrl bits must come before b
-void SWAP2(int a, int b, int ctrl)
-{
-	int jctrl = ctrl & ((1 << NQBITS - 1 - a) - 1);
-	int ictrl = ctrl & ~jctrl;
-	int asize = NAMPS >> a;
-	int ahalf = asize >> 1;
-	int bsize = NAMPS >> b;
-	int bhalf = bsize >> 1;
-	for (int i = 0; i < NAMPS; i += asize)
-	{
-		if ((i & ictrl) != ictrl)
-			continue;
-
-		for (int j = bhalf; j < ahalf; j += bsize)
+		else if (strcmp(argv[i], "--state-file") == 0)
+		{
+			if (!(statefile = argv[++i]))
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "-o") == 0)
+		{
+			if (!(outpath = argv[++i]))
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "-j") == 0)
+		{
+			nthreads = (int)parse_count(argv[0], argv[i], argv[i + 1], 4096);
+			i++;
+		}
+		else if (strcmp(argv[i], "--shots") == 0)
 		{
-			if ((j & jctrl) != jctrl)
-				continue;
+			shots = parse_count(argv[0], argv[i], argv[i + 1], LONG_MAX);
+			i++;
+		}
+		else if (strcmp(argv[i], "--trajectories") == 0)
+		{
+			trajectories = parse_count(argv[0], argv[i], argv[i + 1], LONG_MAX);
+			i++;
+		}
+		else if (strcmp(argv[i], "--shards") == 0)
+		{
+			shards = (int)parse_count(argv[0], argv[i], argv[i + 1], MAXSHARDBITS);
+			i++;
+		}
+		else if (strcmp(argv[i], "--tol") == 0)
+		{
+			char * endptr;
 
-			memcpy(temp, &state[i + j], bhalf * sizeof(struct amp));
-			memcpy(&state[i + j], &state[i + ahalf + j - bhalf], bhalf * sizeof(struct amp));
-			memcpy(&state[i + ahalf + j - bhalf], temp, bhalf * sizeof(struct amp));
+			if (!argv[++i])
+				usage(argv[0]);
+			tol = strtod(argv[i], &endptr);
+			if (!*argv[i] || *endptr || !(tol > 0))
+				error("Bad value for --tol: '%s'", argv[i]);
 		}
+		else if (strcmp(argv[i], "--branch") == 0)
+			branch = 1;
+		else if (strcmp(argv[i], "--stream") == 0)
+			stream = 1;
+		else if (strcmp(argv[i], "--density") == 0)
+			density = 1;
+		else if (strcmp(argv[i], "--palette") == 0)
+			palette = 1;
+		else if (strcmp(argv[i], "--numa") == 0)
+			numa = 1;
+		else if (strcmp(argv[i], "--postselect") == 0)
+			post = 1;
+		else if (strcmp(argv[i], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[i], "--seed") == 0)
+		{
+			if (!(seed = argv[++i]))
+				usage(argv[0]);
+		}
+		else if (argv[i][0] == '-' || path)
+			usage(argv[0]);
+		else
+			path = argv[i];
 	}
 
-}
-
-// like an X, but half one bit and half another
-void SWAP(int a, int b, int ctrl)
-{
-	if (b < a)
+	if (seed)
 	{
-		a ^= b;
-		b ^= a;
-		a ^= b;
+		char * endptr;
+		unsigned long long ull = strtoull(seed, &endptr, 0);
+
+		if (!*seed || *endptr)
+			error("Bad value for --seed: '%s'", seed);
+		seedval = ull;
 	}
 
-	int kctrl = ctrl & ((1 << NQBITS - 1 - b) - 1);
-	if (!kctrl)
+	if (batch)
 	{
-		SWAP2(a, b, ctrl);
-		return;
+		if (path)
+			usage(argv[0]);
+		return run_batch(batch, nthreads, seed? seedval: (uint64_t)time(NULL))? EXIT_FAILURE: EXIT_SUCCESS;
 	}
-
-	int jctrl = ctrl & ~kctrl & ((1 << NQBITS - 1 - a) - 1);
-	int ictrl = ctrl & ~(jctrl & kctrl);
-	int asize = NAMPS >> a;
-	int ahalf = asize >> 1;
-	int bsize = NAMPS >> b;
-	int bhalf = bsize >> 1;
-	for (int i = 0; i < NAMPS; i += asize)
+	if (compile)
 	{
-		if ((i & ictrl) != ictrl)
-			continue;
-
-		for (int j = bhalf; j < ahalf; j += bsize)
-		{
-			if ((j & jctrl) != jctrl)
-				continue;
-
-			for (int k = 0; k < bhalf; k++)
-			{
-				struct amp temp;
-
-				if ((k & kctrl) != kctrl)
-					continue;
-
-				temp = state[i + j + k];
-				state[i + j + k] = state[i + ahalf + j - bhalf + k];
-				state[i + ahalf + j - bhalf + k] = temp;
-			}
-		}
+		if (path || !outpath)
+			usage(argv[0]);
+		if (!(ctx = ctx_new()))
+			error("Out of memory");
+		if (verbose)
+			ctx->flags |= RUN_VERBOSE;
+		path_parse_circuit(ctx, compile);
+		compile_circuit(ctx, outpath);
+		ctx_free(ctx);
+		return EXIT_SUCCESS;
 	}
-}
+	if (!path || outpath || !!shots + branch + stream + density + palette + !!trajectories + !!shards > 1
+			|| tol && !trajectories || post && trajectories
+			|| statefile && (shots || branch || density || palette || trajectories || shards))
+		usage(argv[0]);
 
-int measure(int bit)
-{
-	static int seeded = false;
-	int size = NAMPS >> bit;
-	int half = size >> 1;
-	int newval;
+	if (!(ctx = ctx_new()))
+		error("Out of memory");
 
-	struct amp prob = {0};
-	for (int i = 0; i < NAMPS; i += size)
+	if (seed)
 	{
-		for (int j = half; j < size; j++)
-		{
-			struct amp temp = state[i + j];
-
-			mult(&temp, &temp);
-			add(&prob, &temp);
-		}
+		ctx->seed = seedval;
+		rng_seed(&ctx->rng, seedval);
 	}
 
-	if (!seeded)
-		srand(time(NULL));
-
-	// measure
-	int isone = (double)rand()/RAND_MAX < (double)prob.ones/DENOMINATOR;
+	if (post)
+		ctx->flags |= RUN_POSTSELECT;
+	if (verbose)
+		ctx->flags |= RUN_VERBOSE;
+	if (statefile)
+		state_map(ctx, statefile);
+	ctx->shardbits = shards;
 
-	// sqrt log2, assume prob is power of 2
-	int tz = isone? ctz(prob.ones): ctz(DENOMINATOR - prob.ones);
-	int scale = DENOMINATOR_BITS/2 - tz/2;
-	int scalestart = isone * half;
-	for (int i = 0; i < NAMPS; i += size)
+	if (stream)
 	{
-		for (int j = scalestart; j < scalestart + half; j++)
-		{
-			state[i + j].ones <<= scale;
-			state[i + j].root2s <<= scale;
+		FILE * in;
 
-			if (tz & 1)
-				mult(&state[i + j], &iroot2);
-		}
-		for (int j = half - scalestart; j < half*2 - scalestart; j++)
+		if (!(in = fopen(path, "r")))
+			error("Failed to open %s: %s", path, strerror(errno));
+		if (numa)
+			print_placement(stderr, ctx);
+		puts("");
+		// a compiled circuit has no parsing to overlap with
+		if (is_compiled(in))
 		{
-			state[i + j].ones = 0;
-			state[i + j].root2s = 0;
+			parse_circuit(ctx, in);
+			run(ctx, ctx->gates, ctx->ngates, 0);
 		}
+		else
+			run_stream(ctx, in);
+		fclose(in);
+		if (post)
+			printf("Postselection weight: %lf\n", ctx->weight);
+		if (statefile && verbose)
+			fprintf(stderr, "State file: %zu bytes paged through\n", ctx->iobytes);
+		ctx_free(ctx);
+		return EXIT_SUCCESS;
 	}
-			
-	return isone;
-}
 
-int hash_args(int bits, const int * args, int argc)
-{
-	int hash = 0;
-	for (int i = 0; i < argc; i++)
+	path_parse_circuit(ctx, path);
+	if (density)
 	{
-		hash <<= 1;
-		hash |= !!(bits & (1 << NQBITS - 1 >> args[i]));
+		rho_init(ctx, nthreads);
+		ctx->flags |= RUN_NOISY;
 	}
-	return hash;
-}
+	if (numa)
+		print_placement(stderr, ctx);
 
-// this is very similar to CX, except uses f in addition to ctrl
-void Uf(int bit, struct func * func, const int * args, int ctrl)
-{
-	int jctrl = ctrl & ((1 << NQBITS - 1 - bit) - 1);
-	int ictrl = ctrl & ~jctrl;
-	int size = NAMPS >> bit;
-	int half = size >> 1;
-	for (int i = 0; i < NAMPS; i += size)
+	puts("");
+	if (shots)
 	{
-		if ((i & ictrl) != ictrl)
-			continue;
-
-		for (int j = 0; j < half; j++)
-		{
-			struct amp temp;
-
-			if ((j & jctrl) != jctrl)
-				continue;
-			if (!func->map[hash_args(i + j, args, func->argc)])
-				continue;
-
-			temp = state[i + j];
-			state[i + j] = state[i + half + j];
-			state[i + half + j] = temp;
-		}
+		run_shots(ctx, shots, nthreads);
+		if (post)
+			printf("Postselection weight: %lf\n", ctx->weight);
 	}
-}
-
-static void copy_state(struct amp a[NAMPS], const struct amp b[NAMPS])
-{
-	memcpy(a, b, NAMPS * sizeof(struct amp));
-}
-
-static void to_probs(struct amp * s)
-{
-	for (int i = 0; i < NAMPS; i++)
-		mult(&s[i], &s[i]);
-}
-
-// TODO Not sure if this is most efficient or convenient
-static void merge_bits(int bits, struct amp * s)
-{
-	int size = NAMPS;
-
-	for (int i = 0; i < NQBITS; i++)
+	else if (branch)
+		run_branches(ctx, nthreads);
+	else if (trajectories)
+		run_trajectories(ctx, trajectories, tol, nthreads);
+	else if (shards)
 	{
-		int half = size >> 1;
-
-		if (bits & half)
-		{
-			for (int j = 0; j < NAMPS; j += size)
-				for (int k = 0; k < half; k++)
-					add(&s[j + k], &s[j + k + half]);
-
-		}
-		size = half;
+		run_sharded(ctx, shards);
+		if (post)
+			printf("Postselection weight: %lf\n", ctx->weight);
 	}
-}
-
-void run(struct gate * gates, int ngates, int start)
-{
-	for (int i = start; i < ngates; i++)
+	else if (palette)
 	{
-		gates[i].cnt++;
-		switch (gates[i].type)
-		{
-			case GATE_X:
-				X(gates[i].bits[0], gates[i].ctrl);
-				break;
-			case GATE_H:
-				H(gates[i].bits[0], gates[i].ctrl);
-				break;
-			case GATE_Uf:
-				Uf(gates[i].bits[gates[i].func->argc], gates[i].func, gates[i].bits, gates[i].ctrl);
-				break;
-			case GATE_Z:
-				Z(gates[i].bits[0], gates[i].ctrl);
-				break;
-			case GATE_SWAP:
-				SWAP(gates[i].bits[0], gates[i].bits[1], gates[i].ctrl);
-				break;
-			case GATE_MEASURE:
-				gates[i].mstate = measure(gates[i].bits[0])? MSTATE_1: MSTATE_0;
-				break;
-			case GATE_BARRIER_BEGIN:
-				while (gates[i].barrier.end)
-				{
-					for (int j = 0; j < gates[i].barrier.repeat; j++)
-						run(gates, ngates, i + 1);
-					i = gates[i].barrier.end;
-				}
-				break;
-			case GATE_BARRIER_END:
-				return;
-			case GATE_PAUSE:
-				getc(stdin);
-				break;
-			case GATE_DRAW:
-				print_circuit(gates, ngates);
-				puts("");
-				break;
-			case GATE_STATE:
-				copy_state(temp, state);
-				merge_bits(~gates[i].ctrl, temp);
-				print_state(gates[i].ctrl, temp);
-				puts("");
-				break;
-			case GATE_PROBS:
-				copy_state(temp, state);
-				to_probs(temp);
-				merge_bits(~gates[i].ctrl, temp);
-				print_probs(gates[i].ctrl, temp);
-				puts("");
-				break;
-			case GATE_PFUNC:
-				print_func(gates[i].func);
-				puts("");
-				break;
-			default:
-				error("Strange gate type: %d", gates[i].type);
-		}
+		run_palette(ctx);
+		if (post)
+			printf("Postselection weight: %lf\n", ctx->weight);
 	}
-}
-
-int main(int argc, char ** argv)
-{
-	FILE * in;
-	struct gate gates[MAXGATES] = {0};
-	int ngates;
-
-	if (argc != 2)
+	else
 	{
-		fprintf(stderr, "Usage: %s <file>\n", argv[0]);
-		return EXIT_FAILURE;
+		run(ctx, ctx->gates, ctx->ngates, 0);
+		if (post)
+			printf("Postselection weight: %lf\n", ctx->weight);
+		if (statefile && verbose)
+			fprintf(stderr, "State file: %zu bytes paged through\n", ctx->iobytes);
 	}
-
-	if (!(in = fopen(argv[1], "r")))
-		error("Failed to read input file");
-	
-	ngates = parse_circuit(gates, in);
-	fclose(in);
-
-	puts("");
-	run(gates, ngates, 0);
+	ctx_free(ctx);
 }
@@ -3,32 +3,76 @@
 
 #define NQBITS 10
 #define FMAXOPS 128
-#define BUFSIZE 64
-#define MAXGATES 128
-#define VALID_GATES "X, H, Z, W (SWAP), U (boolean function), M (measure)"
+#define FMAXANF 64 // most ANF terms kept for a function
+#define VALID_GATES "X, H, Z, W (SWAP), U (boolean function), P (phase oracle), D (diffusion), F (Walsh-Hadamard transform), G (matrix), M (measure)"
 #define NFUNCS 8
+#define NMATS 8
+#define GMAXSIZE 32 // side of the largest matrix gate, for 5 qubits
+#define NNOISE 16
+#define MAXSHARDBITS 4 // leaves every shard at least 64 amplitudes for Uf_table
 #define FRACBUFSIZ 32
 #define DENOMINATOR_BITS 30
 #define DENOMINATOR (1 << DENOMINATOR_BITS)
-#define PRIMAXCOLS MAXGATES
+#define SQRT2 1.4142135623730951
+#define PRIMAXCOLS 128
 #define NAMPS (1 << NQBITS)
+#define NBARRIERS 27 // named a-z and anonymous, the deepest barriers can nest
+
+#define ERRBUFSIZ 512
+
+#include <stdint.h>
+#include <setjmp.h>
 
 #ifdef _MSC_VER
 #include <intrin.h>
+#define THREAD_LOCAL __declspec(thread)
+#define NORETURN __declspec(noreturn)
+#else
+#define THREAD_LOCAL _Thread_local
+#define NORETURN __attribute__((noreturn))
 #endif
 
-#define error(MSG, ...) (fprintf(stderr, MSG "\n", ##__VA_ARGS__), exit(EXIT_FAILURE))
+// Reports MSG. Jumps back to the active qsim_ctx if there is one, else exits.
+#define error(MSG, ...) qsim_fail(MSG, ##__VA_ARGS__)
 
+// map holds a bit per input, set where f is nonzero. vals keeps the values
+// themselves for printing, and is NULL when they are all 0 or 1. anf lists the
+// terms of map's algebraic normal form, each the inputs it multiplies, and is
+// NULL when there are more than FMAXANF.
 struct func {
 	int name;
-	int map[NAMPS];
+	uint64_t map[(NAMPS + 63) / 64];
+	int * vals;
 	int argc;
+	int nones; // inputs where f is nonzero
+	int nanf;
+	int * anf;
+};
+
+static inline int func_bit(const struct func * f, int x)
+{
+	return f->map[x >> 6] >> (x & 63) & 1;
+}
+
+static inline int func_val(const struct func * f, int x)
+{
+	return f->vals? f->vals[x]: func_bit(f, x);
+}
+
+// a matrix gate on k qubits, 2^k by 2^k entries by rows, the first qubit
+// selecting the most significant half
+struct gmat {
+	int name;
+	int k;
+	struct amp * m;
 };
 
-extern struct func funcs[NFUNCS];
+struct qsim_ctx;
 
-void parse_func(const char *, int);
-void print_func(const struct func *);
+void parse_matrix(struct qsim_ctx *, const char *, int, int);
+void parse_func(struct qsim_ctx *, const char *, int);
+void analyze_func(struct func *);
+void print_func(FILE *, const struct func *);
 
 enum gatetype {
 	GATE_NONE,
@@ -37,6 +81,10 @@ enum gatetype {
 	GATE_Uf,
 	GATE_Z,
 	GATE_SWAP,
+	GATE_Pf,
+	GATE_D,
+	GATE_F,
+	GATE_G,
 	GATE_MEASURE,
 	GATE_BARRIER_BEGIN,
 	GATE_BARRIER_END,
@@ -47,10 +95,62 @@ enum gatetype {
 	GATE_PFUNC
 };
 
+// A noise channel, applied after every gate of type gate to each qubit it
+// touches, controls included. readout is only for M, and flips the outcome it
+// records instead.
+enum channel {
+	CH_DEPOLARIZE,
+	CH_DAMP,
+	CH_DEPHASE,
+	CH_FLIP,
+	CH_READOUT
+};
+
+struct noise {
+	enum gatetype gate;
+	enum channel channel;
+	double p;
+};
+
+// ctype without the locale lookup, as these run on every character
+static inline int is_space(int c)
+{
+	return c == ' ' || (unsigned)(c - '\t') < 5;
+}
+
+static inline int is_digit(int c)
+{
+	return (unsigned)(c - '0') < 10;
+}
+
+static inline int is_lower(int c)
+{
+	return (unsigned)(c - 'a') < 26;
+}
+
+static inline int is_command(enum gatetype type)
+{
+	return type >= GATE_PAUSE;
+}
+
+static inline int is_unitary(enum gatetype type)
+{
+	return type != GATE_NONE && type < GATE_MEASURE;
+}
+
+// how a Uf or Pf gate runs: scanning the truth table, visiting the inputs where f
+// is nonzero, as one multi-controlled X per term of the ANF, or for a Uf with
+// several outputs, swapping each index with the one f's value XORs it to
+enum ufmode {
+	UF_TABLE,
+	UF_SPARSE,
+	UF_ANF,
+	UF_PERM
+};
+
 enum mstate {
 	MSTATE_UNKNOWN,
-	MSTATE_0,
-	MSTATE_1
+	MSTATE_KNOWN
 };
 
 struct gate {
@@ -62,39 +162,179 @@ struct gate {
 			int name;
 			int end;
 			int repeat;
-			struct gate * prev;
+			int prev; // enclosing barrier while parsing, or -1
 		} barrier;
 	};
 	union {
-		struct func * func;
-		enum mstate mstate;
+		struct {
+			struct func * func;
+			enum ufmode ufmode;
+			int nout; // outputs of U after its inputs in bits, or 0 for a single target
+		};
+		struct gmat * mat;
+		size_t funcidx; // func or mat in a compiled circuit, before relocation
+		struct {
+			enum mstate mstate;
+			int mval;  // last outcome, bits[0] most significant
+			int nbits; // measured together, or the register of D or F
+			int post;  // outcome to force under --postselect, or -1
+		};
 	};
 	int cnt;
 };
 
-static const enum gatetype gatemap[0xff] =
+static const enum gatetype gatemap[0x100] =
 {
 	['X'] = GATE_X,
 	['H'] = GATE_H,
 	['U'] = GATE_Uf,
 	['Z'] = GATE_Z,
 	['W'] = GATE_SWAP,
+	['P'] = GATE_Pf,
+	['D'] = GATE_D,
+	['F'] = GATE_F,
+	['G'] = GATE_G,
 	['M'] = GATE_MEASURE,
 };
 
-#define rgatemap "\0XHUZWM"
+#define rgatemap "\0XHUZWPDFGM"
 
 struct amp {
 	int ones;
 	int root2s;
 };
 
-int parse_circuit(struct gate *, FILE *);
-void print_circuit(const struct gate *, int ngates);
-void print_state(int, struct amp *);
-void print_probs(int, struct amp *);
+enum rngkind {
+	RNG_XOSHIRO,
+	RNG_PHILOX
+};
+
+struct rng {
+	enum rngkind kind;
+	union {
+		uint64_t s[4]; // xoshiro256**
+		struct philox {
+			uint32_t key[2];
+			uint32_t ctr[4];
+		} philox;
+	};
+};
+
+enum runflags {
+	RUN_QUIET = 1,     // skip commands
+	RUN_NOMEASURE = 2, // skip measurements, leaving the state unprojected
+	RUN_POSTSELECT = 4, // force measurements given an outcome with M q = v
+	RUN_VERBOSE = 8,    // report how Uf and Pf gates are run
+	RUN_NOISY = 16      // apply the circuit's noise channels
+};
+
+struct qsim_ctx {
+	struct amp * state;
+	int namps; // the kernels run over, NAMPS or a shard's under --shards
+	int shardbits; // p under --shards, which the parser checks gates against, or 0
+	struct amp * temp;
+	struct func funcs[NFUNCS];
+	struct gmat mats[NMATS];
+	struct noise noise[NNOISE];
+	int nnoise;
+	struct amp * rho; // density matrix by rows under --density, else NULL
+	size_t rholen, rhopage; // of its mapping, from huge_alloc()
+	struct rhopool * rhopool; // workers running kernels on its rows
+	char * statemap; // file mapping state and temp live in under --state-file
+	size_t statelen;
+	size_t iobytes; // of the state file paged through so far
+	struct gate * gates; // borrowed from map when gatecap is 0
+	int ngates, gatecap;
+	struct rng rng;
+	uint64_t seed;
+	unsigned flags;
+	int mmask, mvals; // qubits measured so far and their last outcomes
+	double weight; // probability of the postselected outcomes so far
+	FILE * out; // where commands print
+	char * line; // line being parsed
+	size_t linecap;
+	char * map; // input being parsed, or the compiled circuit being run
+	size_t maplen;
+	jmp_buf jmp;
+	char errmsg[ERRBUFSIZ];
+};
+
+// where run_until() is in the circuit, with the repeat blocks it is inside
+struct cursor {
+	int pc;
+	int depth;
+	struct frame {
+		int begin;
+		int left;
+	} stack[NBARRIERS];
+};
+
+// ctx that error() jumps back to on this thread, if any
+extern THREAD_LOCAL struct qsim_ctx * qsim_active;
+
+NORETURN void qsim_fail(const char *, ...);
 
-extern struct amp state[NAMPS];
+struct qsim_ctx * ctx_new(void);
+void ctx_free(struct qsim_ctx *);
+void ctx_reset(struct qsim_ctx *);
+void ctx_reserve(struct qsim_ctx *, int ngates);
+void ctx_copy_gates(struct qsim_ctx *, const struct qsim_ctx *);
+
+struct stream;
+void parse_circuit(struct qsim_ctx *, FILE *);
+void path_parse_circuit(struct qsim_ctx *, const char *);
+void stream_parse_circuit(struct qsim_ctx *, FILE *, struct stream *);
+void stream_push(struct stream *, const struct gate *, int n);
+void run_stream(struct qsim_ctx *, FILE *);
+void compile_circuit(struct qsim_ctx *, const char * path);
+int is_compiled(FILE *);
+void load_compiled(struct qsim_ctx *, FILE *);
+void measure_probs(struct qsim_ctx *, const int * bits, int nbits, int * probs);
+void project(struct qsim_ctx *, const int * bits, int nbits, int outcome, int prob);
+int measure(struct qsim_ctx *, const int * bits, int nbits);
+int postselect(struct qsim_ctx *, const int * bits, int nbits, int outcome);
+void plan_Uf(struct qsim_ctx *, struct gate *, const char * where, int n);
+void apply_unitary(struct qsim_ctx *, const struct gate *);
+void parse_noise(struct qsim_ctx *, const char *, int, int);
+int noise_kraus(const struct noise *, double k[4][2][2]);
+int gate_qubits(const struct gate *);
+int readout(struct qsim_ctx *, int outcome, int nbits);
+void state_map(struct qsim_ctx *, const char * path);
+size_t state_io(const struct gate *);
+int numa_nodes(void);
+void numa_pin(int node);
+void numa_unpin(void);
+int numa_node_at(size_t off, size_t len, size_t page);
+void * huge_alloc(size_t * len, size_t * page);
+void first_touch(void *, size_t len, size_t page);
+void print_placement(FILE *, const struct qsim_ctx *);
+void rho_init(struct qsim_ctx *, int nthreads);
+void rho_free(struct qsim_ctx *);
+void rho_reset(struct qsim_ctx *);
+void rho_gate(struct qsim_ctx *, const struct gate *);
+int rho_measure(struct qsim_ctx *, const struct gate *);
+void rho_diag(const struct qsim_ctx *, struct amp * diag);
+void run(struct qsim_ctx *, struct gate *, int ngates, int start);
+void cursor_init(struct cursor *, int start);
+int run_step(struct qsim_ctx *, struct gate *, int ngates, struct cursor *);
+int run_until(struct qsim_ctx *, struct gate *, int ngates, struct cursor *, enum gatetype stop);
+struct pool;
+typedef void pool_fn(struct pool *, void * arg, int job, int worker);
+void pool_run(int nthreads, int njobs, pool_fn *, void * arg);
+void pool_push(struct pool *, int worker, int job);
+
+int run_batch(const char *, int nthreads, uint64_t seed);
+void run_shots(struct qsim_ctx *, long shots, int nthreads);
+void run_branches(struct qsim_ctx *, int nthreads);
+void run_sharded(struct qsim_ctx *, int p);
+void check_shard_width(const struct gate *, int p, const char * where, int n);
+void run_palette(struct qsim_ctx *);
+void run_trajectories(struct qsim_ctx *, long max, double tol, int nthreads);
+
+void print_circuit(FILE *, const struct gate *, int ngates);
+void print_state(FILE *, int, struct amp *);
+void print_probs(FILE *, int, struct amp *);
+void print_rho(FILE *, int, const struct amp *);
 
 static const struct amp iroot2 = {0, DENOMINATOR >> 1};
 
@@ -116,17 +356,121 @@ static inline void add(struct amp * a, const struct amp * b)
 	a->root2s += b->root2s;
 }
 
+// the real number a stands for
+static inline double amp_value(struct amp a)
+{
+	return (a.ones + a.root2s * SQRT2) / DENOMINATOR;
+}
+
 static inline void neg(struct amp * a)
 {
 	a->ones = -a->ones;
 	a->root2s = -a->root2s;
 }
 
+static inline uint64_t rotl(uint64_t x, int k)
+{
+	return x << k | x >> 64 - k;
+}
+
+static inline uint32_t mulhilo(uint32_t a, uint32_t b, uint32_t * hi)
+{
+	uint64_t p = (uint64_t)a * b;
+	*hi = (uint32_t)(p >> 32);
+	return (uint32_t)p;
+}
+
+// Philox4x32-10. Counter based, so any stream can be started anywhere
+// without stepping through the ones before it.
+static inline uint64_t philox_next(struct philox * p)
+{
+	uint32_t c[4] = {p->ctr[0], p->ctr[1], p->ctr[2], p->ctr[3]};
+	uint32_t k0 = p->key[0], k1 = p->key[1];
+
+	for (int i = 0; i < 10; i++)
+	{
+		uint32_t hi0, hi1;
+		uint32_t lo0 = mulhilo(0xD2511F53, c[0], &hi0);
+		uint32_t lo1 = mulhilo(0xCD9E8D57, c[2], &hi1);
+
+		c[0] = hi1 ^ c[1] ^ k0;
+		c[1] = lo1;
+		c[2] = hi0 ^ c[3] ^ k1;
+		c[3] = lo0;
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+	if (!++p->ctr[0])
+		p->ctr[1]++;
+	// half the block is thrown away to keep the state this small
+	return (uint64_t)c[0] << 32 | c[1];
+}
+
+// stream is typically the shot number, so each shot's draws do not depend
+// on which thread runs it
+static inline void rng_philox(struct rng * rng, uint64_t seed, uint64_t stream)
+{
+	rng->kind = RNG_PHILOX;
+	rng->philox.key[0] = (uint32_t)seed;
+	rng->philox.key[1] = (uint32_t)(seed >> 32);
+	rng->philox.ctr[0] = 0;
+	rng->philox.ctr[1] = 0;
+	rng->philox.ctr[2] = (uint32_t)stream;
+	rng->philox.ctr[3] = (uint32_t)(stream >> 32);
+}
+
+static inline uint64_t rng_next(struct rng * rng)
+{
+	uint64_t * s = rng->s;
+
+	if (rng->kind == RNG_PHILOX)
+		return philox_next(&rng->philox);
+
+	uint64_t result = rotl(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return result;
+}
+
+// uniform in [0, 1)
+static inline double rng_double(struct rng * rng)
+{
+	return (rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+// expand seed with splitmix64 so nearby seeds give unrelated streams
+static inline void rng_seed(struct rng * rng, uint64_t seed)
+{
+	rng->kind = RNG_XOSHIRO;
+	for (int i = 0; i < 4; i++)
+	{
+		uint64_t z = (seed += 0x9e3779b97f4a7c15);
+		z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9;
+		z = (z ^ z >> 27) * 0x94d049bb133111eb;
+		rng->s[i] = z ^ z >> 31;
+	}
+}
+
 static inline int ctrlbit(int idx)
 {
 	return 1 << NQBITS - 1 >> idx;
 }
 
+// value of the measured bits in index i, bits[0] most significant
+static inline int outcome_of(int i, const int * bits, int nbits)
+{
+	int o = 0;
+	for (int b = 0; b < nbits; b++)
+		o = o << 1 | !!(i & ctrlbit(bits[b]));
+	return o;
+}
+
 static inline int popcount(int x)
 {
 	#ifdef __GNUC__
@@ -171,4 +515,19 @@ static inline int ctz(int x)
 	#endif
 }
 
+static inline int ctz64(uint64_t x)
+{
+	#ifdef __GNUC__
+	return x? __builtin_ctzll(x): 64;
+	#elif _MSC_VER
+	unsigned long idx;
+	return _BitScanForward64(&idx, x)? (int)idx: 64;
+	#else
+	for (int i = 0; i < 64; i++)
+		if (x >> i & 1)
+			return i;
+	return 64;
+	#endif
+}
+
 #endif
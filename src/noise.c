@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "main.h"
+
+// Noise is declared per gate type, one channel per line:
+//	noise H depolarize 0.01
+//	noise M readout 0.02
+// A gate type can have several channels, which apply in the order given.
+
+static const char * const channames[] = {"depolarize", "damp", "dephase", "flip", "readout"};
+#define NCHANNELS (int)(sizeof(channames) / sizeof(*channames))
+
+void parse_noise(struct qsim_ctx * ctx, const char * s, int sidx, int lineno)
+{
+	struct noise * n;
+	enum gatetype type;
+	char * endptr;
+	int start;
+	int ch;
+
+	if (ctx->nnoise == NNOISE)
+		error("Line %d: More than %d noise channels", lineno, NNOISE);
+	n = &ctx->noise[ctx->nnoise];
+
+	sidx += 5; // past "noise"
+	while (is_space(s[sidx]))
+		sidx++;
+	type = (unsigned char)s[sidx] < 0x80? gatemap[(unsigned char)s[sidx]]: GATE_NONE;
+	if (!type || s[sidx + 1] && !is_space(s[sidx + 1]))
+		error("Line %d: Expected gate type after noise. Valid gates are: %s\n%s\n%*s~~~ Here",
+				lineno, VALID_GATES, s, sidx + 1, "^");
+	sidx++;
+
+	while (is_space(s[sidx]))
+		sidx++;
+	start = sidx;
+	while (is_lower(s[sidx]))
+		sidx++;
+	for (ch = 0; ch < NCHANNELS; ch++)
+		if (sidx - start == (int)strlen(channames[ch]) && !strncmp(s + start, channames[ch], sidx - start))
+			break;
+	if (ch == NCHANNELS)
+		error("Line %d: Unknown noise channel\n%s\n%*s~~~ What's that?\n"
+				"Available channels are: depolarize, damp, dephase, flip, readout",
+				lineno, s, start + 1, "^");
+	if ((ch == CH_READOUT) != (type == GATE_MEASURE))
+		error("Line %d: M only takes readout noise, and readout only goes on M\n%s\n%*s~~~ Here",
+				lineno, s, start + 1, "^");
+
+	while (is_space(s[sidx]))
+		sidx++;
+	n->p = strtod(s + sidx, &endptr);
+	if (endptr == s + sidx || !(n->p >= 0 && n->p <= 1))
+		error("Line %d: Expected a probability from 0 to 1\n%s\n%*s~~~ Here",
+				lineno, s, sidx + 1, "^");
+	sidx = endptr - s;
+
+	while (is_space(s[sidx]))
+		sidx++;
+	if (s[sidx] && s[sidx] != '#')
+		error("Line %d: Unexpected token\n%s\n%*s~~~ What's that?",
+				lineno, s, sidx + 1, "^");
+
+	n->gate = type;
+	n->channel = ch;
+	ctx->nnoise++;
+}
+
+// Fills k with the Kraus operators of n and returns how many there are. They
+// are all real: Y's term is written as XZ, which gives the same Y rho Y.
+int noise_kraus(const struct noise * n, double k[4][2][2])
+{
+	double p = n->p;
+
+	memset(k, 0, 4 * sizeof(*k));
+	switch (n->channel)
+	{
+		case CH_DEPOLARIZE:
+			k[0][0][0] = k[0][1][1] = sqrt(1 - p);
+			k[1][0][1] = k[1][1][0] = sqrt(p / 3);
+			k[2][1][0] = sqrt(p / 3);
+			k[2][0][1] = -sqrt(p / 3);
+			k[3][0][0] = sqrt(p / 3);
+			k[3][1][1] = -sqrt(p / 3);
+			return 4;
+		case CH_DAMP:
+			k[0][0][0] = 1;
+			k[0][1][1] = sqrt(1 - p);
+			k[1][0][1] = sqrt(p);
+			return 2;
+		case CH_DEPHASE:
+			k[0][0][0] = k[0][1][1] = sqrt(1 - p);
+			k[1][0][0] = sqrt(p);
+			k[1][1][1] = -sqrt(p);
+			return 2;
+		case CH_FLIP:
+			k[0][0][0] = k[0][1][1] = sqrt(1 - p);
+			k[1][0][1] = k[1][1][0] = sqrt(p);
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+// flips each bit of a measured outcome of nbits with M's readout noise
+int readout(struct qsim_ctx * ctx, int outcome, int nbits)
+{
+	for (int n = 0; n < ctx->nnoise; n++)
+		if (ctx->noise[n].gate == GATE_MEASURE)
+			for (int b = 0; b < nbits; b++)
+				if (rng_double(&ctx->rng) < ctx->noise[n].p)
+					outcome ^= 1 << b;
+	return outcome;
+}
+
+// the qubits g acts on, controls included, as ctrlbit()s
+int gate_qubits(const struct gate * g)
+{
+	int n = 1, mask = g->ctrl;
+
+	switch (g->type)
+	{
+		case GATE_SWAP:
+			n = 2;
+			break;
+		case GATE_Uf:
+			n = g->func->argc + (g->nout? g->nout: 1);
+			break;
+		case GATE_Pf:
+			n = g->func->argc;
+			break;
+		case GATE_D:
+		case GATE_F:
+		case GATE_MEASURE:
+			n = g->nbits;
+			break;
+		case GATE_G:
+			n = g->mat->k;
+			break;
+		default:
+			break;
+	}
+	for (int b = 0; b < n; b++)
+		mask |= ctrlbit(g->bits[b]);
+	return mask;
+}
@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "main.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define HUGE_2MB ((size_t)1 << 21)
+#define HUGE_1GB ((size_t)1 << 30)
+#define MAXNODES 64
+
+// Large buffers are mapped from huge pages, so a kernel sweeping them takes a
+// TLB miss every 2 MB or 1 GB instead of every 4 kB. Each is split into one
+// contiguous range of pages per NUMA node, which a thread pinned to that node
+// writes first, so the kernel places the range in that node's memory. Threads
+// working on the buffer later pin themselves to the node of the range they
+// work on, going by numa_node_at().
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int nnodes;
+static int nodeids[MAXNODES];
+static cpu_set_t nodecpus[MAXNODES];
+static cpu_set_t allcpus; // the affinity the process started with
+
+// parses a cpulist like "0-3,8,10-11" into set
+static void parse_cpulist(const char * s, cpu_set_t * set)
+{
+	CPU_ZERO(set);
+	while (*s >= '0' && *s <= '9')
+	{
+		char * end;
+		long lo = strtol(s, &end, 10), hi = lo;
+
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		for (long c = lo; c <= hi && c < CPU_SETSIZE; c++)
+			CPU_SET(c, set);
+		s = *end == ','? end + 1: end;
+	}
+}
+
+// finds the nodes with CPUs this process may run on, or else makes one node
+// of all of them
+static void read_nodes(void)
+{
+	if (sched_getaffinity(0, sizeof(allcpus), &allcpus))
+	{
+		CPU_ZERO(&allcpus);
+		for (int c = 0; c < CPU_SETSIZE; c++)
+			CPU_SET(c, &allcpus);
+	}
+
+	for (int n = 0; n < MAXNODES; n++)
+	{
+		char path[64], list[1024];
+		FILE * f;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+		if (!(f = fopen(path, "r")))
+			continue;
+		if (fgets(list, sizeof(list), f))
+		{
+			parse_cpulist(list, &nodecpus[nnodes]);
+			CPU_AND(&nodecpus[nnodes], &nodecpus[nnodes], &allcpus);
+			if (CPU_COUNT(&nodecpus[nnodes]))
+				nodeids[nnodes++] = n;
+		}
+		fclose(f);
+	}
+
+	if (!nnodes)
+	{
+		nodecpus[0] = allcpus;
+		nnodes = 1;
+	}
+}
+
+int numa_nodes(void)
+{
+	pthread_once(&once, read_nodes);
+	return nnodes;
+}
+
+// pins the calling thread to the CPUs of node, counted from 0 among
+// numa_nodes()
+void numa_pin(int node)
+{
+	if (numa_nodes() > 1)
+		sched_setaffinity(0, sizeof(cpu_set_t), &nodecpus[node % nnodes]);
+}
+
+// lets the calling thread run anywhere again
+void numa_unpin(void)
+{
+	if (numa_nodes() > 1)
+		sched_setaffinity(0, sizeof(cpu_set_t), &allcpus);
+}
+
+// the node whose range of a buffer of len bytes in pages of page bytes holds
+// byte off
+int numa_node_at(size_t off, size_t len, size_t page)
+{
+	size_t npages = (len + page - 1) / page;
+
+	return (int)(off / page * numa_nodes() / npages);
+}
+
+// Maps *len bytes of zeros from 1 GB or 2 MB huge pages when that many are
+// reserved, or else from normal pages aligned to 2 MB and advised as
+// transparent huge pages. Huge pages are only tried when *len fills at least
+// one. *len is rounded up to a whole number of *page bytes.
+void * huge_alloc(size_t * len, size_t * page)
+{
+	static const size_t sizes[] = {HUGE_1GB, HUGE_2MB};
+	static const int shifts[] = {30, 21};
+	size_t base = (size_t)sysconf(_SC_PAGESIZE), n;
+	char * p, * start;
+
+	for (int i = 0; i < 2; i++)
+	{
+		if (*len < sizes[i])
+			continue;
+		n = *len + sizes[i] - 1 & ~(sizes[i] - 1);
+		p = mmap(NULL, n, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | shifts[i] << MAP_HUGE_SHIFT, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			*len = n;
+			*page = sizes[i];
+			return p;
+		}
+	}
+
+	n = *len + base - 1 & ~(base - 1);
+	*page = base;
+	if (n < HUGE_2MB)
+	{
+		if ((p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+			return NULL;
+		*len = n;
+		return p;
+	}
+
+	// over-map by 2 MB and trim both ends to a 2 MB boundary
+	n = *len + HUGE_2MB - 1 & ~(HUGE_2MB - 1);
+	if ((p = mmap(NULL, n + HUGE_2MB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return NULL;
+	start = (char *)((uintptr_t)p + HUGE_2MB - 1 & ~(uintptr_t)(HUGE_2MB - 1));
+	if (start > p)
+		munmap(p, start - p);
+	munmap(start + n, p + HUGE_2MB - start);
+	madvise(start, n, MADV_HUGEPAGE);
+	*len = n;
+	*page = HUGE_2MB; // the unit transparent huge pages come in
+	return start;
+}
+
+struct touch {
+	char * p;
+	size_t len, page;
+};
+
+static void touch_node(struct pool * pool, void * arg, int job, int worker)
+{
+	struct touch * t = arg;
+
+	numa_pin(job);
+	for (size_t off = 0; off < t->len; off += t->page)
+		if (numa_node_at(off, t->len, t->page) == job)
+			memset(t->p + off, 0, t->page);
+}
+
+// writes every page of p, each from a thread on the node it belongs to
+void first_touch(void * p, size_t len, size_t page)
+{
+	struct touch t = {.p = p, .len = len, .page = page};
+
+	pool_run(numa_nodes(), numa_nodes(), touch_node, &t);
+	numa_unpin();
+}
+
+// the page size of the mapping at p, and how much of it is backed by
+// transparent huge pages
+static void smaps(const void * p, size_t * page, size_t * thp)
+{
+	FILE * f = fopen("/proc/self/smaps", "r");
+	char line[256];
+	size_t kb;
+	int in = 0;
+
+	*page = (size_t)sysconf(_SC_PAGESIZE);
+	*thp = 0;
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f))
+	{
+		unsigned long lo, hi;
+
+		if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+			in = lo <= (uintptr_t)p && (uintptr_t)p < hi;
+		else if (in && sscanf(line, "KernelPageSize: %zu kB", &kb) == 1)
+			*page = kb << 10;
+		else if (in && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+			*thp = kb << 10;
+	}
+	fclose(f);
+}
+
+// prints which nodes the len bytes at p are on, and in what pages
+static void report(FILE * out, const char * what, const void * p, size_t len)
+{
+	size_t base = (size_t)sysconf(_SC_PAGESIZE), page, thp;
+	uintptr_t start = (uintptr_t)p & ~(uintptr_t)(base - 1);
+	size_t npages = ((uintptr_t)p + len - start + base - 1) / base;
+	void ** pages = malloc(npages * sizeof(void *));
+	int * status = malloc(npages * sizeof(int));
+	size_t bytes[MAXNODES] = {0}, unplaced = 0;
+
+	if (!pages || !status)
+		error("Out of memory");
+	for (size_t i = 0; i < npages; i++)
+		pages[i] = (void *)(start + i * base);
+	// with no target nodes, move_pages only reports where each page is
+	if (syscall(SYS_move_pages, 0, (unsigned long)npages, pages, NULL, status, 0))
+		for (size_t i = 0; i < npages; i++)
+			status[i] = -1;
+
+	for (size_t i = 0; i < npages; i++)
+		if (status[i] >= 0 && status[i] < MAXNODES)
+			bytes[status[i]] += base;
+		else
+			unplaced += base;
+
+	smaps(p, &page, &thp);
+	fprintf(out, "%s: %zu bytes in %zu kB pages", what, len, page >> 10);
+	if (thp)
+		fprintf(out, ", %zu of the mapping in transparent huge pages", thp);
+	fprintf(out, "\n");
+	for (int n = 0; n < MAXNODES; n++)
+		if (bytes[n])
+			fprintf(out, "\tnode %d: %zu bytes\n", n, bytes[n]);
+	if (unplaced)
+		fprintf(out, "\tnot placed: %zu bytes\n", unplaced);
+	free(pages);
+	free(status);
+}
+
+// --numa: the nodes found, and where the state and rho are
+void print_placement(FILE * out, const struct qsim_ctx * ctx)
+{
+	numa_nodes();
+	fprintf(out, "NUMA: %d node%s:", nnodes, nnodes == 1? "": "s");
+	for (int n = 0; n < nnodes; n++)
+		fprintf(out, " %d (%d CPUs)", nodeids[n], CPU_COUNT(&nodecpus[n]));
+	fprintf(out, "\n");
+	report(out, "State", ctx->state, NAMPS * sizeof(struct amp));
+	if (ctx->rho)
+		report(out, "Density matrix", ctx->rho, ctx->rholen);
+}
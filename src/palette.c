@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "main.h"
+
+#define PALMAX (NAMPS / 4) // distinct values above which the state goes dense
+#define PALCAP (PALMAX + NAMPS) // a gate adds at most one value per amplitude
+#define PALHASH 2048 // slots of the value to id table, a power of 2 above PALCAP
+#define PAIRHASH 1024 // slots of the cache of H results
+
+// Under --palette the state is kept as a palette of its distinct amplitudes
+// and, for each index, the id of its value in the palette, packed 4, 8 or 16
+// bits wide, the narrowest that holds every id. States made of H, X, Z and
+// oracles tend to have only a few distinct amplitudes, so the ids take a
+// fraction of the bytes of the state vector. X, SWAP and U move ids around,
+// Z and P replace ids with the id of the negated value, and H maps each pair
+// of ids to a new pair, so the values themselves are only worked on once per
+// distinct id or pair of ids. Values are only ever added to the palette, and
+// once more than PALMAX are in it, the unused ones are dropped. Other gates,
+// measurements and commands run on the state vector unpacked from the ids,
+// and the result is packed again when it has at most PALMAX distinct values.
+// Until it does, the circuit runs on the state vector as usual.
+
+struct palette {
+	struct amp vals[PALCAP];
+	int nvals;
+	int16_t slot[PALHASH]; // id + 1 of the value hashed there, or 0
+	int16_t negid[PALCAP]; // id + 1 of the negated value, or 0 if not known
+	struct hpair {
+		int16_t a, b; // ids in, a is -1 when the slot is empty
+		int16_t ha, hb; // ids out
+	} hcache[PAIRHASH];
+	int width; // bits per id
+	uint8_t ids[NAMPS * 2];
+	int dense; // the state is in ctx->state, not the ids
+
+	long idgates, densegates; // gates run on the ids and on the state vector
+	int maxvals, maxwidth;
+};
+
+static inline int get_id(const struct palette * pal, int i)
+{
+	switch (pal->width)
+	{
+		case 4:
+			return pal->ids[i >> 1] >> (i & 1) * 4 & 15;
+		case 8:
+			return pal->ids[i];
+		default:
+			return pal->ids[2 * i] | pal->ids[2 * i + 1] << 8;
+	}
+}
+
+static inline void set_id(struct palette * pal, int i, int id)
+{
+	switch (pal->width)
+	{
+		case 4:
+			pal->ids[i >> 1] = pal->ids[i >> 1] & 0xf0 >> (i & 1) * 4 | id << (i & 1) * 4;
+			break;
+		case 8:
+			pal->ids[i] = (uint8_t)id;
+			break;
+		default:
+			pal->ids[2 * i] = (uint8_t)id;
+			pal->ids[2 * i + 1] = (uint8_t)(id >> 8);
+	}
+}
+
+static void repack(struct palette * pal, int width)
+{
+	uint16_t ids[NAMPS];
+
+	for (int i = 0; i < NAMPS; i++)
+		ids[i] = (uint16_t)get_id(pal, i);
+	pal->width = width;
+	if (width > pal->maxwidth)
+		pal->maxwidth = width;
+	for (int i = 0; i < NAMPS; i++)
+		set_id(pal, i, ids[i]);
+}
+
+static inline unsigned hash(struct amp v)
+{
+	return ((unsigned)v.ones * 0x9e3779b1u ^ (unsigned)v.root2s * 0x85ebca6bu) >> 16 & (PALHASH - 1);
+}
+
+// the id of v, which is added to the palette if it is not there yet
+static int lookup(struct palette * pal, struct amp v)
+{
+	unsigned h = hash(v);
+	int id;
+
+	for (; pal->slot[h]; h = h + 1 & (PALHASH - 1))
+	{
+		id = pal->slot[h] - 1;
+		if (pal->vals[id].ones == v.ones && pal->vals[id].root2s == v.root2s)
+			return id;
+	}
+	if (pal->nvals == PALCAP)
+		error("Palette overflow");
+	id = pal->nvals++;
+	pal->vals[id] = v;
+	pal->slot[h] = (int16_t)(id + 1);
+	pal->negid[id] = 0;
+	if (id >> pal->width)
+		repack(pal, pal->width * 2);
+	return id;
+}
+
+static int neg_id(struct palette * pal, int id)
+{
+	struct amp v;
+	int n;
+
+	if (pal->negid[id])
+		return pal->negid[id] - 1;
+	v = pal->vals[id];
+	neg(&v);
+	n = lookup(pal, v);
+	pal->negid[id] = (int16_t)(n + 1);
+	pal->negid[n] = (int16_t)(id + 1);
+	return n;
+}
+
+// Packs state into a fresh palette and returns 1, or returns 0 once it has
+// more than PALMAX distinct values.
+static int pack(struct palette * pal, const struct amp * state)
+{
+	pal->nvals = 0;
+	pal->width = 4;
+	memset(pal->slot, 0, sizeof(pal->slot));
+	for (int p = 0; p < PAIRHASH; p++)
+		pal->hcache[p].a = -1;
+	for (int i = 0; i < NAMPS; i++)
+	{
+		int id = lookup(pal, state[i]);
+
+		if (pal->nvals > PALMAX)
+			return 0;
+		set_id(pal, i, id);
+	}
+	if (pal->nvals > pal->maxvals)
+		pal->maxvals = pal->nvals;
+	if (pal->width > pal->maxwidth)
+		pal->maxwidth = pal->width;
+	return 1;
+}
+
+static void unpack(const struct palette * pal, struct amp * state)
+{
+	for (int i = 0; i < NAMPS; i++)
+		state[i] = pal->vals[get_id(pal, i)];
+}
+
+static inline void swap_ids(struct palette * pal, int i, int j)
+{
+	int id = get_id(pal, i);
+
+	set_id(pal, i, get_id(pal, j));
+	set_id(pal, j, id);
+}
+
+// H on the values of ids a and b, the same way H() does it
+static void h_ids(struct palette * pal, int a, int b, int * ha, int * hb)
+{
+	struct hpair * c = &pal->hcache[(a * 31 + b) & (PAIRHASH - 1)];
+	struct amp x = pal->vals[a], y = pal->vals[b], s;
+
+	if (c->a == a && c->b == b)
+	{
+		*ha = c->ha;
+		*hb = c->hb;
+		return;
+	}
+	mult(&x, &iroot2);
+	mult(&y, &iroot2);
+	s = x;
+	add(&s, &y);
+	neg(&y);
+	add(&y, &x);
+	*ha = lookup(pal, s);
+	*hb = lookup(pal, y);
+	*c = (struct hpair){(int16_t)a, (int16_t)b, (int16_t)*ha, (int16_t)*hb};
+}
+
+// Runs unitary g on the ids and returns 1, or returns 0 if g has to run on the
+// state vector.
+static int pal_gate(struct palette * pal, const struct gate * g)
+{
+	int ctrl = g->ctrl;
+	int m, ma, mb;
+
+	switch (g->type)
+	{
+		case GATE_X:
+			m = ctrlbit(g->bits[0]);
+			for (int i = 0; i < NAMPS; i++)
+				if (!(i & m) && (i & ctrl) == ctrl)
+					swap_ids(pal, i, i | m);
+			return 1;
+		case GATE_SWAP:
+			ma = ctrlbit(g->bits[0]);
+			mb = ctrlbit(g->bits[1]);
+			for (int i = 0; i < NAMPS; i++)
+				if (i & ma && !(i & mb) && (i & ctrl) == ctrl)
+					swap_ids(pal, i, i ^ ma ^ mb);
+			return 1;
+		case GATE_Z:
+			m = ctrlbit(g->bits[0]);
+			for (int i = 0; i < NAMPS; i++)
+				if (i & m && (i & ctrl) == ctrl)
+					set_id(pal, i, neg_id(pal, get_id(pal, i)));
+			return 1;
+		case GATE_H:
+			m = ctrlbit(g->bits[0]);
+			for (int i = 0; i < NAMPS; i++)
+				if (!(i & m) && (i & ctrl) == ctrl)
+				{
+					int ha, hb;
+
+					h_ids(pal, get_id(pal, i), get_id(pal, i | m), &ha, &hb);
+					set_id(pal, i, ha);
+					set_id(pal, i | m, hb);
+				}
+			return 1;
+		case GATE_Uf:
+			if (g->nout)
+				return 0;
+			m = ctrlbit(g->bits[g->func->argc]);
+			for (int i = 0; i < NAMPS; i++)
+				if (!(i & m) && (i & ctrl) == ctrl && func_bit(g->func, outcome_of(i, g->bits, g->func->argc)))
+					swap_ids(pal, i, i | m);
+			return 1;
+		case GATE_Pf:
+			for (int i = 0; i < NAMPS; i++)
+				if ((i & ctrl) == ctrl && func_bit(g->func, outcome_of(i, g->bits, g->func->argc)))
+					set_id(pal, i, neg_id(pal, get_id(pal, i)));
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Runs the circuit with the state palettized whenever it has few enough
+// distinct values, and leaves the final state in ctx->state.
+void run_palette(struct qsim_ctx * ctx)
+{
+	struct palette * pal = calloc(1, sizeof(*pal));
+	struct cursor cur;
+
+	if (!pal)
+		error("Out of memory");
+	pal->dense = !pack(pal, ctx->state);
+	cursor_init(&cur, 0);
+	while (cur.pc < ctx->ngates)
+	{
+		struct gate * g = &ctx->gates[cur.pc];
+		int changes = is_unitary(g->type) || g->type == GATE_MEASURE;
+
+		if (!pal->dense && is_unitary(g->type) && pal_gate(pal, g))
+		{
+			g->cnt++;
+			cur.pc++;
+			pal->idgates++;
+			if (pal->nvals > pal->maxvals)
+				pal->maxvals = pal->nvals;
+			// drop the values no longer used
+			if (pal->nvals > PALMAX)
+			{
+				unpack(pal, ctx->state);
+				pal->dense = !pack(pal, ctx->state);
+			}
+			continue;
+		}
+
+		if (!pal->dense && (changes || is_command(g->type)))
+			unpack(pal, ctx->state);
+		run_step(ctx, ctx->gates, ctx->ngates, &cur);
+		if (is_unitary(g->type))
+			pal->densegates++;
+		if (changes)
+			pal->dense = !pack(pal, ctx->state);
+	}
+	if (!pal->dense)
+		unpack(pal, ctx->state);
+
+	if (ctx->flags & RUN_VERBOSE)
+		fprintf(stderr, "Palette: %ld gates on ids, %ld on the state vector, "
+				"palette of at most %d values, ids of at most %d bits\n",
+				pal->idgates, pal->densegates, pal->maxvals, pal->maxwidth);
+	free(pal);
+}
@@ -5,6 +5,9 @@
 #include <errno.h>
 #include <ctype.h>
 #include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "main.h"
 
 static void parse_range(const char * s, int * sidx, int lineno,
@@ -14,15 +17,15 @@ static void parse_range(const char * s, int * sidx, int lineno,
 	*start_idx = *sidx;
 
 	++*sidx;
-	while (isspace(s[*sidx]))
+	while (is_space(s[*sidx]))
 		++*sidx;
 
 	if (s[*sidx] == '.' && s[*sidx + 1] == '.')
 	{
 		*sidx += 2;
-		while (isspace(s[*sidx]))
+		while (is_space(s[*sidx]))
 			++*sidx;
-		if (!isdigit(s[*sidx]))
+		if (!is_digit(s[*sidx]))
 			error("Line %d: Missing index at end of range\n%s\n%*s~~~ Here",
 				lineno, s, *sidx + 1, "^");
 
@@ -41,7 +44,7 @@ static void parse_range(const char * s, int * sidx, int lineno,
 	}
 }
 
-static int parse_bits(const char * s, int * sidx, struct gate * gates, int * gidx, int lineno)
+static int parse_bits(const char * s, int * sidx, struct gate * g, int lineno)
 {
 	int nbits = 0;
 	int bits = 0;
@@ -50,52 +53,134 @@ static int parse_bits(const char * s, int * sidx, struct gate * gates, int * gid
 		int start, stop;
 		int start_idx, stop_idx;
 
-		while (isspace((int)s[*sidx]))
+		while (is_space((int)s[*sidx]))
 			++*sidx;
-		if (!isdigit((int)s[*sidx]))
+		if (!is_digit((int)s[*sidx]))
 			break;
 
 		parse_range(s, sidx, lineno, &start, &start_idx, &stop, &stop_idx);
 
 		for (int i = start; i < stop; i++)
 		{
-			if (nbits >= sizeof(gates->bits)/sizeof(*gates->bits))
+			if (nbits >= sizeof(g->bits)/sizeof(*g->bits))
 				error("Line %d: Too many input bits for gate %c.\n"
 						"%s\n%*s~~~ Here",
-						lineno, rgatemap[gates[*gidx].type], s, stop_idx + 1, "^");
+						lineno, rgatemap[g->type], s, stop_idx + 1, "^");
 			if (bits & ctrlbit(i))
 				error("Line %d: Duplicate input bit '%d'\n%s\n%*s~~~ Here",
 						lineno, i, s, start_idx + 1, "^");
 			bits |= ctrlbit(i);
 
-			gates[*gidx].bits[nbits] = i;
+			g->bits[nbits] = i;
 			nbits++;
 		}
 	}
-	switch (gates[*gidx].type)
+	switch (g->type)
 	{
-		case GATE_Uf:
-			if (nbits != gates[*gidx].func->argc + 1)
+		case GATE_G:
+			if (nbits != g->mat->k)
+				error("Line %d: Matrix %c takes %d bits. "
+						"%d given.\n%s\n%*s~~~ Here", lineno, g->mat->name,
+						g->mat->k, nbits, s, *sidx + 1, "^");
+			break;
+		case GATE_Pf:
+			if (nbits != g->func->argc)
 				error("Line %d: Gate %c takes %d input bits. "
-						"%d given.\n%s\n%*s~~~ Here", lineno, rgatemap[gates[*gidx].type],
-						gates[*gidx].func->argc + 1, nbits, s, *sidx + 1, "^");
+						"%d given.\n%s\n%*s~~~ Here", lineno, rgatemap[g->type],
+						g->func->argc, nbits, s, *sidx + 1, "^");
 			break;
 		case GATE_SWAP:
 			if (nbits != 2)
 				error("Line %d: SWAP gate takes 2 input bits. "
 						"%d given.\n%s\n%*s~~~ Here", lineno, nbits, s, *sidx + 1, "^");
 			break;
+		case GATE_MEASURE:
+		case GATE_D:
+		case GATE_F:
+			g->nbits = nbits;
+			break;
 		default:
 			break;
 	}
 	return bits;
 }
 
-static void parse_ctrl(const char * s, int * sidx, struct gate * gates, int * gidx, int lineno, int bits)
+static void parse_post(const char * s, int * sidx, struct gate * g, int lineno)
+{
+	int max = (1 << g->nbits) - 1;
+	char * endptr;
+	long l;
+
+	g->post = -1;
+
+	while (is_space((int)s[*sidx]))
+		++*sidx;
+	if (s[*sidx] != '=')
+		return;
+	++*sidx;
+
+	while (is_space((int)s[*sidx]))
+		++*sidx;
+
+	errno = 0;
+	l = strtol(s + *sidx, &endptr, 0);
+	if (!is_digit((int)s[*sidx]) || errno || l > max)
+		error("Line %d: Postselected outcome must be between 0 and %d\n%s\n%*s~~~ Here",
+				lineno, max, s, *sidx + 1, "^");
+
+	g->post = (int)l;
+	*sidx = endptr - s;
+}
+
+// Parses the outputs of U, given as -> out..., which leave the bits before
+// them as just the function's inputs. Without them the last bit is the target.
+static void parse_outs(const char * s, int * sidx, struct gate * g, int lineno, int bits)
+{
+	int nin = popcount(bits);
+	int want = g->func->argc + 1;
+
+	while (is_space((int)s[*sidx]))
+		++*sidx;
+	if (s[*sidx] == '-' && s[*sidx + 1] == '>')
+	{
+		*sidx += 2;
+		want = g->func->argc;
+		while (1)
+		{
+			int start, stop;
+			int start_idx, stop_idx;
+
+			while (is_space((int)s[*sidx]))
+				++*sidx;
+			if (!is_digit((int)s[*sidx]))
+				break;
+
+			parse_range(s, sidx, lineno, &start, &start_idx, &stop, &stop_idx);
+
+			for (int i = start; i < stop; i++)
+			{
+				if ((bits | g->ctrl) & ctrlbit(i))
+					error("Line %d: Output bit '%d' is already used\n%s\n%*s~~~ Here",
+							lineno, i, s, start_idx + 1, "^");
+				bits |= ctrlbit(i);
+				g->bits[nin + g->nout++] = i;
+			}
+		}
+		if (!g->nout)
+			error("Line %d: Expected output bits after '->'\n%s\n%*s~~~ Here",
+					lineno, s, *sidx + 1, "^");
+	}
+
+	if (nin != want)
+		error("Line %d: Gate U takes %d input bits%s. %d given.\n%s\n%*s~~~ Here",
+				lineno, want, g->nout? " before '->'": "", nin, s, *sidx + 1, "^");
+}
+
+static void parse_ctrl(const char * s, int * sidx, struct gate * g, int lineno, int bits)
 {
-	gates[*gidx].ctrl = 0;
+	g->ctrl = 0;
 
-	while (isspace((int)s[*sidx]))
+	while (is_space((int)s[*sidx]))
 		++*sidx;
 	if (s[*sidx] != ':')
 		return;
@@ -106,142 +191,197 @@ static void parse_ctrl(const char * s, int * sidx, struct gate * gates, int * gi
 		int start, stop;
 		int start_idx, stop_idx;
 
-		while (isspace((int)s[*sidx]))
+		while (is_space((int)s[*sidx]))
 			++*sidx;
-		if (!isdigit((int)s[*sidx]))
+		if (!is_digit((int)s[*sidx]))
 			break;
 
 		parse_range(s, sidx, lineno, &start, &start_idx, &stop, &stop_idx);
 
 		for (int i = start; i < stop; i++)
 		{
-			if (gates[*gidx].ctrl & ctrlbit(i))
+			if (g->ctrl & ctrlbit(i))
 				error("Line %d: Duplicate control bit '%d'\n%s\n%*s~~~ Here",
 						lineno, i, s, start_idx + 1, "^");
 			if (bits & ctrlbit(i))
 				error("Line %d: Input bit '%d' used as control bit\n%s\n%*s~~~ Here",
 						lineno, i, s, start_idx + 1, "^");
 
-			gates[*gidx].ctrl |= ctrlbit(i);
+			g->ctrl |= ctrlbit(i);
 		}
 	}
 
-	if (gates[*gidx].type == GATE_MEASURE && gates[*gidx].ctrl)
+	if (g->type == GATE_MEASURE && g->ctrl)
 		error("Line %d: Can't control measure operator", lineno);
 }
 
-static void parse_gate(const char * s, int * sidx, struct gate * gates, int * gidx, int lineno)
+// Gates are numbered from the start of the circuit. Without a stream they all
+// stay in ctx->gates; with one, gates[0] is gate number base, and every gate
+// before the outermost barrier that may still be closed has been handed over.
+struct parser {
+	struct qsim_ctx * ctx;
+	struct stream * stream;
+	struct gate * gates;
+	int base, ngates, cap;
+	int barrier; // innermost barrier that may still be closed, or -1
+};
+
+static inline struct gate * gate_at(struct parser * p, int i)
 {
-	int bits;
+	return &p->gates[i - p->base];
+}
 
-	while (isspace((int)s[*sidx]))
+// appends a zeroed gate and returns its number
+static int new_gate(struct parser * p)
+{
+	if (p->ngates == INT_MAX)
+		error("Circuit is too large");
+	if (p->ngates - p->base == p->cap)
+	{
+		struct gate * gates;
+		int cap = p->cap? p->cap * 2: 64;
+
+		if (!(gates = realloc(p->gates, cap * sizeof(*gates))))
+			error("Out of memory");
+		p->gates = gates;
+		p->cap = cap;
+		if (!p->stream)
+		{
+			p->ctx->gates = gates;
+			p->ctx->gatecap = cap;
+		}
+	}
+	memset(gate_at(p, p->ngates), 0, sizeof(struct gate));
+	return p->ngates++;
+}
+
+static void parse_gate(struct parser * p, const char * s, int * sidx, int lineno)
+{
+	struct gate * g;
+	int bits, first;
+
+	while (is_space((int)s[*sidx]))
 		++*sidx;
 	if (!s[*sidx] || s[*sidx] == '#')
 		return;
 
-	if (*gidx >= MAXGATES)
-		error("Line %d: Circuit is too large. The limit is %d gates", lineno, MAXGATES);
-	
-	if (!gatemap[s[*sidx]])
+	if (!gatemap[(unsigned char)s[*sidx]])
 		error("Line %d: Unknown gate\n%s\n%*s~~~ Here\n"
 				"Valid gates are " VALID_GATES, lineno, s, *sidx + 1, "^");
 
-	gates[*gidx].type = gatemap[s[*sidx]];
+	first = new_gate(p);
+	g = gate_at(p, first);
+	g->type = gatemap[(unsigned char)s[*sidx]];
 	++*sidx;
 
-	if (gates[*gidx].type == GATE_Uf)
+	if (g->type == GATE_Uf || g->type == GATE_Pf)
 	{
 		if (s[*sidx] < 'a' || s[*sidx] >= 'a' + NFUNCS)
 			error("Line %d: Expected function name\n%s\n%*s~~~ Here",
 					lineno, s, *sidx + 1, "^");
-		if (!funcs[s[*sidx] - 'a'].name)
+		if (!p->ctx->funcs[s[*sidx] - 'a'].name)
 			error("Line %d: Function '%c' not defined\n%s\n%*s~~~ Here",
 					lineno, s[*sidx], s, *sidx + 1, "^");
-		gates[*gidx].func = &funcs[s[*sidx] - 'a'];
+		g->func = &p->ctx->funcs[s[*sidx] - 'a'];
+		if (g->type == GATE_Pf && !g->func->argc)
+			error("Line %d: Gate P needs a function of at least one variable\n%s\n%*s~~~ Here",
+					lineno, s, *sidx + 1, "^");
+		++*sidx;
+	}
+	else if (g->type == GATE_G)
+	{
+		if (s[*sidx] < 'a' || s[*sidx] >= 'a' + NMATS)
+			error("Line %d: Expected matrix name\n%s\n%*s~~~ Here",
+					lineno, s, *sidx + 1, "^");
+		if (!p->ctx->mats[s[*sidx] - 'a'].name)
+			error("Line %d: Matrix '%c' not defined\n%s\n%*s~~~ Here",
+					lineno, s[*sidx], s, *sidx + 1, "^");
+		g->mat = &p->ctx->mats[s[*sidx] - 'a'];
 		++*sidx;
 	}
 
-	bits = parse_bits(s, sidx, gates, gidx, lineno);
-	parse_ctrl(s, sidx, gates, gidx, lineno, bits);
+	bits = parse_bits(s, sidx, g, lineno);
+	if (g->type == GATE_MEASURE)
+		parse_post(s, sidx, g, lineno);
+	parse_ctrl(s, sidx, g, lineno, bits);
+	if (g->type == GATE_Uf)
+		parse_outs(s, sidx, g, lineno, bits);
+	if (g->type == GATE_Uf || g->type == GATE_Pf)
+		plan_Uf(p->ctx, g, "Line", lineno);
+	if (p->ctx->shardbits)
+		check_shard_width(g, p->ctx->shardbits, "Line", lineno);
 
 	if (s[*sidx] && s[*sidx] != '#')
 		error("Line %d: Unexpected symbol\n%s\n%*s~~~ What's that?",
 				lineno, s, *sidx + 1, "^");
 
-	++*gidx;
-
-	if (gates[*gidx - 1].type == GATE_H
-			|| gates[*gidx - 1].type == GATE_X
-			|| gates[*gidx - 1].type == GATE_Z)
+	if (g->type == GATE_H
+			|| g->type == GATE_X
+			|| g->type == GATE_Z)
 	{
 		for (int i = 1; i < popcount(bits); i++)
 		{
-			if (*gidx >= MAXGATES)
-				error("Line %d: Reached circuit limit while expanding gate %c",
-						lineno, rgatemap[gates[*gidx - 1].type]);
-
-			gates[*gidx].type = gates[*gidx - i].type;
-			gates[*gidx].bits[0] = gates[*gidx - i].bits[i];
-			gates[*gidx].ctrl = gates[*gidx - i].ctrl;
+			struct gate * copy = gate_at(p, new_gate(p));
 
-			++*gidx;
+			g = gate_at(p, first);
+			copy->type = g->type;
+			copy->bits[0] = g->bits[i];
+			copy->ctrl = g->ctrl;
 		}
 	}
 }
 
-static void parse_command(const char * s, int sidx, struct gate * gates, int * gidx, int lineno)
+static void parse_command(struct parser * p, const char * s, int sidx, int lineno)
 {
+	struct gate * g = gate_at(p, new_gate(p));
+
 	if (strncmp(s + sidx, "draw", 4) == 0
-			&& (!s[sidx + 4] || isspace(s[sidx + 4])))
+			&& (!s[sidx + 4] || is_space(s[sidx + 4])))
 	{
-		gates[*gidx].type = GATE_DRAW;
+		g->type = GATE_DRAW;
 		sidx += 4;
-		++*gidx;
 	}
 	else if (strncmp(s + sidx, "pause", 5) == 0
-			&& (!s[sidx + 5] || isspace(s[sidx + 5])))
+			&& (!s[sidx + 5] || is_space(s[sidx + 5])))
 	{
-		gates[*gidx].type = GATE_PAUSE;
+		g->type = GATE_PAUSE;
 		sidx += 5;
-		++*gidx;
 	}
 	else if (strncmp(s + sidx, "pfunc", 5) == 0
-			&& (!s[sidx + 5] || isspace(s[sidx + 5])))
+			&& (!s[sidx + 5] || is_space(s[sidx + 5])))
 	{
-		gates[*gidx].type = GATE_PFUNC;
+		g->type = GATE_PFUNC;
 		sidx += 5;
 
-		while (isspace(s[sidx]))
+		while (is_space(s[sidx]))
 			sidx++;
-		if (!islower(s[sidx]))
+		if (!is_lower(s[sidx]))
 			error("Line %d: Expected function name\n%s\n%*s~~~ Here",
 					lineno, s, sidx + 1, "^");
-		if (s[sidx] < 'a' || s[sidx] >= 'a' + NFUNCS || !funcs[s[sidx] - 'a'].name)
+		if (s[sidx] < 'a' || s[sidx] >= 'a' + NFUNCS || !p->ctx->funcs[s[sidx] - 'a'].name)
 			error("Line %d: Unknown function '%c'\n%s\n%*s~~~ What's that?",
 					lineno, s[sidx], s, sidx + 1, "^");
 
-		gates[*gidx].func = &funcs[s[sidx] - 'a'];
+		g->func = &p->ctx->funcs[s[sidx] - 'a'];
 		sidx++;
 
-		while (isspace(s[sidx]))
+		while (is_space(s[sidx]))
 			sidx++;
 		if (s[sidx] && s[sidx] != '#')
 			error("Line %d: Too many arguments given\n%s\n%*s~~~ Here",
 					lineno, s, sidx + 1, "^");
-
-		++*gidx;
 	}
 	else {
 		if (strncmp(s + sidx, "state", 5) == 0
-				&& (!s[sidx + 5] || isspace(s[sidx + 5])))
+				&& (!s[sidx + 5] || is_space(s[sidx + 5])))
 		{
-			gates[*gidx].type = GATE_STATE;
+			g->type = GATE_STATE;
 			sidx += 5;
 		}
 		else if (strncmp(s + sidx, "prob", 4) == 0
-				&& (!s[sidx + 4] || isspace(s[sidx + 4])))
+				&& (!s[sidx + 4] || is_space(s[sidx + 4])))
 		{
-			gates[*gidx].type = GATE_PROBS;
+			g->type = GATE_PROBS;
 			sidx += 4;
 		}
 		else error("Line %d: Unknown command\n%s\n%*s~~~ What's that?\n"
@@ -252,12 +392,12 @@ static void parse_command(const char * s, int sidx, struct gate * gates, int * g
 			int start, stop;
 			int start_idx, stop_idx;
 
-			while (isspace((int)s[sidx]))
+			while (is_space((int)s[sidx]))
 				sidx++;
 			if (!s[sidx] || s[sidx] == '#')
 				break;
 
-			if (!isdigit((int)s[sidx]))
+			if (!is_digit((int)s[sidx]))
 				error("Line %d: Expected qubit index\n%s\n%*s~~~ Here",
 						lineno, s, sidx + 1, "^");
 
@@ -265,50 +405,49 @@ static void parse_command(const char * s, int sidx, struct gate * gates, int * g
 			
 			for (int i = start; i < stop; i++)
 			{
-				if (gates[*gidx].ctrl & ctrlbit(i))
+				if (g->ctrl & ctrlbit(i))
 					error("Line %d: Duplicate qubit '%d'\n%s\n%*s~~~ Here",
 							lineno, i, s, start_idx + 1, "^");
-				gates[*gidx].ctrl |= ctrlbit(i);
+				g->ctrl |= ctrlbit(i);
 			}
 		}
 
-		if (!gates[*gidx].ctrl)
-			gates[*gidx].ctrl = -1;
-
-		++*gidx;
+		if (!g->ctrl)
+			g->ctrl = -1;
 	}
 
-	while (isspace(s[sidx]))
+	while (is_space(s[sidx]))
 		sidx++;
 	if (s[sidx])
 		error("Line %d: Unexpected token\n%s\n%*s~~~ What's that?",
 				lineno, s, sidx + 1, "^");
 }
 
-void parse_barrier(const char * s, int sidx,
-	struct gate * gates, int * gidx, int lineno, struct gate ** barrier_stack)
+static void parse_barrier(struct parser * p, const char * s, int sidx, int lineno)
 {
+	int idx = new_gate(p);
+	struct gate * g = gate_at(p, idx);
 	int repeat = 0;
 	int start = sidx;
 
 	while (s[sidx] == '-')
 		sidx++;
 
-	if (islower(s[sidx]))
+	if (is_lower(s[sidx]))
 	{
-		gates[*gidx].barrier.name = s[sidx];
+		g->barrier.name = s[sidx];
 		sidx++;
 	}
-	else gates[*gidx].barrier.name = 0;
+	else g->barrier.name = 0;
 
-	if (s[sidx] && !isspace(s[sidx]) && s[sidx] != '#')
+	if (s[sidx] && !is_space(s[sidx]) && s[sidx] != '#')
 			error("Line %d: Barrier name must be 1 letter\n%s\n%*s~~~ Here",
 					lineno, s, sidx + 1, "^");
 
-	while (isspace(s[sidx]))
+	while (is_space(s[sidx]))
 		sidx++;
 	
-	if (isdigit(s[sidx])) {
+	if (is_digit(s[sidx])) {
 		char * endptr;
 		long l;
 
@@ -321,11 +460,11 @@ void parse_barrier(const char * s, int sidx,
 		sidx = endptr - s;
 		repeat = (int) l;
 
-		if (s[sidx] && !isspace(s[sidx]) && s[sidx] != '#')
+		if (s[sidx] && !is_space(s[sidx]) && s[sidx] != '#')
 			error("Line %d: Barrier repeat must be an integer.\n"
 					"%s\n%*s~~~ Here", lineno, s, sidx + 1, "^");
 
-		while (isspace(s[sidx]))
+		while (is_space(s[sidx]))
 			sidx++;
 		if (s[sidx])
 			error("Line %d: Unexpected token following barrier repeat.\n"
@@ -336,92 +475,195 @@ void parse_barrier(const char * s, int sidx,
 				"%s\n%*s~~~ Here", lineno, s, sidx + 1, "^");
 
 	// unwind
-	for (struct gate * barrier = *barrier_stack; barrier; barrier = barrier->barrier.prev)
+	for (int b = p->barrier; b >= 0; b = gate_at(p, b)->barrier.prev)
 	{
-		if (barrier->barrier.name == gates[*gidx].barrier.name)
+		if (gate_at(p, b)->barrier.name == g->barrier.name)
 		{
-			while ((*barrier_stack)->barrier.name != gates[*gidx].barrier.name)
-				*barrier_stack = (*barrier_stack)->barrier.prev;
+			while (gate_at(p, p->barrier)->barrier.name != g->barrier.name)
+				p->barrier = gate_at(p, p->barrier)->barrier.prev;
 			break;
 		}
 	}
 
-	if (*barrier_stack && (*barrier_stack)->barrier.name == gates[*gidx].barrier.name)
+	if (p->barrier >= 0 && gate_at(p, p->barrier)->barrier.name == g->barrier.name)
 	{
-		(*barrier_stack)->barrier.end = *gidx;
-		(*barrier_stack)->barrier.repeat = repeat? repeat: 1;
-		gates[*gidx].barrier.prev = (*barrier_stack)->barrier.prev;
-		*barrier_stack = &gates[*gidx];
+		struct gate * begin = gate_at(p, p->barrier);
+
+		begin->barrier.end = idx;
+		begin->barrier.repeat = repeat? repeat: 1;
+		g->barrier.prev = begin->barrier.prev;
+		p->barrier = idx;
 		
-		gates[*gidx].type = GATE_BARRIER_END;
+		g->type = GATE_BARRIER_END;
 	}
 	else if (repeat)
 		error("Line %d: Missing start of repeat block.\n"
 				"%s\n%*s~~~ Ends here", lineno, s, start + 1, "^");
 	else {
-		gates[*gidx].barrier.prev = *barrier_stack;
-		*barrier_stack = &gates[*gidx];
+		g->barrier.prev = p->barrier;
+		p->barrier = idx;
 
-		gates[*gidx].type = GATE_BARRIER_BEGIN;
+		g->type = GATE_BARRIER_BEGIN;
 	}
-	
-	++*gidx;
 }
 
-static inline void strip_newline(char * s)
+// Hands over every gate whose barriers are all closed, keeping the rest
+// for when they are.
+static void commit(struct parser * p, int eof)
 {
-	size_t len = strlen(s);
-	if (len > 0 && s[len - 1] == '\n')
+	int upto = p->ngates;
+
+	if (!eof)
+		for (int b = p->barrier; b >= 0; b = gate_at(p, b)->barrier.prev)
+			upto = b;
+	if (upto == p->base)
+		return;
+
+	stream_push(p->stream, p->gates, upto - p->base);
+	memmove(p->gates, gate_at(p, upto), (p->ngates - upto) * sizeof(struct gate));
+	p->base = upto;
+}
+
+static void parse_line(struct parser * p, char * s, int lineno)
+{
+	int sidx = 0;
+
+	while (is_space(s[sidx]))
+		sidx++;
+	if (!s[sidx] || s[sidx] == '#')
+		return;
+
+	if (is_lower(s[sidx]))
 	{
-		s[len - 1] = 0;
-		if (len > 1 && s[len - 2] == '\r')
-			s[len - 2] = 0;
+		if (strncmp(s + sidx, "noise", 5) == 0 && is_space(s[sidx + 5]))
+			parse_noise(p->ctx, s, sidx, lineno);
+		else if (is_lower(s[sidx + 1]))
+			parse_command(p, s, sidx, lineno);
+		else
+			parse_func(p->ctx, s, lineno);
 	}
+	else if (s[sidx] == '-')
+		parse_barrier(p, s, sidx, lineno);
+	else if (s[sidx] == 'G' && s[sidx + 1] && s[sidx + 2 + strspn(s + sidx + 2, " \t")] == '=')
+		parse_matrix(p->ctx, s, sidx, lineno);
+	else
+		parse_gate(p, s, &sidx, lineno);
+
+	if (p->stream)
+		commit(p, 0);
 }
 
-// returns number of gates
-int parse_circuit(struct gate * gates, FILE * in)
+// Copies line lineno into ctx->line without its line ending, as the parse
+// functions want a terminated string they can point into for errors.
+static char * get_line(struct qsim_ctx * ctx, const char * s, size_t len, int lineno)
 {
-	char s[BUFSIZE];
-	int gidx = 0;
+	if (len && s[len - 1] == '\r')
+		len--;
+	if (len >= INT_MAX)
+		error("Line %d: Line is too long", lineno);
+	if (len >= ctx->linecap)
+	{
+		char * line;
+		size_t cap = ctx->linecap? ctx->linecap: 256;
+
+		while (cap <= len)
+			cap *= 2;
+		if (!(line = realloc(ctx->line, cap)))
+			error("Out of memory");
+		ctx->line = line;
+		ctx->linecap = cap;
+	}
+	memcpy(ctx->line, s, len);
+	ctx->line[len] = 0;
+	return ctx->line;
+}
+
+// Regular files are mapped and split on newlines with memchr, which libc
+// vectorizes. Anything else, like a pipe, is read a line at a time.
+static void parse(struct parser * p, FILE * in)
+{
+	struct qsim_ctx * ctx = p->ctx;
+	struct stat st;
+	off_t off = ftello(in);
 	int lineno = 0;
-	struct gate * barrier_stack = NULL;
 
-	while (fgets(s, BUFSIZE, in))
+	p->barrier = -1;
+	if (off >= 0 && fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > off
+			&& (ctx->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0)) != MAP_FAILED)
 	{
-		int sidx = 0;
-		lineno++;
-		strip_newline(s);
+		const char * s = (const char *)ctx->map + off;
+		const char * end = (const char *)ctx->map + st.st_size;
 
-		while (isspace(s[sidx]))
-			sidx++;
-		if (!s[sidx] || s[sidx] == '#')
-			continue;
+		ctx->maplen = st.st_size;
+		madvise(ctx->map, ctx->maplen, MADV_SEQUENTIAL);
+		while (s < end)
+		{
+			const char * nl = memchr(s, '\n', end - s);
+
+			if (!nl)
+				nl = end;
+			lineno++;
+			parse_line(p, get_line(ctx, s, nl - s, lineno), lineno);
+			s = nl + 1;
+		}
+
+		munmap(ctx->map, ctx->maplen);
+		ctx->map = NULL;
+		fseeko(in, 0, SEEK_END);
+	}
+	else
+	{
+		ssize_t len;
 
-		if (islower(s[sidx]))
+		ctx->map = NULL;
+		while ((len = getline(&ctx->line, &ctx->linecap, in)) > 0)
 		{
-			if (islower(s[sidx + 1]))
-				parse_command(s, sidx, gates, &gidx, lineno);
-			else
-				parse_func(s, lineno);
+			lineno++;
+			if (ctx->line[len - 1] == '\n')
+				len--;
+			if (len && ctx->line[len - 1] == '\r')
+				len--;
+			if (len >= INT_MAX)
+				error("Line %d: Line is too long", lineno);
+			ctx->line[len] = 0;
+			parse_line(p, ctx->line, lineno);
 		}
-		else if (s[sidx] == '-')
-			parse_barrier(s, sidx, gates, &gidx, lineno, &barrier_stack);
-		else
-			parse_gate(s, &sidx, gates, &gidx, lineno);
 	}
-	return gidx;
+
+	if (p->stream)
+		commit(p, 1);
+}
+
+// parses the whole circuit into ctx->gates, or maps it if it is compiled
+void parse_circuit(struct qsim_ctx * ctx, FILE * in)
+{
+	struct parser p = {.ctx = ctx, .gates = ctx->gatecap? ctx->gates: NULL, .cap = ctx->gatecap};
+
+	if (is_compiled(in))
+	{
+		load_compiled(ctx, in);
+		return;
+	}
+	parse(&p, in);
+	ctx->ngates = p.ngates;
 }
 
-int path_parse_circuit(struct gate * gates, const char * path)
+void path_parse_circuit(struct qsim_ctx * ctx, const char * path)
 {
-	int ngates;
 	FILE * in;
 
 	if (!(in = fopen(path, "r")))
 		error("Failed to open %s: %s", path, strerror(errno));
-	ngates = parse_circuit(gates, in);
+	parse_circuit(ctx, in);
 	fclose(in);
+}
+
+// Parses gates into st as soon as they can no longer change. ctx is only
+// used for its functions, which are defined before any gate uses them.
+void stream_parse_circuit(struct qsim_ctx * ctx, FILE * in, struct stream * st)
+{
+	struct parser p = {.ctx = ctx, .stream = st};
 
-	return ngates;
+	parse(&p, in);
+	free(p.gates);
 }
@@ -4,6 +4,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <limits.h>
+#include <stdint.h>
+#include <string.h>
 #include "main.h"
 
 enum optype {
@@ -42,8 +44,6 @@ enum isempty {
 	NOTEMPTY
 };
 
-struct func funcs[NFUNCS];
-
 static void parse_tern(const char *, int *, struct op *, int *, struct func *, int);
 
 static enum isempty parse_term(const char * s, int * sidx, struct op * ops,
@@ -182,7 +182,9 @@ static void parse_mult(const char * s, int * sidx, struct op * ops, int * opidx,
 			++*sidx;
 			continue;
 		}
-		if (parse_not(s, sidx, ops, opidx, false, func, lineno) != EMPTY)
+		// juxtaposition, which must not swallow a binary - or the ! of !=
+		if (s[*sidx] != '-' && s[*sidx] != '!'
+				&& parse_not(s, sidx, ops, opidx, false, func, lineno) != EMPTY)
 		{
 			if (*opidx >= FMAXOPS)
 				error("Line %d: Function %c is too big :(", lineno, func->name);
@@ -265,38 +267,27 @@ static void parse_rel(const char * s, int * sidx, struct op * ops, int * opidx,
 		}
 		if (s[*sidx] == '<' || s[*sidx] == '>')
 		{
-			if (*opidx >= FMAXOPS)
-				error("Line %d: Function %c is too big :(", lineno, func->name);
+			int arg1 = *opidx - 1;
+			enum optype type;
 
-			if (s[*sidx] == '<')
+			if (s[*sidx + 1] == '=')
 			{
-				if (s[*sidx + 1] == '=')
-				{
-					ops[*opidx].type = OP_LTE;
-					*sidx += 2;
-				}
-				else {
-					ops[*opidx].type = OP_LT;
-					++*sidx;
-				}
+				type = s[*sidx] == '<'? OP_LTE: OP_GTE;
+				*sidx += 2;
 			}
-			else
-			{
-				if (s[*sidx + 1] == '=')
-				{
-					ops[*opidx].type = OP_GTE;
-					*sidx += 2;
-				}
-				else {
-					ops[*opidx].type = OP_GT;
-					++*sidx;
-				}
+			else {
+				type = s[*sidx] == '<'? OP_LT: OP_GT;
+				++*sidx;
 			}
-			ops[*opidx].args[0] = *opidx - 1;
-			
+
 			parse_add(s, sidx, ops, opidx, func, lineno);
-			ops[*opidx].args[1] = *opidx - 1;
 
+			if (*opidx >= FMAXOPS)
+				error("Line %d: Function %c is too big :(", lineno, func->name);
+
+			ops[*opidx].type = type;
+			ops[*opidx].args[0] = arg1;
+			ops[*opidx].args[1] = *opidx - 1;
 			++*opidx;
 		}
 		else break;
@@ -318,7 +309,7 @@ static void parse_eq(const char * s, int * sidx, struct op * ops, int * opidx, s
 			int arg1 = *opidx - 1;
 			int sym = s[*sidx];
 
-			++*sidx;
+			*sidx += 2;
 			parse_rel(s, sidx, ops, opidx, func, lineno);
 
 			if (*opidx >= FMAXOPS)
@@ -343,7 +334,8 @@ static void parse_band(const char * s, int * sidx, struct op * ops, int * opidx,
 			++*sidx;
 			continue;
 		}
-		if (s[*sidx] == '&')
+		// not &&, which parse_and() takes
+		if (s[*sidx] == '&' && s[*sidx + 1] != '&')
 		{
 			int arg1 = *opidx - 1;
 
@@ -401,7 +393,7 @@ static void parse_bor(const char * s, int * sidx, struct op * ops, int * opidx,
 			++*sidx;
 			continue;
 		}
-		if (s[*sidx] == '|')
+		if (s[*sidx] == '|' && s[*sidx + 1] != '|')
 		{
 			int arg1 = *opidx - 1;
 
@@ -534,102 +526,658 @@ static int intpow(int a, int b)
 	return c;
 }
 
-static int run(const struct op * ops, int nops, int args, int argc, int lineno, int name)
+static int nargs(enum optype type)
+{
+	switch (type)
+	{
+		case OP_VAR:
+		case OP_CONST:
+			return 0;
+		case OP_NEG:
+		case OP_BNOT:
+		case OP_NOT:
+			return 1;
+		case OP_TERN:
+			return 3;
+		default:
+			return 2;
+	}
+}
+
+static bool commutes(enum optype type)
+{
+	return type == OP_MUL || type == OP_ADD || type == OP_EQ || type == OP_NEQ
+		|| type == OP_BAND || type == OP_BXOR || type == OP_BOR
+		|| type == OP_AND || type == OP_OR;
+}
+
+// value of an op whose operands are the constants x, y and z
+static int fold(enum optype type, int x, int y, int z)
+{
+	switch (type)
+	{
+		case OP_POW: return intpow(x, y);
+		case OP_NEG: return -x;
+		case OP_NOT: return !x;
+		case OP_BNOT: return ~x;
+		case OP_MUL: return x * y;
+		case OP_DIV: return x / y;
+		case OP_MOD: return x % y;
+		case OP_ADD: return x + y;
+		case OP_SUB: return x - y;
+		case OP_LT: return x < y;
+		case OP_LTE: return x <= y;
+		case OP_GT: return x > y;
+		case OP_GTE: return x >= y;
+		case OP_EQ: return x == y;
+		case OP_NEQ: return x != y;
+		case OP_BAND: return x & y;
+		case OP_BXOR: return x ^ y;
+		case OP_BOR: return x | y;
+		case OP_AND: return x && y;
+		case OP_OR: return x || y;
+		case OP_TERN: return x? y: z;
+		default:
+			error("Unknown operator type in "
+					"representation of func: %d", type);
+	}
+}
+
+// can only be 0 or 1, so truthiness is the value itself
+static bool is_bool(const struct op * op)
+{
+	switch (op->type)
+	{
+		case OP_VAR:
+		case OP_NOT:
+		case OP_LT:
+		case OP_LTE:
+		case OP_GT:
+		case OP_GTE:
+		case OP_EQ:
+		case OP_NEQ:
+		case OP_AND:
+		case OP_OR:
+			return true;
+		case OP_CONST:
+			return op->args[0] == 0 || op->args[0] == 1;
+		default:
+			return false;
+	}
+}
+
+// a division whose divisor is not known to be nonzero, which has to run for
+// its diagnostic even if its value is never used
+static bool may_fault(const struct op * ops, const struct op * op)
+{
+	return (op->type == OP_DIV || op->type == OP_MOD)
+		&& !(ops[op->args[1]].type == OP_CONST && ops[op->args[1]].args[0]);
+}
+
+#define OPTHASH 256 // > FMAXOPS, power of 2
+
+struct opt {
+	struct op * out;
+	int nout;
+	int table[OPTHASH]; // index into out + 1, or 0
+};
+
+static unsigned hash_op(const struct op * op)
+{
+	unsigned h = op->type * 0x9e3779b1u;
+
+	for (int k = 0; k < 3; k++)
+		h = (h ^ (unsigned)op->args[k]) * 0x85ebca6bu;
+	return h ^ h >> 15;
+}
+
+// index of op in out, adding it unless an equal op is already there
+static int emit(struct opt * o, struct op op)
+{
+	unsigned h = hash_op(&op);
+
+	for (unsigned i = h & OPTHASH - 1; ; i = i + 1 & OPTHASH - 1)
+	{
+		int j = o->table[i] - 1;
+
+		if (j < 0)
+		{
+			o->out[o->nout] = op;
+			o->table[i] = ++o->nout;
+			return o->nout - 1;
+		}
+		if (memcmp(&o->out[j], &op, sizeof(op)) == 0)
+			return j;
+	}
+}
+
+static int emit_const(struct opt * o, int val)
+{
+	struct op op = {OP_CONST, {val, 0, 0}};
+
+	return emit(o, op);
+}
+
+// Replaces op, whose args already index out, with an equivalent existing op
+// or constant where it can. Returns the index of its value in out.
+static int simplify(struct opt * o, struct op op)
+{
+	const struct op * out = o->out;
+	int n = nargs(op.type);
+	int a = op.args[0], b = op.args[1];
+	bool ca = n > 0 && out[a].type == OP_CONST, cb = n > 1 && out[b].type == OP_CONST;
+	int va = ca? out[a].args[0]: 0, vb = cb? out[b].args[0]: 0;
+
+	if (commutes(op.type) && (ca && !cb || !(ca || cb) && a > b))
+	{
+		int t = a; a = b; b = t;
+		t = va; va = vb; vb = t;
+		bool tc = ca; ca = cb; cb = tc;
+		op.args[0] = a;
+		op.args[1] = b;
+	}
+
+	// folding 0 divisors would lose the error
+	if (n && !may_fault(out, &op))
+	{
+		bool all = true;
+
+		for (int k = 0; k < n; k++)
+			all = all && out[op.args[k]].type == OP_CONST;
+		if (all)
+			return emit_const(o, fold(op.type, va, vb,
+						n > 2? out[op.args[2]].args[0]: 0));
+	}
+
+	switch (op.type)
+	{
+		case OP_NEG:
+		case OP_BNOT:
+			if (out[a].type == op.type)
+				return out[a].args[0];
+			break;
+		case OP_NOT:
+			if (out[a].type == OP_NOT && is_bool(&out[out[a].args[0]]))
+				return out[a].args[0];
+			break;
+		case OP_POW:
+			if (cb && vb == 1)
+				return a;
+			if (cb && vb <= 0)
+				return emit_const(o, 1);
+			break;
+		case OP_MUL:
+			if (cb && vb == 1)
+				return a;
+			if (cb && vb == 0)
+				return emit_const(o, 0);
+			break;
+		case OP_DIV:
+			if (cb && vb == 1)
+				return a;
+			break;
+		case OP_ADD:
+		case OP_BOR:
+		case OP_BXOR:
+			if (cb && vb == 0)
+				return a;
+			if (a == b && op.type == OP_BOR)
+				return a;
+			if (a == b && op.type == OP_BXOR)
+				return emit_const(o, 0);
+			break;
+		case OP_SUB:
+			if (cb && vb == 0)
+				return a;
+			if (a == b)
+				return emit_const(o, 0);
+			break;
+		case OP_BAND:
+			if (cb && vb == 0)
+				return emit_const(o, 0);
+			if (cb && vb == -1 || a == b)
+				return a;
+			break;
+		case OP_LT:
+		case OP_GT:
+		case OP_NEQ:
+			if (a == b)
+				return emit_const(o, 0);
+			break;
+		case OP_LTE:
+		case OP_GTE:
+		case OP_EQ:
+			if (a == b)
+				return emit_const(o, 1);
+			break;
+		case OP_AND:
+			if (cb && !vb)
+				return emit_const(o, 0);
+			if ((cb || a == b) && is_bool(&out[a]))
+				return a;
+			break;
+		case OP_OR:
+			if (cb && vb)
+				return emit_const(o, 1);
+			if ((cb || a == b) && is_bool(&out[a]))
+				return a;
+			break;
+		case OP_TERN:
+			if (ca)
+				return va? b: op.args[2];
+			if (b == op.args[2])
+				return b;
+			break;
+		default:
+			break;
+	}
+	return emit(o, op);
+}
+
+// Folds constants, shares repeated subexpressions, applies identities like
+// x*1 and x^x and drops ops nothing reads, except divisions that may fault.
+// Returns the number of ops left, with the result in *root.
+static int optimize(struct op * ops, int nops, int * root)
+{
+	struct op out[FMAXOPS];
+	struct opt o = {.out = out};
+	int remap[FMAXOPS]; // from ops to out
+	int compact[FMAXOPS]; // from out to what is left of ops
+	bool live[FMAXOPS] = {0};
+	int n = 0;
+
+	for (int i = 0; i < nops; i++)
+	{
+		struct op op = ops[i];
+
+		for (int k = 0; k < nargs(op.type); k++)
+			op.args[k] = remap[op.args[k]];
+		for (int k = nargs(op.type); k < 3; k++)
+			if (op.type != OP_VAR && op.type != OP_CONST || k)
+				op.args[k] = 0;
+		remap[i] = simplify(&o, op);
+	}
+
+	live[remap[nops - 1]] = true;
+	for (int i = o.nout - 1; i >= 0; i--)
+	{
+		if (may_fault(out, &out[i]))
+			live[i] = true;
+		if (live[i])
+			for (int k = 0; k < nargs(out[i].type); k++)
+				live[out[i].args[k]] = true;
+	}
+
+	for (int i = 0; i < o.nout; i++)
+	{
+		if (!live[i])
+			continue;
+		ops[n] = out[i];
+		for (int k = 0; k < nargs(out[i].type); k++)
+			ops[n].args[k] = compact[out[i].args[k]];
+		compact[i] = n++;
+	}
+	*root = compact[remap[nops - 1]];
+	return n;
+}
+
+// Ops are evaluated a column at a time, over FLANES consecutive inputs. An op
+// that can only be 0 or 1 is bit-sliced, with one bit per input in a word;
+// the rest hold an int per input in loops the compiler can vectorize.
+#define FLANES 64
+
+struct cols {
+	bool isbool[FMAXOPS];  // op is kept as bits
+	bool needint[FMAXOPS]; // a bool op is also read as ints
+	uint64_t bits[FMAXOPS];
+	int vals[FMAXOPS][FLANES];
+};
+
+static bool is_bool_op(const struct op * ops, const bool * isbool, int i)
+{
+	const int * a = ops[i].args;
+
+	switch (ops[i].type)
+	{
+		case OP_VAR:
+		case OP_NOT:
+		case OP_LT:
+		case OP_LTE:
+		case OP_GT:
+		case OP_GTE:
+		case OP_EQ:
+		case OP_NEQ:
+		case OP_AND:
+		case OP_OR:
+			return true;
+		case OP_CONST:
+			return a[0] == 0 || a[0] == 1;
+		case OP_MUL:
+		case OP_BAND:
+		case OP_BXOR:
+		case OP_BOR:
+			return isbool[a[0]] && isbool[a[1]];
+		case OP_TERN:
+			return isbool[a[1]] && isbool[a[2]];
+		default:
+			return false;
+	}
+}
+
+// which operands of op i are read as ints, rather than as bits or truth
+static int int_operands(const struct op * ops, const bool * isbool, int i)
+{
+	switch (ops[i].type)
+	{
+		case OP_VAR:
+		case OP_CONST:
+		case OP_NOT:
+		case OP_AND:
+		case OP_OR:
+			return 0;
+		case OP_NEG:
+		case OP_BNOT:
+			return 1;
+		case OP_TERN:
+			return isbool[i]? 0: 6;
+		case OP_LT:
+		case OP_LTE:
+		case OP_GT:
+		case OP_GTE:
+		case OP_EQ:
+		case OP_NEQ:
+			return isbool[ops[i].args[0]] && isbool[ops[i].args[1]]? 0: 3;
+		default:
+			return isbool[i]? 0: 3;
+	}
+}
+
+static void classify(struct cols * c, const struct op * ops, int nops)
 {
-	int vals[FMAXOPS];
 	for (int i = 0; i < nops; i++)
 	{
+		int mask;
+
+		c->isbool[i] = is_bool_op(ops, c->isbool, i);
+		c->needint[i] = false;
+		mask = int_operands(ops, c->isbool, i);
+		for (int k = 0; k < 3; k++)
+			if (mask >> k & 1)
+				c->needint[ops[i].args[k]] = true;
+	}
+}
+
+// input i has variable v in bit argc - 1 - v
+static uint64_t var_bits(int var, int argc, int base)
+{
+	static const uint64_t pattern[6] = {
+		0xaaaaaaaaaaaaaaaa, 0xcccccccccccccccc, 0xf0f0f0f0f0f0f0f0,
+		0xff00ff00ff00ff00, 0xffff0000ffff0000, 0xffffffff00000000
+	};
+	int bit = argc - 1 - var;
+
+	if (bit < 6)
+		return pattern[bit];
+	return base >> bit & 1? ~(uint64_t)0: 0;
+}
+
+// nonzero lanes of op j
+static uint64_t truth(const struct cols * c, int j, int n)
+{
+	uint64_t t = 0;
+
+	if (c->isbool[j])
+		return c->bits[j];
+	for (int l = 0; l < n; l++)
+		t |= (uint64_t)(c->vals[j][l] != 0) << l;
+	return t;
+}
+
+static void eval_bool(struct cols * c, const struct op * ops, int i, int argc, int base, int n)
+{
+	const int * a = ops[i].args;
+	const int * x = c->vals[a[0]], * y = c->vals[a[1]];
+	uint64_t r = 0;
+
+	// comparisons of two bool columns stay in bits, the rest go by lane
+	if (ops[i].type >= OP_LT && ops[i].type <= OP_NEQ
+			&& !(c->isbool[a[0]] && c->isbool[a[1]]))
+	{
+		#define CMP(OP) for (int l = 0; l < n; l++) r |= (uint64_t)(x[l] OP y[l]) << l
 		switch (ops[i].type)
 		{
-			case OP_VAR:
-				vals[i] = !!(args & (1 << argc - 1 >> ops[i].args[0]));
-				continue;
-			case OP_CONST:
-				vals[i] = ops[i].args[0];
-				continue;
-			case OP_POW:
-				vals[i] = intpow(vals[ops[i].args[0]], vals[ops[i].args[1]]);
-				continue;
-			case OP_NEG:
-				vals[i] = -vals[ops[i].args[0]];
-				continue;
-			case OP_NOT:
-				vals[i] = !vals[ops[i].args[0]];
-				continue;
-			case OP_BNOT:
-				vals[i] = ~vals[ops[i].args[0]];
-				continue;
-			case OP_MUL:
-				vals[i] = vals[ops[i].args[0]] * vals[ops[i].args[1]];
-				continue;
-			case OP_DIV:
-				if (vals[ops[i].args[1]] == 0)
-					error("Line %d: Division by zero in function %c", lineno, name);
-				vals[i] = vals[ops[i].args[0]] / vals[ops[i].args[1]];
-				continue;
-			case OP_MOD:
-				if (vals[ops[i].args[1]] == 0)
+			case OP_LT: CMP(<); break;
+			case OP_LTE: CMP(<=); break;
+			case OP_GT: CMP(>); break;
+			case OP_GTE: CMP(>=); break;
+			case OP_EQ: CMP(==); break;
+			default: CMP(!=); break;
+		}
+		#undef CMP
+		c->bits[i] = r;
+		return;
+	}
+
+	switch (ops[i].type)
+	{
+		case OP_VAR:
+			r = var_bits(a[0], argc, base);
+			break;
+		case OP_CONST:
+			r = a[0]? ~(uint64_t)0: 0;
+			break;
+		case OP_NOT:
+			r = ~truth(c, a[0], n);
+			break;
+		case OP_LT:
+			r = ~c->bits[a[0]] & c->bits[a[1]];
+			break;
+		case OP_LTE:
+			r = ~c->bits[a[0]] | c->bits[a[1]];
+			break;
+		case OP_GT:
+			r = c->bits[a[0]] & ~c->bits[a[1]];
+			break;
+		case OP_GTE:
+			r = c->bits[a[0]] | ~c->bits[a[1]];
+			break;
+		case OP_EQ:
+			r = ~(c->bits[a[0]] ^ c->bits[a[1]]);
+			break;
+		case OP_NEQ:
+			r = c->bits[a[0]] ^ c->bits[a[1]];
+			break;
+		case OP_AND:
+			r = truth(c, a[0], n) & truth(c, a[1], n);
+			break;
+		case OP_OR:
+			r = truth(c, a[0], n) | truth(c, a[1], n);
+			break;
+		case OP_MUL:
+		case OP_BAND:
+			r = c->bits[a[0]] & c->bits[a[1]];
+			break;
+		case OP_BXOR:
+			r = c->bits[a[0]] ^ c->bits[a[1]];
+			break;
+		case OP_BOR:
+			r = c->bits[a[0]] | c->bits[a[1]];
+			break;
+		case OP_TERN:
+		{
+			uint64_t t = truth(c, a[0], n);
+			r = t & c->bits[a[1]] | ~t & c->bits[a[2]];
+			break;
+		}
+		default:
+			error("Unknown operator type in "
+					"representation of func: %d", ops[i].type);
+	}
+	c->bits[i] = r;
+}
+
+static void eval_int(struct cols * c, const struct op * ops, int i, int n, int lineno, int name)
+{
+	const int * a = ops[i].args;
+	int * v = c->vals[i];
+	const int * x = c->vals[a[0]], * y = c->vals[a[1]];
+
+	switch (ops[i].type)
+	{
+		case OP_CONST:
+			for (int l = 0; l < n; l++)
+				v[l] = a[0];
+			break;
+		case OP_POW:
+			for (int l = 0; l < n; l++)
+				v[l] = intpow(x[l], y[l]);
+			break;
+		case OP_NEG:
+			for (int l = 0; l < n; l++)
+				v[l] = -x[l];
+			break;
+		case OP_BNOT:
+			for (int l = 0; l < n; l++)
+				v[l] = ~x[l];
+			break;
+		case OP_MUL:
+			for (int l = 0; l < n; l++)
+				v[l] = x[l] * y[l];
+			break;
+		case OP_DIV:
+		case OP_MOD:
+			for (int l = 0; l < n; l++)
+				if (y[l] == 0)
 					error("Line %d: Division by zero in function %c", lineno, name);
-				vals[i] = vals[ops[i].args[0]] % vals[ops[i].args[1]];
-				continue;
-			case OP_ADD:
-				vals[i] = vals[ops[i].args[0]] + vals[ops[i].args[1]];
-				continue;
-			case OP_SUB:
-				vals[i] = vals[ops[i].args[0]] - vals[ops[i].args[1]];
-				continue;
-			case OP_LT:
-				vals[i] = vals[ops[i].args[0]] < vals[ops[i].args[1]];
-				continue;
-			case OP_LTE:
-				vals[i] = vals[ops[i].args[0]] <= vals[ops[i].args[1]];
-				continue;
-			case OP_GT:
-				vals[i] = vals[ops[i].args[0]] > vals[ops[i].args[1]];
-				continue;
-			case OP_GTE:
-				vals[i] = vals[ops[i].args[0]] >= vals[ops[i].args[1]];
-				continue;
-			case OP_EQ:
-				vals[i] = vals[ops[i].args[0]] == vals[ops[i].args[1]];
-				continue;
-			case OP_NEQ:
-				vals[i] = vals[ops[i].args[0]] != vals[ops[i].args[1]];
-				continue;
-			case OP_BAND:
-				vals[i] = vals[ops[i].args[0]] & vals[ops[i].args[1]];
-				continue;
-			case OP_BXOR:
-				vals[i] = vals[ops[i].args[0]] ^ vals[ops[i].args[1]];
-				continue;
-			case OP_BOR:
-				vals[i] = vals[ops[i].args[0]] | vals[ops[i].args[1]];
-				continue;
-			case OP_AND:
-				vals[i] = vals[ops[i].args[0]] && vals[ops[i].args[1]];
-				continue;
-			case OP_OR:
-				vals[i] = vals[ops[i].args[0]] || vals[ops[i].args[1]];
-				continue;
-			case OP_TERN:
-				vals[i] = vals[ops[i].args[0]]? vals[ops[i].args[1]]: vals[ops[i].args[2]];
+			if (ops[i].type == OP_DIV)
+				for (int l = 0; l < n; l++)
+					v[l] = x[l] / y[l];
+			else
+				for (int l = 0; l < n; l++)
+					v[l] = x[l] % y[l];
+			break;
+		case OP_ADD:
+			for (int l = 0; l < n; l++)
+				v[l] = x[l] + y[l];
+			break;
+		case OP_SUB:
+			for (int l = 0; l < n; l++)
+				v[l] = x[l] - y[l];
+			break;
+		case OP_BAND:
+			for (int l = 0; l < n; l++)
+				v[l] = x[l] & y[l];
+			break;
+		case OP_BXOR:
+			for (int l = 0; l < n; l++)
+				v[l] = x[l] ^ y[l];
+			break;
+		case OP_BOR:
+			for (int l = 0; l < n; l++)
+				v[l] = x[l] | y[l];
+			break;
+		case OP_TERN:
+		{
+			uint64_t t = truth(c, a[0], n);
+			const int * z = c->vals[a[2]];
+
+			for (int l = 0; l < n; l++)
+				v[l] = t >> l & 1? y[l]: z[l];
+			break;
+		}
+		default:
+			error("Unknown operator type in "
+					"representation of func: %d", ops[i].type);
+	}
+}
+
+// fills func's table with the value of op root for each input
+static void run_ops(const struct op * ops, int nops, int root, struct func * func, int lineno)
+{
+	struct cols cols, * c = &cols;
+	int argc = func->argc;
+	int n = 1 << argc < FLANES? 1 << argc: FLANES;
+	int vals[NAMPS];
+	bool flat = true; // every value is 0 or 1
+
+	classify(c, ops, nops);
+	memset(func->map, 0, sizeof(func->map));
+
+	for (int base = 0; base < 1 << argc; base += n)
+	{
+		uint64_t word = 0;
+
+		for (int i = 0; i < nops; i++)
+		{
+			if (!c->isbool[i])
+			{
+				eval_int(c, ops, i, n, lineno, func->name);
 				continue;
-			default:
-				error("Unknown operator type in "
-						"representation of func: %d", ops[i].type);
+			}
+			eval_bool(c, ops, i, argc, base, n);
+			if (c->needint[i])
+				for (int l = 0; l < n; l++)
+					c->vals[i][l] = c->bits[i] >> l & 1;
 		}
+
+		if (c->isbool[root])
+			word = c->bits[root] & ~(uint64_t)0 >> (FLANES - n);
+		else
+			for (int l = 0; l < n; l++)
+			{
+				vals[base + l] = c->vals[root][l];
+				word |= (uint64_t)(vals[base + l] != 0) << l;
+				flat &= vals[base + l] == 0 || vals[base + l] == 1;
+			}
+		func->map[base / 64] |= word << base % 64;
+	}
+
+	if (!flat)
+	{
+		if (!(func->vals = malloc(sizeof(int) << argc)))
+			error("Out of memory");
+		memcpy(func->vals, vals, sizeof(int) << argc);
 	}
-	return vals[nops - 1];
 }
 
-struct func * parse_name(const char * s, int * sidx, int lineno)
+// counts the inputs where func is nonzero and finds its algebraic normal form
+void analyze_func(struct func * func)
+{
+	int n = 1 << func->argc;
+	unsigned char t[NAMPS];
+
+	func->nones = 0;
+	for (int x = 0; x < n; x++)
+		func->nones += t[x] = func_bit(func, x);
+
+	// Moebius transform, after which t[x] is the coefficient of the product
+	// of the inputs set in x
+	for (int b = 1; b < n; b <<= 1)
+		for (int x = 0; x < n; x++)
+			if (x & b)
+				t[x] ^= t[x ^ b];
+
+	func->nanf = 0;
+	for (int x = 0; x < n; x++)
+		func->nanf += t[x];
+	if (func->nanf > FMAXANF || !func->nanf)
+		return;
+
+	if (!(func->anf = malloc(func->nanf * sizeof(int))))
+		error("Out of memory");
+	for (int x = 0, k = 0; x < n; x++)
+		if (t[x])
+			func->anf[k++] = x;
+}
+
+static struct func * parse_name(struct qsim_ctx * ctx, const char * s, int * sidx, int lineno)
 {
 	char name = s[*sidx];
 
 	if (name < 'a' || name >= 'a' + NFUNCS)
 		error("Line %d: Bad function name '%c'. Choose from "
 				"'a'-'%c'\n%s\n%*s~~~ Here", lineno, name, 'a' + NFUNCS, s, *sidx + 1, "^");
-	if (funcs[name - 'a'].name)
+	if (ctx->funcs[name - 'a'].name)
 		error("Line %d: Function '%c' already exists\n"
 				"%s\n%*s~~~ Here", lineno, name, s, *sidx + 1, "^");
 	++*sidx;
@@ -641,27 +1189,27 @@ struct func * parse_name(const char * s, int * sidx, int lineno)
 				"following %c\n%s\n%*s~~~ Here", lineno, name, s, *sidx + 1, "^");
 	++*sidx;
 
-	funcs[name - 'a'].name = name;
-	return &funcs[name - 'a'];
+	ctx->funcs[name - 'a'].name = name;
+	return &ctx->funcs[name - 'a'];
 }
 
-void print_func(const struct func * func)
+void print_func(FILE * out, const struct func * func)
 {
-	printf("Function: %c\n", func->name);
+	fprintf(out, "Function: %c\n", func->name);
 	for (int i = 0; i < (1 << func->argc); i++)
 	{
 		for (int j = (1 << func->argc - 1); j > 0; j >>= 1)
-			putc(0x30 | !!(i & j), stdout);
-		printf(" -> %d\n", func->map[i]);
+			putc(0x30 | !!(i & j), out);
+		fprintf(out, " -> %d\n", func_val(func, i));
 	}
 }
 
-void parse_func(const char * s, int lineno)
+void parse_func(struct qsim_ctx * ctx, const char * s, int lineno)
 {
 	struct op ops[FMAXOPS];
 
-	int sidx = 0, opidx = 0;
-	struct func * func = parse_name(s, &sidx, lineno);
+	int sidx = 0, opidx = 0, root;
+	struct func * func = parse_name(ctx, s, &sidx, lineno);
 
 	parse_tern(s, &sidx, ops, &opidx, func, lineno);
 
@@ -672,6 +1220,7 @@ void parse_func(const char * s, int lineno)
 		error("Line %d: Unknown symbol in function "
 				"%c\n%s\n%*s~~~ Here", lineno, func->name, s, sidx + 1, "^");
 
-	for (int i = 0; i < (1 << func->argc); i++)
-		func->map[i] = run(ops, opidx, i, func->argc, lineno, func->name);
+	opidx = optimize(ops, opidx, &root);
+	run_ops(ops, opidx, root, func, lineno);
+	analyze_func(func);
 }
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "main.h"
+
+// A matrix gate is defined on one line, rows separated by semicolons:
+//	Gr = [s/2 s/2; s/2 -s/2]
+// Each entry is a sum of terms like 3, -1/2, s/4 or 0.25s, where s is the
+// square root of 2, as amplitudes can only hold numbers of the form a + b*s.
+
+static void skip_space(const char * s, int * sidx)
+{
+	while (is_space(s[*sidx]))
+		++*sidx;
+}
+
+// one term of an entry, added to *ones or *root2s
+static void parse_term(const char * s, int * sidx, double * ones, double * root2s, int lineno, int name)
+{
+	double coef = 1;
+	int sign = 1;
+	int root2 = 0;
+	char * endptr;
+
+	if (s[*sidx] == '+' || s[*sidx] == '-')
+		sign = s[(*sidx)++] == '-'? -1: 1;
+	if (is_digit(s[*sidx]) || s[*sidx] == '.')
+	{
+		coef = strtod(s + *sidx, &endptr);
+		*sidx = endptr - s;
+	}
+	else if (s[*sidx] != 's')
+		error("Line %d: Expected number in matrix %c\n%s\n%*s~~~ Here",
+				lineno, name, s, *sidx + 1, "^");
+	if (s[*sidx] == 's')
+	{
+		root2 = 1;
+		++*sidx;
+	}
+	if (s[*sidx] == '/')
+	{
+		double den;
+
+		++*sidx;
+		den = strtod(s + *sidx, &endptr);
+		if (endptr == s + *sidx || den == 0)
+			error("Line %d: Bad denominator in matrix %c\n%s\n%*s~~~ Here",
+					lineno, name, s, *sidx + 1, "^");
+		*sidx = endptr - s;
+		coef /= den;
+	}
+
+	if (root2)
+		*root2s += sign * coef;
+	else
+		*ones += sign * coef;
+}
+
+static struct amp parse_entry(const char * s, int * sidx, double * val, int lineno, int name)
+{
+	double ones = 0, root2s = 0;
+
+	do
+		parse_term(s, sidx, &ones, &root2s, lineno, name);
+	while (s[*sidx] == '+' || s[*sidx] == '-');
+
+	if (fabs(ones) >= 2 || fabs(root2s) >= 2)
+		error("Line %d: Entry of matrix %c is too large\n%s\n%*s~~~ Here",
+				lineno, name, s, *sidx + 1, "^");
+	*val = ones + root2s * SQRT2;
+	return (struct amp){(int)lround(ones * DENOMINATOR), (int)lround(root2s * DENOMINATOR)};
+}
+
+// amplitudes are real, so a matrix gate has to be orthogonal
+static void check_orthogonal(const double * m, int n, int lineno, int name)
+{
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < n; j++)
+		{
+			double dot = 0;
+
+			for (int r = 0; r < n; r++)
+				dot += m[r * n + i] * m[r * n + j];
+			if (fabs(dot - (i == j)) > 1e-6)
+				error("Line %d: Matrix %c is not orthogonal", lineno, name);
+		}
+}
+
+void parse_matrix(struct qsim_ctx * ctx, const char * s, int sidx, int lineno)
+{
+	int name = s[sidx + 1];
+	struct amp m[GMAXSIZE * GMAXSIZE];
+	double vals[GMAXSIZE * GMAXSIZE];
+	struct gmat * mat;
+	int n = 0, row = 0, col = 0;
+
+	if (name < 'a' || name >= 'a' + NMATS)
+		error("Line %d: Bad matrix name '%c'. Choose from 'a'-'%c'\n%s\n%*s~~~ Here",
+				lineno, name, 'a' + NMATS - 1, s, sidx + 2, "^");
+	mat = &ctx->mats[name - 'a'];
+	if (mat->name)
+		error("Line %d: Matrix '%c' already exists\n%s\n%*s~~~ Here",
+				lineno, name, s, sidx + 2, "^");
+
+	sidx += 2;
+	skip_space(s, &sidx);
+	sidx++; // past the '=' parse_line found
+	skip_space(s, &sidx);
+	if (s[sidx] != '[')
+		error("Line %d: Expected '[' in matrix %c\n%s\n%*s~~~ Here",
+				lineno, name, s, sidx + 1, "^");
+	sidx++;
+
+	while (1)
+	{
+		skip_space(s, &sidx);
+		if (s[sidx] == ';' || s[sidx] == ']')
+		{
+			if (!row)
+				n = col;
+			if (!col || col != n)
+				error("Line %d: Row %d of matrix %c has %d entries, expected %d\n%s\n%*s~~~ Here",
+						lineno, row + 1, name, col, n? n: 1, s, sidx + 1, "^");
+			row++;
+			col = 0;
+			if (s[sidx++] == ']')
+				break;
+			continue;
+		}
+		if (!s[sidx])
+			error("Line %d: Expected ']' in matrix %c\n%s\n%*s~~~ Here",
+					lineno, name, s, sidx + 1, "^");
+		if (row * n + col >= GMAXSIZE * GMAXSIZE || !row && col >= GMAXSIZE)
+			error("Line %d: Matrix %c is larger than %dx%d\n%s\n%*s~~~ Here",
+					lineno, name, GMAXSIZE, GMAXSIZE, s, sidx + 1, "^");
+		m[row * n + col] = parse_entry(s, &sidx, &vals[row * n + col], lineno, name);
+		col++;
+	}
+
+	skip_space(s, &sidx);
+	if (s[sidx] && s[sidx] != '#')
+		error("Line %d: Unexpected symbol after matrix %c\n%s\n%*s~~~ Here",
+				lineno, name, s, sidx + 1, "^");
+	if (row != n || n < 2 || n & n - 1)
+		error("Line %d: Matrix %c must be square with a side of 2, 4, 8, 16 or 32", lineno, name);
+	check_orthogonal(vals, n, lineno, name);
+
+	if (!(mat->m = malloc(n * n * sizeof(struct amp))))
+		error("Out of memory");
+	memcpy(mat->m, m, n * n * sizeof(struct amp));
+	mat->k = ctz(n);
+	mat->name = name;
+}
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "main.h"
+
+// Each worker owns a deque of job ids. It pops from the tail of its own and,
+// when that runs dry, steals from the head of the others. Jobs may push more
+// jobs, so workers only quit once nothing is queued or running anywhere. A
+// worker that finds nothing to take sleeps until a job is pushed or the last
+// one running finishes.
+
+struct deque {
+	pthread_mutex_t lock;
+	int * jobs;
+	int head, tail, cap;
+};
+
+struct pool {
+	int nthreads;
+	struct deque * deques;
+	atomic_int pending; // jobs queued or running
+	atomic_int queued; // jobs in the deques
+	pthread_mutex_t lock; // for sleeping on wake
+	pthread_cond_t wake;
+	pool_fn * fn;
+	void * arg;
+};
+
+struct worker {
+	struct pool * pool;
+	int id;
+};
+
+static void deque_push(struct deque * d, int job)
+{
+	pthread_mutex_lock(&d->lock);
+	if (d->tail == d->cap && d->head)
+	{
+		memmove(d->jobs, d->jobs + d->head, (d->tail - d->head) * sizeof(int));
+		d->tail -= d->head;
+		d->head = 0;
+	}
+	if (d->tail == d->cap)
+	{
+		d->cap = d->cap? d->cap * 2: 16;
+		if (!(d->jobs = realloc(d->jobs, d->cap * sizeof(int))))
+			error("Out of memory");
+	}
+	d->jobs[d->tail++] = job;
+	pthread_mutex_unlock(&d->lock);
+}
+
+static int deque_pop(struct deque * d, int * job, int steal)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->head < d->tail)
+	{
+		*job = steal? d->jobs[d->head++]: d->jobs[--d->tail];
+		found = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+// wakes the sleeping workers, which take the lock to check whether to sleep,
+// so taking it here means none can miss this
+static void wake_all(struct pool * pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_push(struct pool * pool, int worker, int job)
+{
+	atomic_fetch_add(&pool->pending, 1);
+	deque_push(&pool->deques[worker], job);
+	atomic_fetch_add(&pool->queued, 1);
+	wake_all(pool);
+}
+
+static void * work(void * p)
+{
+	struct worker * w = p;
+	struct pool * pool = w->pool;
+	int job;
+
+	while (atomic_load(&pool->pending) > 0)
+	{
+		int found = deque_pop(&pool->deques[w->id], &job, 0);
+
+		for (int i = 1; !found && i < pool->nthreads; i++)
+			found = deque_pop(&pool->deques[(w->id + i) % pool->nthreads], &job, 1);
+		if (!found)
+		{
+			pthread_mutex_lock(&pool->lock);
+			while (!atomic_load(&pool->queued) && atomic_load(&pool->pending) > 0)
+				pthread_cond_wait(&pool->wake, &pool->lock);
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+		atomic_fetch_sub(&pool->queued, 1);
+
+		pool->fn(pool, pool->arg, job, w->id);
+		if (atomic_fetch_sub(&pool->pending, 1) == 1)
+			wake_all(pool);
+	}
+	return NULL;
+}
+
+// runs fn on jobs 0..njobs-1 over nthreads workers, initially split into
+// contiguous ranges so neighbouring jobs start on the same worker
+void pool_run(int nthreads, int njobs, pool_fn * fn, void * arg)
+{
+	struct pool pool = {.nthreads = nthreads, .fn = fn, .arg = arg};
+	struct worker * workers;
+	pthread_t * threads;
+
+	if (nthreads < 1)
+		pool.nthreads = nthreads = 1;
+
+	pool.deques = calloc(nthreads, sizeof(*pool.deques));
+	workers = calloc(nthreads, sizeof(*workers));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!pool.deques || !workers || !threads)
+		error("Out of memory");
+
+	atomic_init(&pool.pending, 0);
+	atomic_init(&pool.queued, 0);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	for (int i = 0; i < nthreads; i++)
+	{
+		pthread_mutex_init(&pool.deques[i].lock, NULL);
+		workers[i].pool = &pool;
+		workers[i].id = i;
+	}
+	// push in reverse so each worker pops its range in order
+	for (int i = njobs - 1; i >= 0; i--)
+		pool_push(&pool, (int)((long long)i * nthreads / njobs), i);
+
+	for (int i = 1; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, work, &workers[i]))
+			error("Failed to start worker thread %d", i);
+	work(&workers[0]);
+	for (int i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (int i = 0; i < nthreads; i++)
+	{
+		pthread_mutex_destroy(&pool.deques[i].lock);
+		free(pool.deques[i].jobs);
+	}
+	pthread_cond_destroy(&pool.wake);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.deques);
+	free(workers);
+	free(threads);
+}
@@ -14,6 +14,9 @@ enum nodetype {
 	NODE_X,
 	NODE_H,
 	NODE_Z,
+	NODE_D,
+	NODE_F,
+	NODE_G,
 	NODE_Uf,
 	NODE_BOX,
 	NODE_SWAP,
@@ -46,12 +49,12 @@ struct node {
 #define LINEPAD "--------"
 #define BORDERPAD "========"
 
-bool docolor()
+bool docolor(FILE * out)
 {
 #ifdef _WIN32
 	return false;
 #else
-	return isatty(fileno(stdout));
+	return isatty(fileno(out));
 #endif
 }
 
@@ -156,6 +159,15 @@ static void add_swap(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const str
 	add_botctrl(nodes, idx, gate, mincol, past);
 }
 
+// the qubits a function gate's box covers: the inputs, and the target or
+// outputs of U
+static int box_width(const struct gate * gate)
+{
+	if (gate->type != GATE_Uf)
+		return gate->func->argc;
+	return gate->func->argc + (gate->nout? gate->nout: 1);
+}
+
 static int add_Ufswaps(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const struct gate * gate, int * start, bool past)
 {
 	int sorted[NQBITS];
@@ -164,12 +176,12 @@ static int add_Ufswaps(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const s
 	for (int i = 0; i < NQBITS; i++)
 		sorted[i] = i;
 
-	if (gate->bits[0] + gate->func->argc < NQBITS)
+	if (gate->bits[0] + box_width(gate) <= NQBITS)
 		*start = gate->bits[0];
 	else
 		*start = 0;
 
-	for (int i = 0; i < gate->func->argc + 1; i++)
+	for (int i = 0; i < box_width(gate); i++)
 	{
 		int sorted_i = *start + i;
 		if (sorted[sorted_i] == gate->bits[i])
@@ -202,14 +214,15 @@ static void add_Uf(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const struc
 {
 	int mincol = 0;
 	int start = 0;
+	int last = box_width(gate) - 1; // bottom row of the box, from start
 	struct gate copy = *gate;
 
 	copy.ctrl = add_Ufswaps(nodes, idx, gate, &start, past);
 
-	for (int i = 0; i < gate->func->argc + 1; i++)
+	for (int i = 0; i <= last; i++)
 		if (idx[start + i] > mincol)
 			mincol = idx[start + i];
-	for (int i = gate->func->argc + 1; i < NQBITS; i++)
+	for (int i = last + 1; i < NQBITS; i++)
 		if (copy.ctrl & ctrlbit(i) && idx[i] > mincol)
 			mincol = idx[i];
 	if (mincol >= PRIMAXCOLS)
@@ -222,35 +235,39 @@ static void add_Uf(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const struc
 	add_topctrl(nodes, idx, &copy, mincol, past);
 
 	nodes[start][mincol].type = NODE_BOX;
-	nodes[start][mincol].wire |= WIRE_BOXBOT;
+	if (last)
+		nodes[start][mincol].wire |= WIRE_BOXBOT;
 	nodes[start][mincol].past = past;
 	idx[start] = mincol + 1;
-	for (int i = start + 1; i < start + gate->func->argc; i++)
+	for (int i = start + 1; i < start + last; i++)
 	{
 		nodes[i][mincol].type = NODE_BOX;
 		nodes[i][mincol].wire = WIRE_BOXBOTH;
 		nodes[i][mincol].past = past;
 		idx[i] = mincol + 1;
 	}
-	nodes[start + gate->func->argc][mincol].type = NODE_BOX;
-	nodes[start + gate->func->argc][mincol].wire |= WIRE_BOXTOP;
-	nodes[start + gate->func->argc][mincol].past = past;
-	idx[start + gate->func->argc] = mincol + 1;
+	if (last)
+	{
+		nodes[start + last][mincol].type = NODE_BOX;
+		nodes[start + last][mincol].wire |= WIRE_BOXTOP;
+		nodes[start + last][mincol].past = past;
+		idx[start + last] = mincol + 1;
+	}
 
-	if (gate->func->argc & 1)
+	if (last & 1)
 	{
-		nodes[start + gate->func->argc/2][mincol].wire |= WIRE_UfBOT;
-		nodes[start + gate->func->argc/2][mincol].fname = gate->func->name;
-		nodes[start + gate->func->argc/2 + 1][mincol].wire |= WIRE_UfTOP;
-		nodes[start + gate->func->argc/2 + 1][mincol].fname = gate->func->name;
+		nodes[start + last/2][mincol].wire |= WIRE_UfBOT;
+		nodes[start + last/2][mincol].fname = gate->func->name;
+		nodes[start + last/2 + 1][mincol].wire |= WIRE_UfTOP;
+		nodes[start + last/2 + 1][mincol].fname = gate->func->name;
 	}
 	else
 	{
-		nodes[start + gate->func->argc/2][mincol].type = NODE_Uf;
-		nodes[start + gate->func->argc/2][mincol].fname = gate->func->name;
+		nodes[start + last/2][mincol].type = NODE_Uf;
+		nodes[start + last/2][mincol].fname = gate->func->name;
 	}
 
-	copy.bits[0] = start + gate->func->argc;
+	copy.bits[0] = start + last;
 	add_botctrl(nodes, idx, &copy, mincol, past);
 
 	add_Ufswaps(nodes, idx, gate, &start, past);
@@ -276,22 +293,6 @@ static void add_gate(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const str
 		case GATE_Z:
 			nodes[gate->bits[0]][mincol].type = NODE_Z;
 			break;
-		case GATE_MEASURE:
-			switch (gate->mstate)
-			{
-				case MSTATE_UNKNOWN:
-					nodes[gate->bits[0]][mincol].type = NODE_MEASURE_UNKNOWN;
-					break;
-				case MSTATE_0:
-					nodes[gate->bits[0]][mincol].type = NODE_MEASURE_0;
-					break;
-				case MSTATE_1:
-					nodes[gate->bits[0]][mincol].type = NODE_MEASURE_1;
-					break;
-				default:
-					error("Unkown measure state: %d", gate->mstate);
-			}
-			break;
 		case GATE_PAUSE:
 		case GATE_DRAW:
 		case GATE_STATE:
@@ -308,6 +309,78 @@ static void add_gate(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const str
 	add_botctrl(nodes, idx, gate, mincol, past);
 }
 
+// the register of D, F or G and the controls in one column, joined by a wire
+static void add_register(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const struct gate * gate, bool past)
+{
+	int reg = 0, all;
+	int mincol = 0;
+	int top, bot;
+
+	for (int i = 0; i < (gate->type == GATE_G? gate->mat->k: gate->nbits); i++)
+		reg |= ctrlbit(gate->bits[i]);
+	all = reg | gate->ctrl;
+	top = clz(all) - (sizeof(all)*8 - NQBITS);
+	bot = NQBITS - 1 - ctz(all);
+
+	for (int i = top; i <= bot; i++)
+		if (idx[i] > mincol)
+			mincol = idx[i];
+	if (mincol >= PRIMAXCOLS)
+		error("Circuit is too big to print!");
+
+	for (int i = top; i <= bot; i++)
+	{
+		struct node * node = &nodes[i][mincol];
+
+		if (reg & ctrlbit(i) && gate->type == GATE_G)
+		{
+			node->type = NODE_G;
+			node->fname = gate->mat->name;
+		}
+		else if (reg & ctrlbit(i))
+			node->type = gate->type == GATE_D? NODE_D: NODE_F;
+		else if (gate->ctrl & ctrlbit(i))
+			node->type = NODE_CTRL;
+		if (i > top)
+			node->wire |= WIRE_TOP;
+		if (i < bot)
+			node->wire |= WIRE_BOT;
+		node->past = past;
+		idx[i] = mincol + 1;
+	}
+}
+
+// all measured bits go in one column
+static void add_measure(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const struct gate * gate, bool past)
+{
+	int mincol = 0;
+	for (int i = 0; i < gate->nbits; i++)
+		if (idx[gate->bits[i]] > mincol)
+			mincol = idx[gate->bits[i]];
+	if (mincol >= PRIMAXCOLS)
+		error("Circuit is too big to print!");
+
+	for (int i = 0; i < gate->nbits; i++)
+	{
+		struct node * node = &nodes[gate->bits[i]][mincol];
+
+		switch (gate->mstate)
+		{
+			case MSTATE_UNKNOWN:
+				node->type = NODE_MEASURE_UNKNOWN;
+				break;
+			case MSTATE_KNOWN:
+				node->type = gate->mval >> gate->nbits - 1 - i & 1?
+					NODE_MEASURE_1: NODE_MEASURE_0;
+				break;
+			default:
+				error("Unkown measure state: %d", gate->mstate);
+		}
+		node->past = past;
+		idx[gate->bits[i]] = mincol + 1;
+	}
+}
+
 static void add_barrier(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const struct gate * gate, int * pad, bool past)
 {
 	int mincol = 0;
@@ -325,20 +398,26 @@ static void add_barrier(struct node nodes[NQBITS][PRIMAXCOLS], int * idx, const
 	}
 }
 
-static void add_nodes(const struct gate * gates, int ngates, int i,
+// returns where it stopped: the end of the block it was called in, or ngates
+static int add_nodes(const struct gate * gates, int ngates, int i,
 	struct node nodes[NQBITS][PRIMAXCOLS], int * idx, int * pad, int * cnt)
 {
 	for (; i < ngates; i++)
 	{
 		cnt[i] += 1;
-		if (gates[i].type == GATE_Uf)
+		if (gates[i].type == GATE_Uf || gates[i].type == GATE_Pf)
 			add_Uf(nodes, idx, &gates[i], pad, gates[i].cnt >= cnt[i]);
 		else if (gates[i].type == GATE_SWAP)
 			add_swap(nodes, idx, &gates[i], gates[i].cnt >= cnt[i]);
+		else if (gates[i].type == GATE_D || gates[i].type == GATE_F || gates[i].type == GATE_G)
+			add_register(nodes, idx, &gates[i], gates[i].cnt >= cnt[i]);
+		else if (gates[i].type == GATE_MEASURE)
+			add_measure(nodes, idx, &gates[i], gates[i].cnt >= cnt[i]);
 		else if (gates[i].type == GATE_BARRIER_BEGIN)
 		{
 			add_barrier(nodes, idx, &gates[i], pad, gates[i].cnt >= cnt[i]);
-			while (gates[i].barrier.end)
+			// a --stream run may not have the end of the block yet
+			while (gates[i].barrier.end && gates[i].barrier.end < ngates)
 			{
 				for (int j = 0; j < gates[i].barrier.repeat; j++)
 				{
@@ -349,30 +428,37 @@ static void add_nodes(const struct gate * gates, int ngates, int i,
 			}
 		}
 		else if (gates[i].type == GATE_BARRIER_END)
-			return;
+			return i;
 		else
 			add_gate(nodes, idx, &gates[i], pad, gates[i].cnt >= cnt[i]);
 	}
+	return ngates;
 }
 
-void print_circuit(const struct gate * gates, int ngates)
+void print_circuit(FILE * out, const struct gate * gates, int ngates)
 {
 	struct node nodes[NQBITS][PRIMAXCOLS] = {0};
 	int idx[NQBITS] = {0};
-	int pad[MAXGATES] = {0};
+	int pad[PRIMAXCOLS] = {0};
 	int len = 0;
 	int nqbits = 0;
-	int cnt[MAXGATES] = {0};
+	int * cnt = calloc(ngates? ngates: 1, sizeof(int));
 
 	const char * pastc = "", * setcmes = "", * resetc = "";
-	if (docolor())
+	if (docolor(out))
 	{
 		pastc = "\x1b[34;1m"; // blue
 		setcmes = "\x1b[32;1m"; // green
 		resetc = "\x1b[0m";
 	}
 
-	add_nodes(gates, ngates, 0, nodes, idx, pad, cnt);
+	if (!cnt)
+		error("Out of memory");
+
+	// stray ends come from blocks whose start is no longer buffered
+	for (int i = 0; (i = add_nodes(gates, ngates, i, nodes, idx, pad, cnt)) < ngates; i++)
+		add_barrier(nodes, idx, &gates[i], pad, gates[i].cnt > 0);
+	free(cnt);
 
 	for (int i = 0; i < NQBITS; i++)
 	{
@@ -402,35 +488,35 @@ void print_circuit(const struct gate * gates, int ngates)
 	{
 		if (i == 0)
 		{
-			printf("   =");
+			fprintf(out, "   =");
 			for (int j = 0; j < len; j++)
-				printf("%.*s====%.*s", pad[j]/2, BORDERPAD, (pad[j] + 1)/2, BORDERPAD);
-			printf("\n");
+				fprintf(out, "%.*s====%.*s", pad[j]/2, BORDERPAD, (pad[j] + 1)/2, BORDERPAD);
+			fprintf(out, "\n");
 		}
 		else
 		{
-			printf("    ");
+			fprintf(out, "    ");
 			for (int j = 0; j < len; j++)
 			{
 				const char * setc = nodes[i][j].past? pastc: "";
 
 				if (nodes[i][j].wire & WIRE_TOP)
-					printf("%.*s %s|%s  %.*s", pad[j]/2, SPACEPAD, setc, resetc, (pad[j] + 1)/2, SPACEPAD);
+					fprintf(out, "%.*s %s|%s  %.*s", pad[j]/2, SPACEPAD, setc, resetc, (pad[j] + 1)/2, SPACEPAD);
 				else if (nodes[i][j].wire & WIRE_UfTOP)
-					printf("%.*s%s[ %c ]%s %.*s", pad[j]/2 - 1, SPACEPAD,
+					fprintf(out, "%.*s%s[ %c ]%s %.*s", pad[j]/2 - 1, SPACEPAD,
 							setc, nodes[i][j].fname, resetc, (pad[j] + 1)/2 - 1, SPACEPAD);
 				else if (nodes[i][j].wire & WIRE_BOXTOP)
-					printf("%.*s%s[   ]%s %.*s", pad[j]/2 - 1, SPACEPAD,
+					fprintf(out, "%.*s%s[   ]%s %.*s", pad[j]/2 - 1, SPACEPAD,
 							setc, resetc, (pad[j] + 1)/2 - 1, SPACEPAD);
 				else if (nodes[i][j].type == NODE_BARRIER)
-					printf(" |  ");
+					fprintf(out, " |  ");
 				else
-					printf("%.*s    %.*s", pad[j]/2, SPACEPAD, (pad[j] + 1)/2, SPACEPAD);
+					fprintf(out, "%.*s    %.*s", pad[j]/2, SPACEPAD, (pad[j] + 1)/2, SPACEPAD);
 			}
-			printf("\n");
+			fprintf(out, "\n");
 		}
 
-		printf("q%d -", i);
+		fprintf(out, "q%d -", i);
 		for (int j = 0; j < len; j++)
 		{
 			const char * setc = nodes[i][j].past? pastc: "";
@@ -439,62 +525,74 @@ void print_circuit(const struct gate * gates, int ngates)
 			{
 				case NODE_NONE:
 					if (nodes[i][j].wire == WIRE_BOTH)
-						printf("%.*s-%s|%s--%.*s", pad[j]/2, LINEPAD,
+						fprintf(out, "%.*s-%s|%s--%.*s", pad[j]/2, LINEPAD,
 								setc, resetc, (pad[j] + 1)/2, LINEPAD);
 					else
-						printf("%.*s----%.*s", pad[j]/2, LINEPAD, (pad[j] + 1)/2, LINEPAD);
+						fprintf(out, "%.*s----%.*s", pad[j]/2, LINEPAD, (pad[j] + 1)/2, LINEPAD);
 					continue;
 				case NODE_CTRL:
-					printf("%.*s-%so%s--%.*s", pad[j]/2, LINEPAD,
+					fprintf(out, "%.*s-%so%s--%.*s", pad[j]/2, LINEPAD,
 							setc, resetc, (pad[j] + 1)/2, LINEPAD);
 					continue;
 				case NODE_X:
-					printf("%.*s%s(+)%s-%.*s", pad[j]/2, LINEPAD,
+					fprintf(out, "%.*s%s(+)%s-%.*s", pad[j]/2, LINEPAD,
 							setc, resetc, (pad[j] + 1)/2, LINEPAD);
 					continue;
 				case NODE_H:
-					printf("%.*s%s[H]%s-%.*s", pad[j]/2, LINEPAD,
+					fprintf(out, "%.*s%s[H]%s-%.*s", pad[j]/2, LINEPAD,
 							setc, resetc, (pad[j] + 1)/2, LINEPAD);
 					continue;
 				case NODE_Z:
-					printf("%.*s%s[Z]%s-%.*s", pad[j]/2, LINEPAD,
+					fprintf(out, "%.*s%s[Z]%s-%.*s", pad[j]/2, LINEPAD,
 							setc, resetc, (pad[j] + 1)/2, LINEPAD);
 					continue;
+				case NODE_D:
+					fprintf(out, "%.*s%s[D]%s-%.*s", pad[j]/2, LINEPAD,
+							setc, resetc, (pad[j] + 1)/2, LINEPAD);
+					continue;
+				case NODE_F:
+					fprintf(out, "%.*s%s[F]%s-%.*s", pad[j]/2, LINEPAD,
+							setc, resetc, (pad[j] + 1)/2, LINEPAD);
+					continue;
+				case NODE_G:
+					fprintf(out, "%.*s%s[%c]%s-%.*s", pad[j]/2, LINEPAD,
+							setc, nodes[i][j].fname, resetc, (pad[j] + 1)/2, LINEPAD);
+					continue;
 				case NODE_SWAP:
-					printf("%.*s-%sX%s--%.*s", pad[j]/2, LINEPAD,
+					fprintf(out, "%.*s-%sX%s--%.*s", pad[j]/2, LINEPAD,
 							setc, resetc, (pad[j] + 1)/2, LINEPAD);
 					continue;
 				case NODE_Uf:
-					printf("%.*s%s[ %c ]%s-%.*s", pad[j]/2 - 1, LINEPAD,
+					fprintf(out, "%.*s%s[ %c ]%s-%.*s", pad[j]/2 - 1, LINEPAD,
 							setc, nodes[i][j].fname, resetc, (pad[j] + 1)/2 - 1, LINEPAD);
 					continue;
 				case NODE_BOX:
-					printf("%.*s%s[   ]%s-%.*s", pad[j]/2 - 1, LINEPAD,
+					fprintf(out, "%.*s%s[   ]%s-%.*s", pad[j]/2 - 1, LINEPAD,
 							setc, resetc, (pad[j] + 1)/2 - 1, LINEPAD);
 					continue;
 				case NODE_MEASURE_UNKNOWN:
-					printf("%.*s%s[?]%s-%.*s", pad[j]/2, LINEPAD,
+					fprintf(out, "%.*s%s[?]%s-%.*s", pad[j]/2, LINEPAD,
 							setc, resetc, (pad[j] + 1)/2, LINEPAD);
 					continue;
 				case NODE_MEASURE_0:
-					printf("%.*s%s[%s%s0%s%s]%s-%.*s", pad[j]/2, LINEPAD,
+					fprintf(out, "%.*s%s[%s%s0%s%s]%s-%.*s", pad[j]/2, LINEPAD,
 							setc, resetc, setcmes, resetc, setc, resetc, (pad[j] + 1)/2, LINEPAD);
 					continue;
 				case NODE_MEASURE_1:
-					printf("%.*s%s[%s%s1%s%s]%s-%.*s", pad[j]/2, LINEPAD,
+					fprintf(out, "%.*s%s[%s%s1%s%s]%s-%.*s", pad[j]/2, LINEPAD,
 							setc, resetc, setcmes, resetc, setc, resetc, (pad[j] + 1)/2, LINEPAD);
 					continue;
 				case NODE_BARRIER:
-					printf("-|--");
+					fprintf(out, "-|--");
 					continue;
 				default:
 					error("Uknown node type: %d", nodes[i][j].type);
 			}
 		}
-		printf("\n");
+		fprintf(out, "\n");
 	}
-	printf("   =");
+	fprintf(out, "   =");
 	for (int j = 0; j < len; j++)
-		printf("%.*s====%.*s", pad[j]/2, BORDERPAD, (pad[j] + 1)/2, BORDERPAD);
-	printf("\n");
+		fprintf(out, "%.*s====%.*s", pad[j]/2, BORDERPAD, (pad[j] + 1)/2, BORDERPAD);
+	fprintf(out, "\n");
 }
@@ -78,35 +78,38 @@ static void extract_ggcd(int fracs[NAMPS][2][2], int ggcd[2][2])
 	}
 }
 
-static void get_fracs(struct amp state[NAMPS], int fracs[NAMPS][2][2])
+static void get_frac(struct amp a, int frac[2][2])
 {
-	for (int i = 0; i < NAMPS; i++)
+	if (a.ones == 0)
 	{
-		if (state[i].ones == 0)
-		{
-			fracs[i][0][0] = 0;
-			fracs[i][0][1] = 1;
-		}
-		else
-		{
-			int d = gcd(state[i].ones, 1 << 30);
-			fracs[i][0][0] = state[i].ones / d;
-			fracs[i][0][1] = (1 << 30) / d;
-		}
-		if (state[i].root2s == 0)
-		{
-			fracs[i][1][0] = 0;
-			fracs[i][1][1] = 1;
-		}
-		else
-		{
-			int d = gcd(state[i].root2s, 1 << 30);
-			fracs[i][1][0] = state[i].root2s / d;
-			fracs[i][1][1] = (1 << 30) / d;
-		}
+		frac[0][0] = 0;
+		frac[0][1] = 1;
+	}
+	else
+	{
+		int d = gcd(a.ones, 1 << 30);
+		frac[0][0] = a.ones / d;
+		frac[0][1] = (1 << 30) / d;
+	}
+	if (a.root2s == 0)
+	{
+		frac[1][0] = 0;
+		frac[1][1] = 1;
+	}
+	else
+	{
+		int d = gcd(a.root2s, 1 << 30);
+		frac[1][0] = a.root2s / d;
+		frac[1][1] = (1 << 30) / d;
 	}
 }
 
+static void get_fracs(struct amp state[NAMPS], int fracs[NAMPS][2][2])
+{
+	for (int i = 0; i < NAMPS; i++)
+		get_frac(state[i], fracs[i]);
+}
+
 // returns length of string printed
 static int print_frac(int frac[2][2], char buf[FRACBUFSIZ])
 {
@@ -148,7 +151,7 @@ static int print_frac(int frac[2][2], char buf[FRACBUFSIZ])
 	return len;
 }
 
-static void print_fracs(int fracs[NAMPS][2][2])
+static void print_fracs(FILE * out, int fracs[NAMPS][2][2])
 {
 	char buf[FRACBUFSIZ];
 	int ggcd[2][2];
@@ -158,37 +161,55 @@ static void print_fracs(int fracs[NAMPS][2][2])
 	if (ggcd[0][1] > 1 || ggcd[1][1] > 1)
 	{
 		print_frac(ggcd, buf);
-		printf("%s", buf);
+		fprintf(out, "%s", buf);
 	}
 
-	printf("[");
+	fprintf(out, "[");
 	for (int i = 0; i < NAMPS; i++)
 	{
 		print_frac(fracs[i], buf);
-		printf("%s%s", buf, i == NAMPS - 1? "": ", ");
+		fprintf(out, "%s%s", buf, i == NAMPS - 1? "": ", ");
 	}
-	printf("]^T\n");
+	fprintf(out, "]^T\n");
 }
 
 double todouble(int frac[2][2])
 {
-#define SQRT2 1.4142135623730951L
 	double d = (double)frac[0][0]/(double)frac[0][1];
 	d += (double)frac[1][0]*SQRT2/(double)frac[1][1];
 	return d;
 }
 
-static void print_indexed(int fracs[NAMPS][2][2], int bits)
+static void print_qubits(FILE * out, int bits)
 {
-	char bufs[NAMPS][FRACBUFSIZ];
-	int maxlen = 0;
-
 	for (int i = 0; i < NQBITS; i++)
 	{
 		if (bits & 1 << NQBITS - 1 >> i)
-			printf(" q%d", i);
+			fprintf(out, " q%d", i);
 	}
-	printf("\n");
+	fprintf(out, "\n");
+}
+
+// the bits of index i that are in bits, first qubit first
+static void print_index(FILE * out, int i, int bits)
+{
+	for (int j = NQBITS - 1; j >= 0; j--)
+	{
+		if (~bits & 1 << j)
+			continue;
+		if (i & (1 << j))
+			fprintf(out, "1");
+		else
+			fprintf(out, "0");
+	}
+}
+
+static void print_indexed(FILE * out, int fracs[NAMPS][2][2], int bits)
+{
+	char bufs[NAMPS][FRACBUFSIZ];
+	int maxlen = 0;
+
+	print_qubits(out, bits);
 
 	for (int i = 0; i < NAMPS; i++)
 	{
@@ -214,31 +235,23 @@ static void print_indexed(int fracs[NAMPS][2][2], int bits)
 
 		if (fracs[i][0][0] != 0 || fracs[i][1][0] != 0)
 		{
-			for (int j = NQBITS - 1; j >= 0; j--)
-			{
-				if (~bits & 1 << j)
-					continue;
-				if (i & (1 << j))
-					printf("1");
-				else
-					printf("0");
-			}
-			printf(": %*s (% lf)\n", maxlen, bufs[i], todouble(fracs[i]));
+			print_index(out, i, bits);
+			fprintf(out, ": %*s (% lf)\n", maxlen, bufs[i], todouble(fracs[i]));
 		}
 	}
 }
 
-void print_state(int bits, struct amp * s)
+void print_state(FILE * out, int bits, struct amp * s)
 {
 	int fracs[NAMPS][2][2];
 
 	get_fracs(s, fracs);
-//	print_fracs(fracs);
-	printf("State:");
-	print_indexed(fracs, bits);
+//	print_fracs(out, fracs);
+	fprintf(out, "State:");
+	print_indexed(out, fracs, bits);
 }
 
-void print_probs(int bits, struct amp * s)
+void print_probs(FILE * out, int bits, struct amp * s)
 {
 	int fracs[NAMPS][2][2];
 	//struct amp copy[NAMPS];
@@ -249,6 +262,67 @@ void print_probs(int bits, struct amp * s)
 
 	//get_fracs(copy, fracs);
 	get_fracs(s, fracs);
-	printf("Probabilities:");
-	print_indexed(fracs, bits);
+	fprintf(out, "Probabilities:");
+	print_indexed(out, fracs, bits);
+}
+
+// entry r, c of rho reduced to the qubits in bits, tracing out the others
+static struct amp reduced(const struct amp * rho, int bits, int r, int c)
+{
+	struct amp sum = {0, 0};
+	int free = NAMPS - 1 & ~bits;
+	int o = 0;
+
+	do
+	{
+		add(&sum, &rho[(size_t)(r | o) * NAMPS + (c | o)]);
+		o = o - free & free;
+	} while (o);
+	return sum;
+}
+
+// the nonzero entries of the density matrix of the qubits in bits, as the
+// row and the column index, in two passes to line the values up
+void print_rho(FILE * out, int bits, const struct amp * rho)
+{
+	char buf[FRACBUFSIZ];
+	int maxlen = 0;
+
+	bits &= NAMPS - 1;
+	fprintf(out, "Density matrix:");
+	print_qubits(out, bits);
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		int r = 0;
+
+		do
+		{
+			int c = 0;
+
+			do
+			{
+				struct amp a = reduced(rho, bits, r, c);
+				int frac[2][2];
+				int len;
+
+				if (a.ones || a.root2s)
+				{
+					get_frac(a, frac);
+					len = print_frac(frac, buf);
+					if (!pass && len > maxlen)
+						maxlen = len;
+					else if (pass)
+					{
+						print_index(out, r, bits);
+						fprintf(out, " ");
+						print_index(out, c, bits);
+						fprintf(out, ": %*s (% lf)\n", maxlen, buf, todouble(frac));
+					}
+				}
+				c = c - bits & bits;
+			} while (c);
+			r = r - bits & bits;
+		} while (r);
+	}
 }
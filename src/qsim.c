@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "main.h"
+#include "qsim.h"
+
+
+THREAD_LOCAL struct qsim_ctx * qsim_active;
+
+void qsim_fail(const char * fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (qsim_active)
+	{
+		vsnprintf(qsim_active->errmsg, ERRBUFSIZ, fmt, ap);
+		va_end(ap);
+		longjmp(qsim_active->jmp, 1);
+	}
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+struct qsim_ctx * ctx_new(void)
+{
+	struct qsim_ctx * ctx = calloc(1, sizeof(*ctx));
+
+	if (!ctx)
+		return NULL;
+	ctx->state = calloc(NAMPS, sizeof(struct amp));
+	ctx->temp = calloc(NAMPS, sizeof(struct amp));
+	if (!ctx->state || !ctx->temp)
+	{
+		ctx_free(ctx);
+		return NULL;
+	}
+	ctx->state[0].ones = DENOMINATOR;
+	ctx->namps = NAMPS;
+	ctx->out = stdout;
+	ctx->weight = 1;
+	ctx->seed = (uint64_t)time(NULL);
+	rng_seed(&ctx->rng, ctx->seed);
+	return ctx;
+}
+
+void ctx_free(struct qsim_ctx * ctx)
+{
+	if (!ctx)
+		return;
+	if (ctx->statemap)
+		munmap(ctx->statemap, ctx->statelen);
+	else
+	{
+		free(ctx->state);
+		free(ctx->temp);
+	}
+	rho_free(ctx);
+	if (ctx->gatecap)
+		free(ctx->gates);
+	free(ctx->line);
+	for (int f = 0; f < NFUNCS; f++)
+	{
+		free(ctx->funcs[f].vals);
+		free(ctx->funcs[f].anf);
+	}
+	for (int m = 0; m < NMATS; m++)
+		free(ctx->mats[m].m);
+	if (ctx->map)
+		munmap(ctx->map, ctx->maplen);
+	free(ctx);
+}
+
+// makes room for ngates gates
+void ctx_reserve(struct qsim_ctx * ctx, int ngates)
+{
+	struct gate * gates;
+	int cap = ctx->gatecap? ctx->gatecap: 64;
+
+	if (ngates <= ctx->gatecap)
+		return;
+	while (cap < ngates)
+		cap *= 2;
+	if (!(gates = realloc(ctx->gatecap? ctx->gates: NULL, cap * sizeof(*gates))))
+		error("Out of memory");
+	if (!ctx->gatecap && ctx->ngates)
+		memcpy(gates, ctx->gates, ctx->ngates * sizeof(*gates));
+	ctx->gates = gates;
+	ctx->gatecap = cap;
+}
+
+// gives dst its own copy of src's circuit
+void ctx_copy_gates(struct qsim_ctx * dst, const struct qsim_ctx * src)
+{
+	ctx_reserve(dst, src->ngates);
+	if (src->ngates)
+		memcpy(dst->gates, src->gates, src->ngates * sizeof(struct gate));
+	dst->ngates = src->ngates;
+}
+
+// back to |0...0> with nothing executed or measured yet
+void ctx_reset(struct qsim_ctx * ctx)
+{
+	memset(ctx->state, 0, NAMPS * sizeof(struct amp));
+	ctx->state[0].ones = DENOMINATOR;
+	if (ctx->rho)
+		rho_reset(ctx);
+	ctx->mmask = ctx->mvals = 0;
+	ctx->weight = 1;
+	for (int i = 0; i < ctx->ngates; i++)
+	{
+		ctx->gates[i].cnt = 0;
+		if (ctx->gates[i].type == GATE_MEASURE)
+			ctx->gates[i].mstate = MSTATE_UNKNOWN;
+	}
+}
+
+int qsim_load(struct qsim_ctx ** pctx, const char * path)
+{
+	struct qsim_ctx * prev = qsim_active;
+	struct qsim_ctx * ctx;
+	FILE * in;
+
+	if (!(*pctx = ctx = ctx_new()))
+		return QSIM_ENOMEM;
+
+	if (!(in = fopen(path, "r")))
+	{
+		snprintf(ctx->errmsg, ERRBUFSIZ, "Failed to open %s: %s", path, strerror(errno));
+		return QSIM_EIO;
+	}
+
+	if (setjmp(ctx->jmp))
+	{
+		qsim_active = prev;
+		fclose(in);
+		return QSIM_EPARSE;
+	}
+	qsim_active = ctx;
+	parse_circuit(ctx, in);
+	qsim_active = prev;
+
+	fclose(in);
+	return QSIM_OK;
+}
+
+int qsim_run(struct qsim_ctx * ctx)
+{
+	struct qsim_ctx * prev = qsim_active;
+
+	if (setjmp(ctx->jmp))
+	{
+		qsim_active = prev;
+		return QSIM_ERUN;
+	}
+	qsim_active = ctx;
+	ctx_reset(ctx);
+	run(ctx, ctx->gates, ctx->ngates, 0);
+	qsim_active = prev;
+
+	return QSIM_OK;
+}
+
+int qsim_probs(struct qsim_ctx * ctx, double * probs, size_t n)
+{
+	if (n < NAMPS)
+	{
+		snprintf(ctx->errmsg, ERRBUFSIZ, "Probability buffer too small: "
+				"%zu given, %d needed", n, NAMPS);
+		return QSIM_EINVAL;
+	}
+
+	for (int i = 0; i < NAMPS; i++)
+	{
+		double amp = amp_value(ctx->state[i]);
+		probs[i] = amp * amp;
+	}
+	return QSIM_OK;
+}
+
+void qsim_free(struct qsim_ctx * ctx)
+{
+	ctx_free(ctx);
+}
+
+const char * qsim_errmsg(const struct qsim_ctx * ctx)
+{
+	return ctx->errmsg;
+}
+
+int qsim_nqubits(void)
+{
+	return NQBITS;
+}
+
+size_t qsim_namps(void)
+{
+	return NAMPS;
+}
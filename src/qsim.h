@@ -0,0 +1,50 @@
+#ifndef QSIM_H
+#define QSIM_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#define QSIM_API
+#else
+#define QSIM_API __attribute__((visibility("default")))
+#endif
+
+// Error codes returned by the API. Anything nonzero is a failure and
+// qsim_errmsg() holds a description.
+enum qsim_status {
+	QSIM_OK,
+	QSIM_ENOMEM,
+	QSIM_EIO,
+	QSIM_EPARSE,
+	QSIM_ERUN,
+	QSIM_EINVAL
+};
+
+struct qsim_ctx;
+
+// Parses the circuit at path into a new context. On failure *ctx is still
+// set (unless out of memory) so the message can be read, and must be freed.
+QSIM_API int qsim_load(struct qsim_ctx ** ctx, const char * path);
+
+// Runs the loaded circuit from the start, resetting the state first.
+QSIM_API int qsim_run(struct qsim_ctx * ctx);
+
+// Writes the probability of every basis state into probs, which must hold
+// qsim_namps() doubles. Index bit (nqubits - 1 - q) is qubit q.
+QSIM_API int qsim_probs(struct qsim_ctx * ctx, double * probs, size_t n);
+
+QSIM_API void qsim_free(struct qsim_ctx * ctx);
+
+QSIM_API const char * qsim_errmsg(const struct qsim_ctx * ctx);
+QSIM_API int qsim_nqubits(void);
+QSIM_API size_t qsim_namps(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <linux/futex.h>
+#include "main.h"
+
+// Under --shards p the state lives in POSIX shared memory, split into 2^p
+// shards of NAMPS >> p amplitudes, each run by its own process. The qubits
+// whose bits select the shard, the top p physical positions, are global, and
+// the rest are local. Logical qubits are mapped to physical positions, and a
+// gate runs on every shard independently, through the usual kernels on that
+// shard alone, once every qubit it writes is local. Global controls just
+// decide whether a shard runs the gate, and the global inputs of U and P are
+// fixed by the shard, so each shard runs the gate on its function of the
+// local inputs alone. When a gate writes a global qubit, it is swapped with the local qubit whose next use is
+// furthest away, which is the only time the processes exchange amplitudes or
+// wait for each other. Measurements and commands run in the first process
+// over the whole state, with the mapping put back to the identity first.
+
+#define POLLMS 100 // how often a waiting shard checks that the others are alive
+
+// A barrier across the shard processes that gives up once any of them is
+// gone. A waiting shard 0 reaps children that exited, which none may do
+// before the barrier is passed, and marks the run dead, and the other shards
+// leave as soon as they see that. It takes no locks, which a shard killed
+// while holding one would never give back, and sleeps on a futex on pass.
+struct shmbarrier {
+	atomic_int count;
+	atomic_int pass;
+	atomic_int dead;
+};
+
+struct shm {
+	struct shmbarrier barrier;
+	char pad[64 - sizeof(struct shmbarrier) % 64];
+	struct amp state[NAMPS];
+};
+
+struct shard {
+	struct qsim_ctx * ctx;
+	struct shm * shm;
+	int p;
+	int id;
+	unsigned flags; // of the run, before the other shards went quiet
+	int phys[NQBITS]; // physical position of each logical qubit
+	int swaps;
+	pid_t * pids; // of the other shards, in shard 0 only
+	pid_t parent; // shard 0, in the others
+};
+
+static inline int is_global(const struct shard * sh, int pos)
+{
+	return pos < sh->p;
+}
+
+// whether another shard has exited or been killed
+static int peer_gone(struct shard * sh)
+{
+	if (!sh->id)
+	{
+		for (int s = 1; s < 1 << sh->p; s++)
+		{
+			int status;
+
+			if (sh->pids[s] && waitpid(sh->pids[s], &status, WNOHANG) == sh->pids[s])
+			{
+				sh->pids[s] = 0;
+				return 1;
+			}
+		}
+		return 0;
+	}
+	return getppid() != sh->parent;
+}
+
+static void shard_wait(struct shard * sh)
+{
+	static const struct timespec poll = {0, POLLMS * 1000000L};
+	struct shmbarrier * b = &sh->shm->barrier;
+	int pass = atomic_load(&b->pass);
+
+	if (atomic_fetch_add(&b->count, 1) + 1 == 1 << sh->p)
+	{
+		atomic_store(&b->count, 0);
+		atomic_fetch_add(&b->pass, 1);
+		syscall(SYS_futex, &b->pass, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+	while (atomic_load(&b->pass) == pass && !atomic_load(&b->dead))
+	{
+		syscall(SYS_futex, &b->pass, FUTEX_WAIT, pass, &poll, NULL, 0);
+		if (atomic_load(&b->pass) == pass && peer_gone(sh))
+		{
+			atomic_store(&b->dead, 1);
+			syscall(SYS_futex, &b->pass, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+		}
+	}
+
+	if (atomic_load(&b->pass) == pass && sh->id)
+		_exit(EXIT_FAILURE);
+	if (atomic_load(&b->pass) == pass)
+		error("A shard process failed");
+}
+
+// Swaps physical positions a and b, and the logical qubits there. Each
+// process swaps the pairs whose a bit is set in its own shard, so every pair
+// is swapped once, and when either position is global the pair may be in two
+// shards, so everyone waits before and after.
+static void phys_swap(struct shard * sh, int a, int b)
+{
+	int global = is_global(sh, a) || is_global(sh, b);
+	int ma = ctrlbit(a), mb = ctrlbit(b);
+	int n = NAMPS >> sh->p;
+	int base = sh->id * n;
+
+	if (global)
+		shard_wait(sh);
+	for (int i = base; i < base + n; i++)
+		if (i & ma && !(i & mb))
+		{
+			struct amp temp = sh->shm->state[i];
+
+			sh->shm->state[i] = sh->shm->state[i ^ ma ^ mb];
+			sh->shm->state[i ^ ma ^ mb] = temp;
+		}
+	if (global)
+	{
+		shard_wait(sh);
+		sh->swaps++;
+	}
+
+	for (int q = 0; q < NQBITS; q++)
+		if (sh->phys[q] == a)
+			sh->phys[q] = b;
+		else if (sh->phys[q] == b)
+			sh->phys[q] = a;
+}
+
+// the qubits g writes, as logical ctrlbit()s: not its controls, nor the
+// inputs of U, nor any qubit of P, which only changes signs
+static int targets(const struct gate * g)
+{
+	int t = 0;
+
+	switch (g->type)
+	{
+		case GATE_Uf:
+			for (int b = 0; b < (g->nout? g->nout: 1); b++)
+				t |= ctrlbit(g->bits[g->func->argc + b]);
+			return t;
+		case GATE_Pf:
+			return 0;
+		default:
+			return gate_qubits(g) & ~g->ctrl;
+	}
+}
+
+// how many gates after gate i the logical qubit q is next a target, or
+// INT_MAX if never, going by the order of the gates in the file
+static int next_use(const struct qsim_ctx * ctx, int i, int q)
+{
+	for (int j = i + 1; j < ctx->ngates; j++)
+		if (is_unitary(ctx->gates[j].type) && targets(&ctx->gates[j]) & ctrlbit(q))
+			return j - i;
+	return INT_MAX;
+}
+
+// makes every target of gate i local, evicting the local qubits that are
+// needed again last
+static void localize(struct shard * sh, int i)
+{
+	const struct gate * g = &sh->ctx->gates[i];
+	int t = targets(g);
+
+	for (int q = 0; q < NQBITS; q++)
+	{
+		int victim = -1, best = -1;
+
+		if (!(t & ctrlbit(q)) || !is_global(sh, sh->phys[q]))
+			continue;
+		for (int v = 0; v < NQBITS; v++)
+		{
+			int d;
+
+			if (t & ctrlbit(v) || is_global(sh, sh->phys[v]))
+				continue;
+			if ((d = next_use(sh->ctx, i, v)) > best)
+			{
+				best = d;
+				victim = v;
+			}
+		}
+		phys_swap(sh, sh->phys[q], sh->phys[victim]);
+	}
+}
+
+// Fixes the inputs of the Uf or Pf gate g, its bits already physical, that
+// are global to their values in this shard, leaving g on f, filled in as its
+// function of the local inputs alone, with vals for a function with several
+// outputs. The table of f is made for this shard and gate, so g runs by
+// scanning it.
+static void fix_inputs(const struct shard * sh, struct gate * g, struct func * f, int * vals)
+{
+	const struct func * orig = g->func;
+	int argc = orig->argc;
+	int base = sh->id * (NAMPS >> sh->p);
+	int local[NQBITS], nlocal = 0, fixed = 0;
+	int nout = g->type == GATE_Pf? 0: g->nout? g->nout: 1;
+
+	for (int k = 0; k < argc; k++)
+		if (!is_global(sh, g->bits[k]))
+			local[nlocal++] = k;
+		else if (base & ctrlbit(g->bits[k]))
+			fixed |= 1 << argc - 1 - k;
+	if (nlocal == argc)
+		return;
+
+	memset(f, 0, sizeof(*f));
+	f->name = orig->name;
+	f->argc = nlocal;
+	f->vals = orig->vals? vals: NULL;
+	for (int x = 0; x < 1 << nlocal; x++)
+	{
+		int y = fixed;
+
+		for (int j = 0; j < nlocal; j++)
+			if (x >> nlocal - 1 - j & 1)
+				y |= 1 << argc - 1 - local[j];
+		f->map[x >> 6] |= (uint64_t)func_bit(orig, y) << (x & 63);
+		if (orig->vals)
+			vals[x] = orig->vals[y];
+	}
+
+	for (int j = 0; j < nlocal; j++)
+		g->bits[j] = g->bits[local[j]];
+	memmove(&g->bits[nlocal], &g->bits[argc], nout * sizeof(int));
+	g->func = f;
+	if (!g->nout)
+		g->ufmode = UF_TABLE;
+}
+
+// runs unitary gate i on this process's shard
+static void shard_gate(struct shard * sh, int i)
+{
+	struct gate g = sh->ctx->gates[i];
+	int n = gate_qubits(&sh->ctx->gates[i]) & ~g.ctrl;
+	int ctrl = 0, need = 0;
+	struct func f;
+	int vals[NAMPS];
+
+	localize(sh, i);
+	for (int b = 0; b < popcount(n); b++)
+		g.bits[b] = sh->phys[g.bits[b]];
+	for (int q = 0; q < NQBITS; q++)
+		if (g.ctrl & ctrlbit(q))
+		{
+			if (is_global(sh, sh->phys[q]))
+				need |= ctrlbit(sh->phys[q]);
+			else
+				ctrl |= ctrlbit(sh->phys[q]);
+		}
+	// the global bits of this shard's indices are its number
+	if ((sh->id * (NAMPS >> sh->p) & need) != need)
+		return;
+	g.ctrl = ctrl;
+	if (g.type == GATE_Uf || g.type == GATE_Pf)
+		fix_inputs(sh, &g, &f, vals);
+	apply_unitary(sh->ctx, &g);
+}
+
+// puts every logical qubit back at its own position
+static void unmap(struct shard * sh)
+{
+	for (int q = 0; q < NQBITS; q++)
+		if (sh->phys[q] != q)
+			phys_swap(sh, q, sh->phys[q]);
+}
+
+static void shard_run(struct shard * sh)
+{
+	struct qsim_ctx * ctx = sh->ctx;
+	struct amp * local = sh->shm->state + sh->id * (NAMPS >> sh->p);
+	struct cursor cur;
+
+	ctx->state = local;
+	ctx->namps = NAMPS >> sh->p;
+	cursor_init(&cur, 0);
+	while (cur.pc < ctx->ngates)
+	{
+		enum gatetype type = ctx->gates[cur.pc].type;
+
+		if (is_unitary(type))
+		{
+			ctx->gates[cur.pc].cnt++;
+			shard_gate(sh, cur.pc++);
+			continue;
+		}
+		if (type == GATE_MEASURE || is_command(type) && !(sh->flags & RUN_QUIET))
+		{
+			unmap(sh);
+			shard_wait(sh);
+			ctx->state = sh->shm->state;
+			ctx->namps = NAMPS;
+			run_step(ctx, ctx->gates, ctx->ngates, &cur);
+			ctx->state = local;
+			ctx->namps = NAMPS >> sh->p;
+			shard_wait(sh);
+			continue;
+		}
+		run_step(ctx, ctx->gates, ctx->ngates, &cur);
+	}
+	unmap(sh);
+}
+
+// every qubit a gate writes must fit in the local qubits of 2^p shards
+void check_shard_width(const struct gate * g, int p, const char * where, int n)
+{
+	int t = popcount(targets(g));
+
+	if (t > NQBITS - p)
+		error("%s %d: %c writes %d qubits, more than the %d local to each of %d shards",
+				where, n, rgatemap[g->type], t, NQBITS - p, 1 << p);
+}
+
+// Runs the circuit over 2^p processes, this one included as shard 0, and
+// leaves the final state in ctx->state.
+void run_sharded(struct qsim_ctx * ctx, int p)
+{
+	struct shard sh = {.ctx = ctx, .p = p, .flags = ctx->flags, .parent = getpid()};
+	struct amp * own = ctx->state;
+	char name[64];
+	pid_t * pids;
+	int nshards = 1 << p;
+	int fd, failed = 0;
+
+	if (p < 1 || p > MAXSHARDBITS)
+		error("Bad value for --shards: %d. Choose from 1 to %d", p, MAXSHARDBITS);
+	for (int i = 0; i < ctx->ngates; i++)
+		if (is_unitary(ctx->gates[i].type))
+			check_shard_width(&ctx->gates[i], p, "Gate", i);
+	if (!(pids = calloc(nshards, sizeof(pid_t))))
+		error("Out of memory");
+
+	snprintf(name, sizeof(name), "/qsim-%ld", (long)getpid());
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+		error("Failed to create shared memory: %s", strerror(errno));
+	shm_unlink(name);
+	if (ftruncate(fd, sizeof(struct shm))
+			|| (sh.shm = mmap(NULL, sizeof(struct shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0)) == MAP_FAILED)
+	{
+		int err = errno;
+
+		close(fd);
+		error("Failed to map shared memory: %s", strerror(err));
+	}
+	close(fd);
+
+	atomic_init(&sh.shm->barrier.count, 0);
+	atomic_init(&sh.shm->barrier.pass, 0);
+	atomic_init(&sh.shm->barrier.dead, 0);
+	memcpy(sh.shm->state, ctx->state, NAMPS * sizeof(struct amp));
+	for (int q = 0; q < NQBITS; q++)
+		sh.phys[q] = q;
+
+	fflush(NULL);
+	for (int s = 1; s < nshards; s++)
+	{
+		if ((pids[s] = fork()) < 0)
+			error("Failed to start shard %d: %s", s, strerror(errno));
+		if (!pids[s])
+		{
+			// dies with shard 0, which it would otherwise wait for forever,
+			// unless shard 0 was gone before the signal was asked for
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			if (getppid() != sh.parent)
+				_exit(EXIT_FAILURE);
+			sh.id = s;
+			ctx->flags |= RUN_QUIET | RUN_NOMEASURE;
+			shard_run(&sh);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	sh.pids = pids;
+	shard_run(&sh);
+
+	for (int s = 1; s < nshards; s++)
+	{
+		int status;
+
+		if (pids[s] && waitpid(pids[s], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			failed = 1;
+	}
+	if (ctx->flags & RUN_VERBOSE)
+		fprintf(stderr, "Shards: %d processes, %d global qubit swaps\n", nshards, sh.swaps);
+	ctx->state = own;
+	ctx->namps = NAMPS;
+	memcpy(ctx->state, sh.shm->state, NAMPS * sizeof(struct amp));
+	munmap(sh.shm, sizeof(struct shm));
+	free(pids);
+	if (failed)
+		error("A shard process failed");
+}
@@ -0,0 +1,351 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "main.h"
+
+#define SHOTBLOCK 256 // shots per pool job
+
+// Vose's alias method: one uniform draw picks a column, a second decides
+// between the column and its alias
+struct alias {
+	int n;
+	double * prob;
+	int * alias;
+};
+
+static void alias_build(struct alias * a, const double * p, int n)
+{
+	int * small = malloc(n * sizeof(int));
+	int * large = malloc(n * sizeof(int));
+	double * scaled = malloc(n * sizeof(double));
+	int nsmall = 0, nlarge = 0;
+	double total = 0;
+
+	a->n = n;
+	a->prob = malloc(n * sizeof(double));
+	a->alias = malloc(n * sizeof(int));
+	if (!small || !large || !scaled || !a->prob || !a->alias)
+		error("Out of memory");
+
+	// fixed point rounding leaves the sum slightly off 1
+	for (int i = 0; i < n; i++)
+		total += p[i];
+	for (int i = 0; i < n; i++)
+	{
+		scaled[i] = p[i] * n / total;
+		if (scaled[i] < 1)
+			small[nsmall++] = i;
+		else
+			large[nlarge++] = i;
+	}
+
+	while (nsmall && nlarge)
+	{
+		int s = small[--nsmall];
+		int l = large[--nlarge];
+
+		a->prob[s] = scaled[s];
+		a->alias[s] = l;
+		scaled[l] -= 1 - scaled[s];
+		if (scaled[l] < 1)
+			small[nsmall++] = l;
+		else
+			large[nlarge++] = l;
+	}
+	while (nlarge)
+		a->prob[large[--nlarge]] = 1;
+	while (nsmall)
+		a->prob[small[--nsmall]] = 1;
+
+	free(small);
+	free(large);
+	free(scaled);
+}
+
+static int alias_sample(const struct alias * a, struct rng * rng)
+{
+	double u = rng_double(rng) * a->n;
+	int i = (int)u;
+
+	return u - i < a->prob[i]? i: a->alias[i];
+}
+
+static void alias_free(struct alias * a)
+{
+	free(a->prob);
+	free(a->alias);
+}
+
+// packs the bits of x selected by mask (ctrlbit layout) into the low bits,
+// keeping lower qubit indices more significant
+static int compact(int x, int mask)
+{
+	int r = 0;
+	for (int i = 0; i < NQBITS; i++)
+	{
+		if (!(mask & ctrlbit(i)))
+			continue;
+		r = r << 1 | !!(x & ctrlbit(i));
+	}
+	return r;
+}
+
+// Terminal if nothing but measurements and commands can run after the first
+// measurement, including later passes of any repeat block around it.
+static int measure_terminal(const struct gate * gates, int ngates)
+{
+	int first = -1;
+
+	for (int i = 0; i < ngates; i++)
+	{
+		if (first < 0 && gates[i].type == GATE_MEASURE)
+			first = i;
+		else if (first >= 0 && is_unitary(gates[i].type))
+			return 0;
+	}
+	if (first < 0)
+		return 1;
+
+	for (int i = 0; i < first; i++)
+	{
+		if (gates[i].type != GATE_BARRIER_BEGIN && gates[i].type != GATE_BARRIER_END)
+			continue;
+		if (gates[i].barrier.end <= first || gates[i].barrier.repeat < 2)
+			continue;
+		for (int j = i + 1; j < first; j++)
+			if (is_unitary(gates[j].type))
+				return 0;
+	}
+	return 1;
+}
+
+static int has_postselect(const struct gate * gates, int ngates)
+{
+	for (int i = 0; i < ngates; i++)
+		if (gates[i].type == GATE_MEASURE && gates[i].post >= 0)
+			return 1;
+	return 0;
+}
+
+static int measured_qubits(const struct gate * gates, int ngates)
+{
+	int mask = 0;
+	for (int i = 0; i < ngates; i++)
+		if (gates[i].type == GATE_MEASURE)
+			for (int b = 0; b < gates[i].nbits; b++)
+				mask |= ctrlbit(gates[i].bits[b]);
+	return mask;
+}
+
+static void print_counts(FILE * out, const long * counts, int mask, long shots)
+{
+	int k = popcount(mask);
+
+	fprintf(out, "Shots: %ld\n", shots);
+	for (int i = 0; i < NQBITS; i++)
+		if (mask & ctrlbit(i))
+			fprintf(out, " q%d", i);
+	fprintf(out, "\n");
+
+	for (int i = 0; i < 1 << k; i++)
+	{
+		if (!counts[i])
+			continue;
+		for (int j = k - 1; j >= 0; j--)
+			putc(0x30 | (i >> j & 1), out);
+		fprintf(out, ": %ld (%lf)\n", counts[i], (double)counts[i] / shots);
+	}
+}
+
+// Everything up to the first measurement is the same for every shot, so it
+// is simulated once and each shot starts from a copy of that state.
+struct shotrun {
+	struct qsim_ctx * ctx;
+	struct amp * prefix;
+	struct cursor cur;
+	long shots;
+	int mask;
+	struct shotworker {
+		struct qsim_ctx * ctx;
+		long * counts;
+		long (* mcounts)[2]; // per gate and bit, times it measured 0 and 1
+		double weight; // postselection weights of its shots, summed
+	} * workers;
+};
+
+static void run_shot_block(struct pool * pool, void * arg, int job, int worker)
+{
+	struct shotrun * sr = arg;
+	struct shotworker * w = &sr->workers[worker];
+	struct qsim_ctx * ctx = w->ctx;
+	long end = (long)(job + 1) * SHOTBLOCK;
+
+	if (end > sr->shots)
+		end = sr->shots;
+
+	for (long shot = (long)job * SHOTBLOCK; shot < end; shot++)
+	{
+		struct cursor cur = sr->cur;
+
+		memcpy(ctx->state, sr->prefix, NAMPS * sizeof(struct amp));
+		ctx->mmask = ctx->mvals = 0;
+		ctx->weight = 1;
+		rng_philox(&ctx->rng, sr->ctx->seed, (uint64_t)shot);
+
+		while (run_until(ctx, ctx->gates, ctx->ngates, &cur, GATE_MEASURE))
+		{
+			int i = cur.pc;
+
+			run_step(ctx, ctx->gates, ctx->ngates, &cur);
+			for (int b = 0; b < ctx->gates[i].nbits; b++)
+				w->mcounts[i * NQBITS + b][ctx->gates[i].mval >> ctx->gates[i].nbits - 1 - b & 1]++;
+		}
+		w->counts[compact(ctx->mvals, sr->mask)]++;
+		w->weight += ctx->weight;
+	}
+}
+
+static void print_mcounts(FILE * out, const struct gate * gates, int ngates, long (* mcounts)[2])
+{
+	int n = 0;
+
+	fprintf(out, "Measurements:\n");
+	for (int i = 0; i < ngates; i++)
+	{
+		if (gates[i].type != GATE_MEASURE)
+			continue;
+		n++;
+		for (int b = 0; b < gates[i].nbits; b++)
+		{
+			long * c = mcounts[i * NQBITS + b];
+			long total = c[0] + c[1];
+
+			if (!total)
+				continue;
+			fprintf(out, " #%d q%d: 0: %ld (%lf) 1: %ld (%lf)\n", n, gates[i].bits[b],
+					c[0], (double)c[0] / total, c[1], (double)c[1] / total);
+		}
+	}
+}
+
+static void sample_shots(struct qsim_ctx * ctx, long shots, int nthreads, int mask,
+		long * counts, long (* mcounts)[2])
+{
+	struct shotrun sr = {.ctx = ctx, .shots = shots, .mask = mask};
+	long njobs = (shots + SHOTBLOCK - 1) / SHOTBLOCK;
+	int k = popcount(mask);
+
+	if (njobs > INT_MAX)
+		error("Too many shots");
+	if (nthreads > njobs)
+		nthreads = (int)njobs;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	sr.prefix = malloc(NAMPS * sizeof(struct amp));
+	sr.workers = calloc(nthreads, sizeof(*sr.workers));
+	if (!sr.prefix || !sr.workers)
+		error("Out of memory");
+
+	cursor_init(&sr.cur, 0);
+	run_until(ctx, ctx->gates, ctx->ngates, &sr.cur, GATE_MEASURE);
+	memcpy(sr.prefix, ctx->state, NAMPS * sizeof(struct amp));
+
+	for (int i = 0; i < nthreads; i++)
+	{
+		struct shotworker * w = &sr.workers[i];
+
+		if (!(w->ctx = ctx_new()))
+			error("Out of memory");
+		ctx_copy_gates(w->ctx, ctx);
+		w->ctx->flags = ctx->flags;
+		w->counts = calloc(1 << k, sizeof(long));
+		w->mcounts = calloc(ctx->ngates * NQBITS, sizeof(*w->mcounts));
+		if (!w->counts || !w->mcounts)
+			error("Out of memory");
+	}
+
+	pool_run(nthreads, (int)njobs, run_shot_block, &sr);
+
+	ctx->weight = 0;
+	for (int i = 0; i < nthreads; i++)
+	{
+		struct shotworker * w = &sr.workers[i];
+
+		ctx->weight += w->weight / shots;
+
+		for (int j = 0; j < 1 << k; j++)
+			counts[j] += w->counts[j];
+		for (int j = 0; j < ctx->ngates * NQBITS; j++)
+		{
+			mcounts[j][0] += w->mcounts[j][0];
+			mcounts[j][1] += w->mcounts[j][1];
+		}
+		ctx_free(w->ctx);
+		free(w->counts);
+		free(w->mcounts);
+	}
+
+	free(sr.workers);
+	free(sr.prefix);
+}
+
+// Samples the measured qubits shots times. When every measurement is
+// terminal the circuit is simulated once and the outcomes are drawn from
+// its final distribution; otherwise each shot replays the circuit from the
+// first measurement on, spread over nthreads, and ctx->weight is left as the
+// mean postselection weight of the shots.
+void run_shots(struct qsim_ctx * ctx, long shots, int nthreads)
+{
+	int mask = measured_qubits(ctx->gates, ctx->ngates);
+	int k = popcount(mask);
+	long * counts = calloc(1 << k, sizeof(long));
+	long (* mcounts)[2] = NULL;
+	unsigned flags = ctx->flags;
+
+	if (!counts)
+		error("Out of memory");
+	if (!mask)
+		error("Circuit has no measurements to sample");
+
+	ctx->flags |= RUN_QUIET;
+	if (measure_terminal(ctx->gates, ctx->ngates)
+			&& !(ctx->flags & RUN_POSTSELECT && has_postselect(ctx->gates, ctx->ngates)))
+	{
+		double * p = calloc(1 << k, sizeof(double));
+		struct alias alias;
+
+		if (!p)
+			error("Out of memory");
+
+		ctx->flags |= RUN_NOMEASURE;
+		run(ctx, ctx->gates, ctx->ngates, 0);
+
+		for (int i = 0; i < NAMPS; i++)
+		{
+			double amp = amp_value(ctx->state[i]);
+			p[compact(i, mask)] += amp * amp;
+		}
+
+		alias_build(&alias, p, 1 << k);
+		for (long i = 0; i < shots; i++)
+			counts[alias_sample(&alias, &ctx->rng)]++;
+
+		alias_free(&alias);
+		free(p);
+	}
+	else
+	{
+		if (!(mcounts = calloc(ctx->ngates * NQBITS, sizeof(*mcounts))))
+			error("Out of memory");
+		sample_shots(ctx, shots, nthreads, mask, counts, mcounts);
+	}
+	ctx->flags = flags;
+
+	print_counts(ctx->out, counts, mask, shots);
+	if (mcounts)
+		print_mcounts(ctx->out, ctx->gates, ctx->ngates, mcounts);
+	free(mcounts);
+	free(counts);
+}
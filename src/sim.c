@@ -0,0 +1,973 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <math.h>
+#include "main.h"
+
+
+// ctrl bits must come before bit
+void X2(struct qsim_ctx * ctx, int bit, int ctrl)
+{
+	struct amp * state = ctx->state;
+	int size = NAMPS >> bit;
+	int half = size >> 1;
+	for (int i = 0; i < ctx->namps; i += size)
+	{
+		if ((i & ctrl) != ctrl)
+			continue;
+
+		memcpy(ctx->temp, &state[i], half * sizeof(struct amp));
+		memcpy(&state[i], &state[i + half], half * sizeof(struct amp));
+		memcpy(&state[i + half], ctx->temp, half * sizeof(struct amp));
+	}
+}
+
+void X(struct qsim_ctx * ctx, int bit, int ctrl)
+{
+	struct amp * state = ctx->state;
+	int jctrl = ctrl & ((1 << NQBITS - 1 - bit) - 1);
+	if (!jctrl)
+	{
+		X2(ctx, bit, ctrl);
+		return;
+	}
+
+	int ictrl = ctrl & ~jctrl;
+	int size = NAMPS >> bit;
+	int half = size >> 1;
+	for (int i = 0; i < ctx->namps; i += size)
+	{
+		if ((i & ictrl) != ictrl)
+			continue;
+
+		for (int j = 0; j < half; j++)
+		{
+			struct amp temp;
+
+			if ((j & jctrl) != jctrl)
+				continue;
+
+			temp = state[i + j];
+			state[i + j] = state[i + half + j];
+			state[i + half + j] = temp;
+		}
+	}
+}
+
+void H(struct qsim_ctx * ctx, int bit, int ctrl)
+{
+	struct amp * state = ctx->state;
+	int jctrl = ctrl & ((1 << NQBITS - 1 - bit) - 1);
+	int ictrl = ctrl & ~jctrl;
+	int size = NAMPS >> bit;
+	int half = size >> 1;
+	for (int i = 0; i < ctx->namps; i += size)
+	{
+		if ((i & ictrl) != ictrl)
+			continue;
+
+		for (int j = 0; j < half; j++)
+		{
+			struct amp temp;
+
+			if ((j & jctrl) != jctrl)
+				continue;
+
+			mult(&state[i + j], &iroot2);
+			mult(&state[i + half + j], &iroot2);
+
+			temp = state[i + j];
+			add(&state[i + j], &state[i + half + j]);
+			neg(&state[i + half + j]);
+			add(&state[i + half + j], &temp);
+		}
+	}
+}
+
+void Z(struct qsim_ctx * ctx, int bit, int ctrl)
+{
+	struct amp * state = ctx->state;
+	int jctrl = ctrl & ((1 << NQBITS - 1 - bit) - 1);
+	int ictrl = ctrl & ~jctrl;
+	int size = NAMPS >> bit;
+	int half = size >> 1;
+	for (int i = 0; i < ctx->namps; i += size)
+	{
+		if ((i & ictrl) != ictrl)
+			continue;
+
+		for (int j = 0; j < half; j++)
+		{
+			if ((j & jctrl) != jctrl)
+				continue;
+
+			neg(&state[i + half + j]);
+		}
+	}
+}
+
+// a < b
+// ctrl bits must come before b
+void SWAP2(struct qsim_ctx * ctx, int a, int b, int ctrl)
+{
+	struct amp * state = ctx->state;
+	int jctrl = ctrl & ((1 << NQBITS - 1 - a) - 1);
+	int ictrl = ctrl & ~jctrl;
+	int asize = NAMPS >> a;
+	int ahalf = asize >> 1;
+	int bsize = NAMPS >> b;
+	int bhalf = bsize >> 1;
+	for (int i = 0; i < ctx->namps; i += asize)
+	{
+		if ((i & ictrl) != ictrl)
+			continue;
+
+		for (int j = bhalf; j < ahalf; j += bsize)
+		{
+			if ((j & jctrl) != jctrl)
+				continue;
+
+			memcpy(ctx->temp, &state[i + j], bhalf * sizeof(struct amp));
+			memcpy(&state[i + j], &state[i + ahalf + j - bhalf], bhalf * sizeof(struct amp));
+			memcpy(&state[i + ahalf + j - bhalf], ctx->temp, bhalf * sizeof(struct amp));
+		}
+	}
+
+}
+
+// like an X, but half one bit and half another
+void SWAP(struct qsim_ctx * ctx, int a, int b, int ctrl)
+{
+	struct amp * state = ctx->state;
+	if (b < a)
+	{
+		a ^= b;
+		b ^= a;
+		a ^= b;
+	}
+
+	int kctrl = ctrl & ((1 << NQBITS - 1 - b) - 1);
+	if (!kctrl)
+	{
+		SWAP2(ctx, a, b, ctrl);
+		return;
+	}
+
+	int jctrl = ctrl & ~kctrl & ((1 << NQBITS - 1 - a) - 1);
+	int ictrl = ctrl & ~(jctrl | kctrl);
+	int asize = NAMPS >> a;
+	int ahalf = asize >> 1;
+	int bsize = NAMPS >> b;
+	int bhalf = bsize >> 1;
+	for (int i = 0; i < ctx->namps; i += asize)
+	{
+		if ((i & ictrl) != ictrl)
+			continue;
+
+		for (int j = bhalf; j < ahalf; j += bsize)
+		{
+			if ((j & jctrl) != jctrl)
+				continue;
+
+			for (int k = 0; k < bhalf; k++)
+			{
+				struct amp temp;
+
+				if ((k & kctrl) != kctrl)
+					continue;
+
+				temp = state[i + j + k];
+				state[i + j + k] = state[i + ahalf + j - bhalf + k];
+				state[i + ahalf + j - bhalf + k] = temp;
+			}
+		}
+	}
+}
+
+// probability of every outcome of measuring bits together, in units of
+// 1/DENOMINATOR, from a single pass over the state
+void measure_probs(struct qsim_ctx * ctx, const int * bits, int nbits, int * probs)
+{
+	struct amp * state = ctx->state;
+	struct amp * acc = ctx->temp;
+
+	memset(acc, 0, (1 << nbits) * sizeof(struct amp));
+	for (int i = 0; i < NAMPS; i++)
+	{
+		struct amp temp = state[i];
+
+		mult(&temp, &temp);
+		add(&acc[outcome_of(i, bits, nbits)], &temp);
+	}
+	for (int o = 0; o < 1 << nbits; o++)
+		probs[o] = acc[o].ones;
+}
+
+// collapses bits onto outcome, where prob is its entry from measure_probs()
+void project(struct qsim_ctx * ctx, const int * bits, int nbits, int outcome, int prob)
+{
+	struct amp * state = ctx->state;
+
+	// sqrt log2 when prob is a power of 2, which keeps the scaling exact
+	int exact = !(prob & prob - 1);
+	int tz = ctz(prob);
+	int scale = DENOMINATOR_BITS/2 - tz/2;
+	double factor = sqrt((double)DENOMINATOR / prob);
+
+	for (int i = 0; i < NAMPS; i++)
+	{
+		if (outcome_of(i, bits, nbits) != outcome)
+		{
+			state[i].ones = 0;
+			state[i].root2s = 0;
+		}
+		else if (exact)
+		{
+			state[i].ones *= 1 << scale;
+			state[i].root2s *= 1 << scale;
+
+			if (tz & 1)
+				mult(&state[i], &iroot2);
+		}
+		else
+		{
+			state[i].ones = (int)lround(state[i].ones * factor);
+			state[i].root2s = (int)lround(state[i].root2s * factor);
+		}
+	}
+}
+
+// measures bits together and returns the outcome, bits[0] most significant
+int measure(struct qsim_ctx * ctx, const int * bits, int nbits)
+{
+	int probs[NAMPS];
+	long long total = 0;
+	double u;
+	int outcome = -1;
+
+	measure_probs(ctx, bits, nbits, probs);
+	for (int o = 0; o < 1 << nbits; o++)
+		if (probs[o] > 0)
+			total += probs[o];
+
+	// measure
+	u = rng_double(&ctx->rng) * total;
+	for (int o = 0; o < 1 << nbits; o++)
+	{
+		if (probs[o] <= 0)
+			continue;
+		outcome = o;
+		if (u < probs[o])
+			break;
+		u -= probs[o];
+	}
+	if (outcome < 0)
+		error("Measured a state with no probability");
+
+	project(ctx, bits, nbits, outcome, probs[outcome]);
+	return outcome;
+}
+
+// like measure, but collapses to outcome and accumulates its probability
+int postselect(struct qsim_ctx * ctx, const int * bits, int nbits, int outcome)
+{
+	int probs[NAMPS];
+
+	measure_probs(ctx, bits, nbits, probs);
+	if (probs[outcome] <= 0)
+		error("Postselected outcome %d of qubit %d%s has probability 0",
+				outcome, bits[0], nbits > 1? " onwards": "");
+
+	ctx->weight *= (double)probs[outcome] / DENOMINATOR;
+	project(ctx, bits, nbits, outcome, probs[outcome]);
+	return outcome;
+}
+
+#define UF_SPLIT (NQBITS / 2)
+
+static const char * const ufnames[] = {"table", "sparse", "anf", "permutation"};
+
+// the bits of a state index where input x of f goes, for arguments args
+static int scatter(int x, const int * args, int argc)
+{
+	int bits = 0;
+
+	for (int k = 0; k < argc; k++)
+		if (x >> argc - 1 - k & 1)
+			bits |= ctrlbit(args[k]);
+	return bits;
+}
+
+// Picks the cheapest way to run the Uf or Pf gate g. The cost is the number of
+// amplitudes or pairs visited, plus the work of placing each input or term.
+void plan_Uf(struct qsim_ctx * ctx, struct gate * g, const char * where, int n)
+{
+	const struct func * f = g->func;
+	int free = NQBITS - (g->type == GATE_Uf) - popcount(g->ctrl); // besides target and controls
+	long flips = (long)f->nones << free - f->argc;
+	long table = NAMPS + flips;
+	long sparse = flips + (long)f->nones * f->argc;
+	long anf = LONG_MAX;
+
+	if (f->nanf <= FMAXANF)
+	{
+		anf = 0;
+		for (int t = 0; t < f->nanf; t++)
+			anf += (1L << free - popcount(f->anf[t])) + f->argc;
+	}
+
+	if (g->nout)
+		g->ufmode = UF_PERM;
+	else if (sparse <= anf && sparse <= table)
+		g->ufmode = UF_SPARSE;
+	else if (anf <= table)
+		g->ufmode = UF_ANF;
+	else
+		g->ufmode = UF_TABLE;
+
+	if (ctx->flags & RUN_VERBOSE)
+		fprintf(stderr, "%s %d: %c%c runs by %s (%d of %d inputs set, %d ANF terms)\n",
+				where, n, rgatemap[g->type], f->name, ufnames[g->ufmode], f->nones, 1 << f->argc, f->nanf);
+}
+
+// The oracles below act on target bit tbit like X, or like Z on the whole
+// index when tbit is 0.
+static inline void flip(struct amp * state, int i, int tbit)
+{
+	struct amp temp;
+
+	if (!tbit)
+	{
+		neg(&state[i]);
+		return;
+	}
+	temp = state[i];
+	state[i] = state[i | tbit];
+	state[i | tbit] = temp;
+}
+
+// flips each index with the bits in set, tbit clear, and any of the bits in free
+static void flip_all(struct amp * state, int tbit, int set, int free)
+{
+	int s = 0;
+
+	do
+	{
+		flip(state, set | s, tbit);
+		s = s - free & free;
+	} while (s);
+}
+
+static void Uf_sparse(struct qsim_ctx * ctx, int tbit, const struct func * func, const int * args, int ctrl)
+{
+	int free = ctx->namps - 1 & ~(scatter((1 << func->argc) - 1, args, func->argc) | ctrl | tbit);
+
+	for (int w = 0; w < (1 << func->argc) + 63 >> 6; w++)
+		for (uint64_t m = func->map[w]; m; m &= m - 1)
+			flip_all(ctx->state, tbit, ctrl | scatter(w * 64 + ctz64(m), args, func->argc), free);
+}
+
+// f is the sum mod 2 of its ANF terms, so Uf is a multi-controlled X per term,
+// and Pf a multi-controlled Z
+static void Uf_anf(struct qsim_ctx * ctx, int tbit, const struct func * func, const int * args, int ctrl)
+{
+	for (int t = 0; t < func->nanf; t++)
+	{
+		int set = ctrl | scatter(func->anf[t], args, func->argc);
+
+		flip_all(ctx->state, tbit, set, ctx->namps - 1 & ~(set | tbit));
+	}
+}
+
+// Fills lo and hi so that the input of f at index i is
+// lo[i & (1 << UF_SPLIT) - 1] | hi[i >> UF_SPLIT].
+static void gather_tables(int * lo, int * hi, const int * args, int argc)
+{
+	memset(lo, 0, sizeof(int) << UF_SPLIT);
+	memset(hi, 0, sizeof(int) << NQBITS - UF_SPLIT);
+	for (int k = 0; k < argc; k++)
+	{
+		int m = ctrlbit(args[k]), x = 1 << argc - 1 - k;
+
+		for (int j = 0; j < 1 << UF_SPLIT; j++)
+			if (j & m)
+				lo[j] |= x;
+		for (int j = 0; j < 1 << NQBITS - UF_SPLIT; j++)
+			if (j << UF_SPLIT & m)
+				hi[j] |= x;
+	}
+}
+
+// this is very similar to CX, except uses f in addition to ctrl. The input of
+// f is gathered through two tables, for the low and the high bits of an index,
+// and the amplitudes to flip are picked out 64 at a time.
+static void Uf_table(struct qsim_ctx * ctx, int tbit, const struct func * func, const int * args, int ctrl)
+{
+	int lo[1 << UF_SPLIT], hi[1 << NQBITS - UF_SPLIT];
+	uint64_t lanes = 0; // which of 64 consecutive amplitudes may flip
+
+	gather_tables(lo, hi, args, func->argc);
+	for (int l = 0; l < 64; l++)
+		if (!(l & tbit) && (l & ctrl & 63) == (ctrl & 63))
+			lanes |= (uint64_t)1 << l;
+
+	for (int w = 0; w < ctx->namps; w += 64)
+	{
+		uint64_t hit = 0;
+
+		if (w & tbit || (w & ctrl & ~63) != (ctrl & ~63))
+			continue;
+		for (int l = 0; l < 64; l++)
+		{
+			int i = w + l;
+
+			hit |= (uint64_t)func_bit(func, lo[i & (1 << UF_SPLIT) - 1] | hi[i >> UF_SPLIT]) << l;
+		}
+
+		for (hit &= lanes; hit; hit &= hit - 1)
+			flip(ctx->state, w + ctz64(hit), tbit);
+	}
+}
+
+// XORs the low nout bits of f into the outputs that follow the inputs in bits,
+// the first output taking the most significant. Each index is swapped with the
+// one its outputs are XORed to, which pairs them up, so this is a single pass
+// with nothing copied.
+static void Uf_perm(struct qsim_ctx * ctx, const struct func * func, const int * bits, int nout, int ctrl)
+{
+	struct amp * state = ctx->state;
+	int lo[1 << UF_SPLIT], hi[1 << NQBITS - UF_SPLIT];
+	int dest[NAMPS]; // what each input XORs into the index
+
+	gather_tables(lo, hi, bits, func->argc);
+	for (int x = 0; x < 1 << func->argc; x++)
+	{
+		int v = func_val(func, x);
+
+		dest[x] = 0;
+		for (int k = 0; k < nout; k++)
+			if (v >> nout - 1 - k & 1)
+				dest[x] |= ctrlbit(bits[func->argc + k]);
+	}
+
+	for (int i = 0; i < ctx->namps; i++)
+	{
+		int j = i ^ dest[lo[i & (1 << UF_SPLIT) - 1] | hi[i >> UF_SPLIT]];
+
+		if (j > i && (i & ctrl) == ctrl)
+		{
+			struct amp temp = state[i];
+
+			state[i] = state[j];
+			state[j] = temp;
+		}
+	}
+}
+
+// Uf with target bit tbit, or Pf when tbit is 0
+void Uf(struct qsim_ctx * ctx, int tbit, const struct func * func, const int * args, int ctrl,
+		enum ufmode mode)
+{
+	switch (mode)
+	{
+		case UF_SPARSE:
+			Uf_sparse(ctx, tbit, func, args, ctrl);
+			break;
+		case UF_ANF:
+			Uf_anf(ctx, tbit, func, args, ctrl);
+			break;
+		default:
+			Uf_table(ctx, tbit, func, args, ctrl);
+	}
+}
+
+// Grover diffusion: inversion about the mean, a -> 2 mean - a, over the
+// register bits, for every setting of the other qubits where ctrl holds. This is
+// H, X on every bit, a multi-controlled Z, X and H again, negated, done as a
+// pass to sum each group and one to update it.
+void D(struct qsim_ctx * ctx, const int * bits, int nbits, int ctrl)
+{
+	struct amp * state = ctx->state;
+	int reg = 0, free;
+	int s = 0;
+
+	for (int b = 0; b < nbits; b++)
+		reg |= ctrlbit(bits[b]);
+	free = ctx->namps - 1 & ~(reg | ctrl);
+
+	do
+	{
+		int base = ctrl | s;
+		int64_t ones = 0, root2s = 0;
+		int r = 0;
+
+		do
+		{
+			ones += state[base | r].ones;
+			root2s += state[base | r].root2s;
+			r = r - reg & reg;
+		} while (r);
+
+		// twice the mean, rounded to nearest
+		if (nbits > 1)
+		{
+			ones = ones + ((int64_t)1 << nbits - 2) >> nbits - 1;
+			root2s = root2s + ((int64_t)1 << nbits - 2) >> nbits - 1;
+		}
+		do
+		{
+			state[base | r].ones = (int)ones - state[base | r].ones;
+			state[base | r].root2s = (int)root2s - state[base | r].root2s;
+			r = r - reg & reg;
+		} while (r);
+
+		s = s - free & free;
+	} while (s);
+}
+
+// the 4 point Walsh-Hadamard transform, halved and rounded to nearest, of one
+// component of 4 amplitudes. The sums can pass INT_MAX before halving.
+static inline void wht4(int * x0, int * x1, int * x2, int * x3)
+{
+	int64_t s01 = (int64_t)*x0 + *x1, d01 = (int64_t)*x0 - *x1;
+	int64_t s23 = (int64_t)*x2 + *x3, d23 = (int64_t)*x2 - *x3;
+
+	*x0 = (int)(s01 + s23 + 1 >> 1);
+	*x1 = (int)(d01 + d23 + 1 >> 1);
+	*x2 = (int)(s01 - s23 + 1 >> 1);
+	*x3 = (int)(d01 - d23 + 1 >> 1);
+}
+
+// Walsh-Hadamard transform of the register bits where ctrl holds, which is H
+// on each of them. Bits are taken two at a time, so each pass over the state
+// does two layers of butterflies and scales by 1/2 with no multiply. An odd bit
+// left over is done like H.
+void F(struct qsim_ctx * ctx, const int * bits, int nbits, int ctrl)
+{
+	struct amp * state = ctx->state;
+	int b = 0;
+
+	for (; b + 1 < nbits; b += 2)
+	{
+		int m1 = ctrlbit(bits[b]), m2 = ctrlbit(bits[b + 1]);
+		int free = ctx->namps - 1 & ~(m1 | m2 | ctrl);
+		int s = 0;
+
+		do
+		{
+			struct amp * a0 = &state[ctrl | s], * a1 = &state[ctrl | s | m1];
+			struct amp * a2 = &state[ctrl | s | m2], * a3 = &state[ctrl | s | m1 | m2];
+
+			wht4(&a0->ones, &a1->ones, &a2->ones, &a3->ones);
+			wht4(&a0->root2s, &a1->root2s, &a2->root2s, &a3->root2s);
+
+			s = s - free & free;
+		} while (s);
+	}
+	if (b < nbits)
+		H(ctx, bits[b], ctrl);
+}
+
+// adds m * x to ones and root2s, which have 2^(DENOMINATOR_BITS + GSHIFT) as
+// one. sqrt(2) * sqrt(2) = 2, so the sqrt(2) parts multiply into ones twice.
+#define GSHIFT 14
+static inline void mac(int64_t * ones, int64_t * root2s, struct amp m, struct amp x)
+{
+	*ones += (int64_t)m.ones * x.ones + 2 * (int64_t)m.root2s * x.root2s >> DENOMINATOR_BITS - GSHIFT;
+	*root2s += (int64_t)m.ones * x.root2s + (int64_t)m.root2s * x.ones >> DENOMINATOR_BITS - GSHIFT;
+}
+
+// Applies the n by n matrix m to each group of amplitudes that differ only in
+// the bits of off, gathering the group, multiplying and scattering it back.
+// Inlined with n constant, so the loops unroll for each size.
+static inline void G_n(struct amp * state, const struct amp * m, const int * off, int n, int ctrl, int free)
+{
+	int s = 0;
+
+	do
+	{
+		struct amp x[GMAXSIZE];
+		int base = ctrl | s;
+
+		for (int j = 0; j < n; j++)
+			x[j] = state[base | off[j]];
+		for (int i = 0; i < n; i++)
+		{
+			int64_t ones = 0, root2s = 0;
+
+			for (int j = 0; j < n; j++)
+				mac(&ones, &root2s, m[i * n + j], x[j]);
+			state[base | off[i]].ones = (int)(ones + (1 << GSHIFT - 1) >> GSHIFT);
+			state[base | off[i]].root2s = (int)(root2s + (1 << GSHIFT - 1) >> GSHIFT);
+		}
+
+		s = s - free & free;
+	} while (s);
+}
+
+void G(struct qsim_ctx * ctx, const struct gmat * mat, const int * bits, int ctrl)
+{
+	int off[GMAXSIZE];
+	int n = 1 << mat->k;
+	int free;
+
+	for (int j = 0; j < n; j++)
+		off[j] = scatter(j, bits, mat->k);
+	free = ctx->namps - 1 & ~(off[n - 1] | ctrl);
+
+	switch (mat->k)
+	{
+		case 1: G_n(ctx->state, mat->m, off, 2, ctrl, free); break;
+		case 2: G_n(ctx->state, mat->m, off, 4, ctrl, free); break;
+		case 3: G_n(ctx->state, mat->m, off, 8, ctrl, free); break;
+		case 4: G_n(ctx->state, mat->m, off, 16, ctrl, free); break;
+		case 5: G_n(ctx->state, mat->m, off, 32, ctrl, free); break;
+		default:
+			error("Matrix %c has bad size %d", mat->name, mat->k);
+	}
+}
+
+static inline void scale(struct amp * a, double f)
+{
+	a->ones = (int)lround(a->ones * f);
+	a->root2s = (int)lround(a->root2s * f);
+}
+
+// Amplitude damping of qubit bit by gamma on one trajectory. It decays to 0
+// with probability gamma times that of it being 1, and otherwise its 1 half
+// shrinks by sqrt(1 - gamma) before the state is renormalized.
+static void damp(struct qsim_ctx * ctx, int bit, double gamma)
+{
+	struct amp * state = ctx->state;
+	int m = ctrlbit(bit);
+	double p1 = 0;
+
+	for (int i = 0; i < NAMPS; i++)
+		if (i & m)
+		{
+			double a = amp_value(state[i]);
+
+			p1 += a * a;
+		}
+
+	if (rng_double(&ctx->rng) < gamma * p1)
+	{
+		double f = 1 / sqrt(p1);
+
+		for (int i = 0; i < NAMPS; i++)
+			if (!(i & m))
+			{
+				state[i] = state[i | m];
+				scale(&state[i], f);
+				state[i | m].ones = state[i | m].root2s = 0;
+			}
+	}
+	else
+	{
+		double f = 1 / sqrt(1 - gamma * p1);
+
+		for (int i = 0; i < NAMPS; i++)
+			scale(&state[i], i & m? f * sqrt(1 - gamma): f);
+	}
+}
+
+// Applies the noise declared for g's type to one trajectory, on each qubit g
+// touches. Depolarize, dephase and flip pick a Pauli with a fixed probability
+// and run it through the X and Z kernels, Y being Z then X.
+static void sample_noise(struct qsim_ctx * ctx, const struct gate * g)
+{
+	int qubits = 0;
+
+	for (int n = 0; n < ctx->nnoise; n++)
+	{
+		const struct noise * noise = &ctx->noise[n];
+
+		if (noise->gate != g->type)
+			continue;
+		if (!qubits)
+			qubits = gate_qubits(g);
+
+		for (int q = 0; q < NQBITS; q++)
+		{
+			double u;
+
+			if (!(qubits & ctrlbit(q)))
+				continue;
+			if (noise->channel == CH_DAMP)
+			{
+				damp(ctx, q, noise->p);
+				continue;
+			}
+			if ((u = rng_double(&ctx->rng)) >= noise->p)
+				continue;
+			switch (noise->channel)
+			{
+				case CH_DEPOLARIZE:
+				{
+					int pauli = (int)(u / noise->p * 3); // X, Y or Z
+
+					if (pauli > 0)
+						Z(ctx, q, 0);
+					if (pauli < 2)
+						X(ctx, q, 0);
+					break;
+				}
+				case CH_DEPHASE:
+					Z(ctx, q, 0);
+					break;
+				case CH_FLIP:
+					X(ctx, q, 0);
+					break;
+				default:
+					break;
+			}
+		}
+	}
+}
+
+static void copy_state(struct amp a[NAMPS], const struct amp b[NAMPS])
+{
+	memcpy(a, b, NAMPS * sizeof(struct amp));
+}
+
+static void to_probs(struct amp * s)
+{
+	for (int i = 0; i < NAMPS; i++)
+		mult(&s[i], &s[i]);
+}
+
+// TODO Not sure if this is most efficient or convenient
+static void merge_bits(int bits, struct amp * s)
+{
+	int size = NAMPS;
+
+	for (int i = 0; i < NQBITS; i++)
+	{
+		int half = size >> 1;
+
+		if (bits & half)
+		{
+			for (int j = 0; j < NAMPS; j += size)
+				for (int k = 0; k < half; k++)
+					add(&s[j + k], &s[j + k + half]);
+
+		}
+		size = half;
+	}
+}
+
+// runs the kernel of the unitary gate g on ctx->state
+void apply_unitary(struct qsim_ctx * ctx, const struct gate * g)
+{
+	switch (g->type)
+	{
+		case GATE_X:
+			X(ctx, g->bits[0], g->ctrl);
+			break;
+		case GATE_H:
+			H(ctx, g->bits[0], g->ctrl);
+			break;
+		case GATE_Uf:
+			if (g->nout)
+			{
+				Uf_perm(ctx, g->func, g->bits, g->nout, g->ctrl);
+				break;
+			}
+			Uf(ctx, ctrlbit(g->bits[g->func->argc]), g->func, g->bits, g->ctrl, g->ufmode);
+			break;
+		case GATE_Pf:
+			Uf(ctx, 0, g->func, g->bits, g->ctrl, g->ufmode);
+			break;
+		case GATE_D:
+			D(ctx, g->bits, g->nbits, g->ctrl);
+			break;
+		case GATE_F:
+			F(ctx, g->bits, g->nbits, g->ctrl);
+			break;
+		case GATE_G:
+			G(ctx, g->mat, g->bits, g->ctrl);
+			break;
+		case GATE_Z:
+			Z(ctx, g->bits[0], g->ctrl);
+			break;
+		case GATE_SWAP:
+			SWAP(ctx, g->bits[0], g->bits[1], g->ctrl);
+			break;
+		default:
+			error("Strange gate type: %d", g->type);
+	}
+}
+
+// everything but barriers, which move the cursor
+static void apply(struct qsim_ctx * ctx, struct gate * gates, int ngates, int i)
+{
+	if (ctx->flags & RUN_QUIET && is_command(gates[i].type))
+		return;
+	if (ctx->statemap && (is_unitary(gates[i].type) || gates[i].type == GATE_MEASURE))
+	{
+		size_t io = state_io(&gates[i]);
+
+		ctx->iobytes += io;
+		if (ctx->flags & RUN_VERBOSE)
+			fprintf(stderr, "Gate %d: %c pages through %zu bytes of state\n", i, rgatemap[gates[i].type], io);
+	}
+	if (is_unitary(gates[i].type))
+	{
+		if (ctx->rho)
+			rho_gate(ctx, &gates[i]);
+		else
+		{
+			apply_unitary(ctx, &gates[i]);
+			if (ctx->flags & RUN_NOISY)
+				sample_noise(ctx, &gates[i]);
+		}
+		return;
+	}
+	switch (gates[i].type)
+	{
+		case GATE_MEASURE:
+			if (ctx->flags & RUN_NOMEASURE)
+				break;
+			if (ctx->rho)
+				gates[i].mval = rho_measure(ctx, &gates[i]);
+			else if (ctx->flags & RUN_POSTSELECT && gates[i].post >= 0)
+				gates[i].mval = postselect(ctx, gates[i].bits, gates[i].nbits, gates[i].post);
+			else
+				gates[i].mval = measure(ctx, gates[i].bits, gates[i].nbits);
+			if (ctx->flags & RUN_NOISY && !(ctx->flags & RUN_POSTSELECT && gates[i].post >= 0))
+				gates[i].mval = readout(ctx, gates[i].mval, gates[i].nbits);
+			gates[i].mstate = MSTATE_KNOWN;
+			for (int b = 0; b < gates[i].nbits; b++)
+			{
+				int bit = ctrlbit(gates[i].bits[b]);
+
+				ctx->mmask |= bit;
+				if (gates[i].mval >> gates[i].nbits - 1 - b & 1)
+					ctx->mvals |= bit;
+				else
+					ctx->mvals &= ~bit;
+			}
+			break;
+		case GATE_PAUSE:
+			getc(stdin);
+			break;
+		case GATE_DRAW:
+			print_circuit(ctx->out, gates, ngates);
+			fputs("\n", ctx->out);
+			break;
+		case GATE_STATE:
+			if (ctx->rho)
+			{
+				print_rho(ctx->out, gates[i].ctrl, ctx->rho);
+				fputs("\n", ctx->out);
+				break;
+			}
+			copy_state(ctx->temp, ctx->state);
+			merge_bits(~gates[i].ctrl, ctx->temp);
+			print_state(ctx->out, gates[i].ctrl, ctx->temp);
+			fputs("\n", ctx->out);
+			break;
+		case GATE_PROBS:
+			if (ctx->rho)
+				rho_diag(ctx, ctx->temp);
+			else
+			{
+				copy_state(ctx->temp, ctx->state);
+				to_probs(ctx->temp);
+			}
+			merge_bits(~gates[i].ctrl, ctx->temp);
+			print_probs(ctx->out, gates[i].ctrl, ctx->temp);
+			fputs("\n", ctx->out);
+			break;
+		case GATE_PFUNC:
+			print_func(ctx->out, gates[i].func);
+			fputs("\n", ctx->out);
+			break;
+		default:
+			error("Strange gate type: %d", gates[i].type);
+	}
+}
+
+// Arriving at barrier b. Skips chained blocks that repeat 0 times and opens
+// the first block that runs, if any.
+static void enter(const struct gate * gates, struct cursor * cur, int b)
+{
+	while (gates[b].barrier.end && !gates[b].barrier.repeat)
+		b = gates[b].barrier.end;
+
+	if (gates[b].barrier.end)
+	{
+		cur->stack[cur->depth].begin = b;
+		cur->stack[cur->depth].left = gates[b].barrier.repeat;
+		cur->depth++;
+	}
+	cur->pc = b + 1;
+}
+
+void cursor_init(struct cursor * cur, int start)
+{
+	cur->pc = start;
+	cur->depth = 0;
+}
+
+// executes the gate under the cursor and moves past it
+// returns 0 if that ended the circuit
+int run_step(struct qsim_ctx * ctx, struct gate * gates, int ngates, struct cursor * cur)
+{
+	int i = cur->pc;
+
+	gates[i].cnt++;
+	switch (gates[i].type)
+	{
+		case GATE_BARRIER_BEGIN:
+			enter(gates, cur, i);
+			break;
+		case GATE_BARRIER_END:
+			if (!cur->depth)
+			{
+				cur->pc = ngates;
+				return 0;
+			}
+			if (--cur->stack[cur->depth - 1].left > 0)
+				cur->pc = cur->stack[cur->depth - 1].begin + 1;
+			else
+			{
+				cur->depth--;
+				enter(gates, cur, i);
+			}
+			break;
+		default:
+			apply(ctx, gates, ngates, i);
+			cur->pc++;
+	}
+	return cur->pc < ngates;
+}
+
+// Runs from the cursor until the circuit ends or, if stop is not GATE_NONE,
+// until the next gate of type stop, which is left unexecuted under the cursor.
+// Returns whether it stopped early.
+int run_until(struct qsim_ctx * ctx, struct gate * gates, int ngates,
+		struct cursor * cur, enum gatetype stop)
+{
+	while (cur->pc < ngates)
+	{
+		if (gates[cur->pc].type == stop)
+			return 1;
+		if (!run_step(ctx, gates, ngates, cur))
+			return 0;
+	}
+	return 0;
+}
+
+void run(struct qsim_ctx * ctx, struct gate * gates, int ngates, int start)
+{
+	struct cursor cur;
+
+	cursor_init(&cur, start);
+	run_until(ctx, gates, ngates, &cur, GATE_NONE);
+}
@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "main.h"
+
+// With --state-file the state vector and the scratch buffer live in a file
+// mapped into memory instead of on the heap, so they can outgrow RAM and are
+// paged to and from the file by the kernel. Every kernel walks the state in
+// increasing order within each block it works on, and a gate on a high stride
+// qubit walks the two halves of each block in lockstep, so a pass streams
+// through the file in at most two sequential runs, which readahead handles.
+
+void state_map(struct qsim_ctx * ctx, const char * path)
+{
+	size_t len = 2 * (size_t)NAMPS * sizeof(struct amp);
+	char * map;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+		error("Failed to open %s: %s", path, strerror(errno));
+	if (ftruncate(fd, len) || (map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0)) == MAP_FAILED)
+	{
+		int err = errno;
+
+		close(fd);
+		error("Failed to map %s: %s", path, strerror(err));
+	}
+	close(fd);
+	madvise(map, len, MADV_SEQUENTIAL);
+
+	free(ctx->state);
+	free(ctx->temp);
+	ctx->statemap = map;
+	ctx->statelen = len;
+	ctx->state = (struct amp *)map;
+	ctx->temp = ctx->state + NAMPS;
+	// the file starts out as zeros
+	ctx->state[0].ones = DENOMINATOR;
+}
+
+// The most bytes of the state gate g pages in and writes back: every page
+// with an index where the controls that select pages hold, twice.
+size_t state_io(const struct gate * g)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	int pamps = page > 0 && page / sizeof(struct amp) < NAMPS? (int)(page / sizeof(struct amp)): NAMPS;
+	int npages = NAMPS / pamps;
+
+	if (g->type == GATE_MEASURE)
+		return 2 * (size_t)NAMPS * sizeof(struct amp);
+	npages >>= popcount(g->ctrl & (NAMPS - 1) & ~(pamps - 1));
+	return 2 * (size_t)npages * pamps * sizeof(struct amp);
+}
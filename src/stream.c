@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "main.h"
+
+#define RINGSIZE 1024
+
+// The parser thread pushes gates into a ring buffer once nothing later in the
+// file can change them, and the executor runs them as they arrive. The
+// executor keeps only the gates from its cursor on, plus the blocks it still
+// has to repeat.
+
+struct stream {
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty, nonfull;
+	struct gate ring[RINGSIZE];
+	unsigned head, tail; // head - tail gates are waiting
+	int done;            // parser reached the end of the file
+	struct qsim_ctx * ctx;
+	FILE * in;
+};
+
+void stream_push(struct stream * st, const struct gate * gates, int n)
+{
+	pthread_mutex_lock(&st->lock);
+	while (n > 0)
+	{
+		while (st->head - st->tail == RINGSIZE)
+			pthread_cond_wait(&st->nonfull, &st->lock);
+		while (n > 0 && st->head - st->tail < RINGSIZE)
+		{
+			st->ring[st->head++ % RINGSIZE] = *gates++;
+			n--;
+		}
+		pthread_cond_signal(&st->nonempty);
+	}
+	pthread_mutex_unlock(&st->lock);
+}
+
+static void * parse_thread(void * arg)
+{
+	struct stream * st = arg;
+
+	stream_parse_circuit(st->ctx, st->in, st);
+
+	pthread_mutex_lock(&st->lock);
+	st->done = 1;
+	pthread_cond_signal(&st->nonempty);
+	pthread_mutex_unlock(&st->lock);
+	return NULL;
+}
+
+// Waits until gate i has arrived, where base is the number of the gate in
+// ctx->gates[0]. Returns 0 if the circuit ends before it.
+static int fetch(struct stream * st, struct qsim_ctx * ctx, int base, int i)
+{
+	while (i >= ctx->ngates)
+	{
+		int n;
+
+		pthread_mutex_lock(&st->lock);
+		while (st->head == st->tail && !st->done)
+			pthread_cond_wait(&st->nonempty, &st->lock);
+		if (st->head == st->tail)
+		{
+			pthread_mutex_unlock(&st->lock);
+			return 0;
+		}
+
+		n = st->head - st->tail;
+		ctx_reserve(ctx, ctx->ngates + n);
+		for (; st->tail != st->head; st->tail++)
+		{
+			struct gate * g = &ctx->gates[ctx->ngates++];
+
+			*g = st->ring[st->tail % RINGSIZE];
+			if ((g->type == GATE_BARRIER_BEGIN || g->type == GATE_BARRIER_END) && g->barrier.end)
+				g->barrier.end -= base;
+		}
+		pthread_cond_signal(&st->nonfull);
+		pthread_mutex_unlock(&st->lock);
+	}
+	return 1;
+}
+
+// drops the gates the cursor can no longer come back to
+static void trim(struct qsim_ctx * ctx, struct cursor * cur, int * base)
+{
+	int lo = cur->pc;
+
+	for (int i = 0; i < cur->depth; i++)
+		if (cur->stack[i].left > 1 && cur->stack[i].begin < lo)
+			lo = cur->stack[i].begin;
+	if (lo < RINGSIZE || lo < ctx->ngates / 2)
+		return;
+
+	memmove(ctx->gates, ctx->gates + lo, (ctx->ngates - lo) * sizeof(struct gate));
+	ctx->ngates -= lo;
+	for (int i = 0; i < ctx->ngates; i++)
+		if ((ctx->gates[i].type == GATE_BARRIER_BEGIN || ctx->gates[i].type == GATE_BARRIER_END)
+				&& ctx->gates[i].barrier.end)
+			ctx->gates[i].barrier.end -= lo;
+	cur->pc -= lo;
+	for (int i = 0; i < cur->depth; i++)
+		cur->stack[i].begin -= lo;
+	*base += lo;
+}
+
+// Runs the circuit in while it is still being parsed. draw waits for the rest
+// of the file, and only shows the gates that are still buffered.
+void run_stream(struct qsim_ctx * ctx, FILE * in)
+{
+	struct stream st = {.ctx = ctx, .in = in};
+	struct cursor cur;
+	pthread_t tid;
+	int base = 0;
+
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.nonempty, NULL);
+	pthread_cond_init(&st.nonfull, NULL);
+	if (pthread_create(&tid, NULL, parse_thread, &st))
+		error("Failed to start parser thread");
+
+	cursor_init(&cur, 0);
+	while (fetch(&st, ctx, base, cur.pc))
+	{
+		enum gatetype type = ctx->gates[cur.pc].type;
+
+		// a barrier may skip ahead over blocks that repeat 0 times
+		if (type == GATE_BARRIER_BEGIN || type == GATE_BARRIER_END)
+			for (int b = cur.pc; ctx->gates[b].barrier.end && !ctx->gates[b].barrier.repeat;
+					b = ctx->gates[b].barrier.end)
+				fetch(&st, ctx, base, ctx->gates[b].barrier.end);
+		if (type == GATE_DRAW && !(ctx->flags & RUN_QUIET))
+			while (fetch(&st, ctx, base, ctx->ngates))
+				;
+
+		run_step(ctx, ctx->gates, ctx->ngates, &cur);
+		trim(ctx, &cur, &base);
+	}
+
+	pthread_join(tid, NULL);
+	pthread_cond_destroy(&st.nonfull);
+	pthread_cond_destroy(&st.nonempty);
+	pthread_mutex_destroy(&st.lock);
+}
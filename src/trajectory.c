@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "main.h"
+
+#define TRAJBLOCK 16 // trajectories per pool job
+#define TRAJROUND 64 // pool jobs between convergence checks
+
+// Each trajectory runs the circuit on the state vector with its noise
+// sampled, one Kraus operator per channel and qubit after every gate, and
+// the final probabilities are averaged over all of them. Everything before
+// the first noisy gate or measurement is the same for every trajectory, so it
+// is simulated once and each trajectory starts from a copy of that state.
+struct trajrun {
+	struct qsim_ctx * ctx;
+	struct amp * prefix;
+	struct cursor cur;
+	long first; // number of the first trajectory of this round
+	long max;
+	struct qsim_ctx ** workers;
+	double (* sums)[2][NAMPS]; // per job of the round, sum of p and of p^2
+};
+
+static void run_traj_block(struct pool * pool, void * arg, int job, int worker)
+{
+	struct trajrun * tr = arg;
+	struct qsim_ctx * ctx = tr->workers[worker];
+	double * sum = tr->sums[job][0], * sq = tr->sums[job][1];
+	long begin = tr->first + (long)job * TRAJBLOCK;
+	long end = begin + TRAJBLOCK < tr->max? begin + TRAJBLOCK: tr->max;
+
+	memset(tr->sums[job], 0, sizeof(tr->sums[job]));
+	for (long t = begin; t < end; t++)
+	{
+		struct cursor cur = tr->cur;
+
+		memcpy(ctx->state, tr->prefix, NAMPS * sizeof(struct amp));
+		ctx->mmask = ctx->mvals = 0;
+		rng_philox(&ctx->rng, tr->ctx->seed, (uint64_t)t);
+		run_until(ctx, ctx->gates, ctx->ngates, &cur, GATE_NONE);
+
+		for (int i = 0; i < NAMPS; i++)
+		{
+			double a = amp_value(ctx->state[i]);
+
+			sum[i] += a * a;
+			sq[i] += a * a * a * a;
+		}
+	}
+}
+
+// whether g draws random numbers, and so starts to differ between trajectories
+static int is_random(const struct qsim_ctx * ctx, const struct gate * g)
+{
+	if (g->type == GATE_MEASURE)
+		return 1;
+	for (int n = 0; n < ctx->nnoise; n++)
+		if (ctx->noise[n].gate == g->type)
+			return 1;
+	return 0;
+}
+
+// the largest standard error of the mean of any probability after n
+// trajectories
+static double max_stderr(const double * sum, const double * sq, long n)
+{
+	double worst = 0;
+
+	if (n < 2)
+		return INFINITY;
+	for (int i = 0; i < NAMPS; i++)
+	{
+		double var = (sq[i] - sum[i] * sum[i] / n) / (n - 1);
+
+		if (var > 0 && sqrt(var / n) > worst)
+			worst = sqrt(var / n);
+	}
+	return worst;
+}
+
+static void print_trajectories(FILE * out, const double * sum, const double * sq, long n)
+{
+	fprintf(out, "Trajectories: %ld (largest standard error %lf)\n", n, max_stderr(sum, sq, n));
+	for (int i = 0; i < NQBITS; i++)
+		fprintf(out, " q%d", i);
+	fprintf(out, "\n");
+
+	for (int i = 0; i < NAMPS; i++)
+	{
+		double var = n > 1? (sq[i] - sum[i] * sum[i] / n) / (n - 1): 0;
+
+		if (sum[i] <= 0)
+			continue;
+		for (int j = NQBITS - 1; j >= 0; j--)
+			putc(0x30 | (i >> j & 1), out);
+		fprintf(out, ": %lf (+- %lf)\n", sum[i] / n, var > 0? sqrt(var / n): 0);
+	}
+}
+
+// Averages the final probabilities of up to max noisy trajectories, spread
+// over nthreads. Trajectories run in rounds, and once the standard error of
+// every probability is at most tol, no more rounds are started. Trajectory t
+// draws from random stream t and rounds are summed in order, so the result
+// does not depend on the thread count.
+void run_trajectories(struct qsim_ctx * ctx, long max, double tol, int nthreads)
+{
+	struct trajrun tr = {.ctx = ctx, .max = max};
+	double * sum = calloc(NAMPS, sizeof(double));
+	double * sq = calloc(NAMPS, sizeof(double));
+	unsigned flags = ctx->flags;
+	long done = 0;
+
+	if (nthreads > TRAJROUND)
+		nthreads = TRAJROUND;
+	tr.prefix = malloc(NAMPS * sizeof(struct amp));
+	tr.workers = calloc(nthreads, sizeof(*tr.workers));
+	tr.sums = malloc(TRAJROUND * sizeof(*tr.sums));
+	if (!sum || !sq || !tr.prefix || !tr.workers || !tr.sums)
+		error("Out of memory");
+
+	ctx->flags |= RUN_QUIET;
+	cursor_init(&tr.cur, 0);
+	while (tr.cur.pc < ctx->ngates && !is_random(ctx, &ctx->gates[tr.cur.pc]))
+		run_step(ctx, ctx->gates, ctx->ngates, &tr.cur);
+	memcpy(tr.prefix, ctx->state, NAMPS * sizeof(struct amp));
+
+	for (int i = 0; i < nthreads; i++)
+	{
+		if (!(tr.workers[i] = ctx_new()))
+			error("Out of memory");
+		ctx_copy_gates(tr.workers[i], ctx);
+		memcpy(tr.workers[i]->noise, ctx->noise, sizeof(ctx->noise));
+		tr.workers[i]->nnoise = ctx->nnoise;
+		tr.workers[i]->flags = ctx->flags | RUN_NOISY;
+	}
+
+	while (done < max)
+	{
+		long n = max - done < (long)TRAJROUND * TRAJBLOCK? max - done: (long)TRAJROUND * TRAJBLOCK;
+		int njobs = (int)((n + TRAJBLOCK - 1) / TRAJBLOCK);
+
+		tr.first = done;
+		pool_run(nthreads < njobs? nthreads: njobs, njobs, run_traj_block, &tr);
+		for (int j = 0; j < njobs; j++)
+			for (int i = 0; i < NAMPS; i++)
+			{
+				sum[i] += tr.sums[j][0][i];
+				sq[i] += tr.sums[j][1][i];
+			}
+		done += n;
+		if (tol > 0 && max_stderr(sum, sq, done) <= tol)
+			break;
+	}
+	ctx->flags = flags;
+
+	print_trajectories(ctx->out, sum, sq, done);
+
+	for (int i = 0; i < nthreads; i++)
+		ctx_free(tr.workers[i]);
+	free(tr.workers);
+	free(tr.sums);
+	free(tr.prefix);
+	free(sum);
+	free(sq);
+}
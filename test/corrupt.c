@@ -0,0 +1,163 @@
+// Loads and runs every single byte corruption of a compiled circuit through
+// the library API, each in its own process, and fails if any of them crashes
+// instead of being rejected with an error code or running. It is built with
+// the address and undefined behaviour sanitizers, and with -fwrapv like every
+// other build, so amplitudes that overflow wrap around rather than being
+// undefined.
+//	make test
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "main.h"
+#include "qsim.h"
+
+#define TIMEOUT 1 // seconds a corrupted circuit may run, say with a huge repeat
+
+static const char circuit[] =
+	"f = a ^ b&c\n"
+	"g = 3(2a + b)\n"
+	"Gc = [1 0 0 0; 0 1 0 0; 0 0 0 1; 0 0 1 0]\n"
+	"noise H depolarize 0.1\n"
+	"noise M readout 0.05\n"
+	"H 0..3\n"
+	"-a\n"
+	"Uf 0 1 2 9 : 4\n"
+	"Pf 1 2 3 : 8\n"
+	"D 0..3 : 9\n"
+	"-a 2\n"
+	"F 4 5 6\n"
+	"Ug 0 1 : 9 -> 3..5\n"
+	"Gc 1 2 : 0\n"
+	"W 2 7 : 8\n"
+	"Z 6 : 5\n"
+	"X 3 : 0 1\n"
+	"M 0..2 = 5\n"
+	"state\n"
+	"prob 0 1\n"
+	"pfunc f\n"
+	"draw\n";
+
+static void write_file(const char * path, const void * p, size_t n)
+{
+	FILE * f = fopen(path, "wb");
+
+	if (!f || fwrite(p, 1, n, f) != n || fclose(f))
+	{
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// loads and runs path in a child, and returns its wait status
+static int try_image(const char * path)
+{
+	pid_t pid;
+	int status;
+
+	fflush(NULL);
+	if ((pid = fork()) < 0)
+	{
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (!pid)
+	{
+		struct qsim_ctx * ctx;
+
+		alarm(TIMEOUT);
+		freopen("/dev/null", "r", stdin);
+		freopen("/dev/null", "w", stdout);
+		if (qsim_load(&ctx, path) == QSIM_OK)
+			qsim_run(ctx);
+		qsim_free(ctx);
+		_exit(EXIT_SUCCESS);
+	}
+	waitpid(pid, &status, 0);
+	return status;
+}
+
+int main(void)
+{
+	static const unsigned char flips[] = {0x01, 0x80, 0xff};
+	char src[] = "/tmp/qsim-corrupt-XXXXXX";
+	char img[sizeof(src) + 6], bad[sizeof(src) + 4];
+	struct qsim_ctx * ctx;
+	unsigned char * data;
+	long size;
+	int fd, failed = 0, rejected = 0, slow = 0;
+	FILE * f;
+
+	if ((fd = mkstemp(src)) < 0)
+	{
+		perror("mkstemp");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	snprintf(img, sizeof(img), "%s.qsimc", src);
+	snprintf(bad, sizeof(bad), "%s.bad", src);
+	write_file(src, circuit, sizeof(circuit) - 1);
+
+	if (qsim_load(&ctx, src) != QSIM_OK)
+	{
+		fprintf(stderr, "%s\n", qsim_errmsg(ctx));
+		return EXIT_FAILURE;
+	}
+	compile_circuit(ctx, img);
+	qsim_free(ctx);
+	if (WIFSIGNALED(try_image(img)))
+	{
+		fprintf(stderr, "the uncorrupted circuit crashes\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!(f = fopen(img, "rb")) || fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0
+			|| !(data = malloc(size)) || fseek(f, 0, SEEK_SET) || fread(data, 1, size, f) != (size_t)size)
+	{
+		perror(img);
+		return EXIT_FAILURE;
+	}
+	fclose(f);
+
+	for (long off = 0; off < size; off++)
+		for (size_t k = 0; k < sizeof(flips); k++)
+		{
+			int status;
+
+			data[off] ^= flips[k];
+			write_file(bad, data, size);
+			data[off] ^= flips[k];
+
+			status = try_image(bad);
+			if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM)
+				slow++;
+			else if (!WIFEXITED(status) || WEXITSTATUS(status))
+			{
+				fprintf(stderr, "byte %ld ^ 0x%02x: crashed\n", off, flips[k]);
+				failed++;
+			}
+		}
+
+	// count the rejections separately, in this process, to make sure the
+	// checks are being reached at all
+	for (long off = 0; off < size; off++)
+	{
+		data[off] ^= 0xff;
+		write_file(bad, data, size);
+		data[off] ^= 0xff;
+		if (qsim_load(&ctx, bad) != QSIM_OK)
+			rejected++;
+		qsim_free(ctx);
+	}
+
+	printf("%ld bytes, %ld corruptions: %d crashed, %d ran past %d s, %d of %ld 0xff flips rejected\n",
+			size, size * (long)sizeof(flips), failed, slow, TIMEOUT, rejected, size);
+	remove(src);
+	remove(img);
+	remove(bad);
+	free(data);
+	return failed? EXIT_FAILURE: EXIT_SUCCESS;
+}
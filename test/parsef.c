@@ -0,0 +1,385 @@
+// Differential test of function parsing: random expressions, printed with as
+// few parentheses as C precedence allows, are parsed, optimized and evaluated
+// by parse_func(), and every entry of the table is checked against a direct
+// evaluation of the expression. Expressions are built as DAGs, so subterms
+// repeat and the optimizer's folding, sharing and identities get exercised.
+//	make test, or ./parsetest [expressions] [seed]
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include "main.h"
+
+#define MAXNODES 48
+#define MAXDEPTH 5
+#define EXPRSIZ 4096
+
+enum kind {
+	K_VAR,
+	K_CONST,
+	K_POW,
+	K_NEG,
+	K_BNOT,
+	K_NOT,
+	K_MUL,
+	K_DIV,
+	K_MOD,
+	K_ADD,
+	K_SUB,
+	K_LT,
+	K_LTE,
+	K_GT,
+	K_GTE,
+	K_EQ,
+	K_NEQ,
+	K_BAND,
+	K_BXOR,
+	K_BOR,
+	K_AND,
+	K_OR,
+	K_TERN,
+	NKINDS
+};
+
+// symbol and C precedence level of each kind, higher binding tighter
+static const struct {
+	const char * sym;
+	int level;
+} kinds[NKINDS] = {
+	[K_VAR] = {"", 13}, [K_CONST] = {"", 13},
+	[K_POW] = {"**", 12},
+	[K_NEG] = {"-", 11}, [K_BNOT] = {"~", 11}, [K_NOT] = {"!", 11},
+	[K_MUL] = {"*", 10}, [K_DIV] = {"/", 10}, [K_MOD] = {"%", 10},
+	[K_ADD] = {"+", 9}, [K_SUB] = {"-", 9},
+	[K_LT] = {"<", 8}, [K_LTE] = {"<=", 8}, [K_GT] = {">", 8}, [K_GTE] = {">=", 8},
+	[K_EQ] = {"==", 7}, [K_NEQ] = {"!=", 7},
+	[K_BAND] = {"&", 6}, [K_BXOR] = {"^", 5}, [K_BOR] = {"|", 4},
+	[K_AND] = {"&&", 3}, [K_OR] = {"||", 2},
+	[K_TERN] = {"?", 1},
+};
+
+struct node {
+	enum kind kind;
+	int val; // of a constant, or the variable
+	int args[3];
+};
+
+struct expr {
+	struct node nodes[MAXNODES];
+	int nnodes;
+	int argc;
+	struct rng rng;
+	char text[EXPRSIZ];
+	int len;
+};
+
+static int pick(struct expr * e, int n)
+{
+	return (int)(rng_next(&e->rng) % (unsigned)n);
+}
+
+static int arity(enum kind k)
+{
+	return k <= K_CONST? 0: k == K_POW? 2: k <= K_NOT? 1: k == K_TERN? 3: 2;
+}
+
+static int leaf(struct expr * e)
+{
+	static const int consts[] = {0, 1, 1, 2, 3, 5, 7, 10, 255, 1000, -1};
+	struct node * n = &e->nodes[e->nnodes];
+
+	if (pick(e, 3))
+	{
+		n->kind = K_VAR;
+		n->val = pick(e, NQBITS - 1);
+		if (n->val + 1 > e->argc)
+			e->argc = n->val + 1;
+	}
+	else
+	{
+		n->kind = K_CONST;
+		n->val = consts[pick(e, sizeof(consts) / sizeof(*consts))];
+	}
+	return e->nnodes++;
+}
+
+// adds a random expression of at most depth levels and returns its node
+static int gen(struct expr * e, int depth)
+{
+	struct node n;
+
+	// an earlier node again, for the optimizer to share, and always once
+	// there is only room left for the nodes under construction and their
+	// exponents
+	if (e->nnodes && (!pick(e, 6) || e->nnodes + 2 * (MAXDEPTH + 1) >= MAXNODES))
+		return pick(e, e->nnodes);
+	if (!depth || !pick(e, 4))
+		return leaf(e);
+
+	n.kind = (enum kind)(K_POW + pick(e, NKINDS - K_POW));
+	for (int k = 0; k < arity(n.kind); k++)
+		// small exponents, so the powers stay in range
+		n.args[k] = n.kind == K_POW && k && pick(e, 4)? leaf(e): gen(e, depth - 1);
+	e->nodes[e->nnodes] = n;
+	return e->nnodes++;
+}
+
+static void put(struct expr * e, const char * s)
+{
+	size_t n = strlen(s);
+
+	if (e->len + n >= EXPRSIZ)
+		n = 0, e->len = EXPRSIZ; // too long, and dropped by the caller
+	memcpy(e->text + e->len, s, n);
+	e->len += (int)n;
+}
+
+static void space(struct expr * e)
+{
+	if (!pick(e, 3))
+		put(e, " ");
+}
+
+// prints node i, in parentheses if its level is below min or at random
+static void print(struct expr * e, int i, int min)
+{
+	const struct node * n = &e->nodes[i];
+	int level = kinds[n->kind].level;
+	int paren = level < min || (level < 13 && !pick(e, 8));
+	char buf[32];
+
+	if (e->len >= EXPRSIZ)
+		return;
+	if (paren)
+		put(e, "(");
+	switch (n->kind)
+	{
+		case K_VAR:
+			buf[0] = (char)('a' + n->val);
+			buf[1] = 0;
+			put(e, buf);
+			break;
+		case K_CONST:
+			// a negative constant is a negated positive one
+			if (n->val < 0)
+				snprintf(buf, sizeof(buf), "(-%d)", -n->val);
+			else
+				snprintf(buf, sizeof(buf), pick(e, 4)? "%d": "0x%x", n->val);
+			put(e, buf);
+			break;
+		case K_NEG:
+		case K_BNOT:
+		case K_NOT:
+			put(e, kinds[n->kind].sym);
+			// - - a, not --a, which reads the same but is less clear
+			print(e, n->args[0], 12);
+			break;
+		case K_POW:
+			// both sides of ** are single terms
+			print(e, n->args[0], 13);
+			space(e);
+			put(e, "**");
+			space(e);
+			print(e, n->args[1], 13);
+			break;
+		case K_TERN:
+			// ?: chains do not group as in C here, so they are kept apart
+			print(e, n->args[0], 2);
+			space(e);
+			put(e, "?");
+			space(e);
+			print(e, n->args[1], 2);
+			space(e);
+			put(e, ":");
+			space(e);
+			print(e, n->args[2], 2);
+			break;
+		default:
+			// juxtaposition for some products, like 3(a + b) or ab
+			if (n->kind == K_MUL && !pick(e, 3))
+			{
+				print(e, n->args[0], 10);
+				if (e->nodes[n->args[1]].kind == K_VAR)
+				{
+					// not 0xab for 0xa b
+					if (e->nodes[n->args[0]].kind != K_VAR)
+						put(e, " ");
+					print(e, n->args[1], 13);
+				}
+				else
+				{
+					put(e, "(");
+					print(e, n->args[1], 0);
+					put(e, ")");
+				}
+				break;
+			}
+			print(e, n->args[0], level);
+			space(e);
+			put(e, kinds[n->kind].sym);
+			space(e);
+			print(e, n->args[1], level + 1);
+	}
+	if (paren)
+		put(e, ")");
+}
+
+// at least the number of ops the parser makes of node i, each use of a shared
+// node counted again, as it is printed again
+static int size(const struct expr * e, int i)
+{
+	const struct node * n = &e->nodes[i];
+	int k = 1;
+
+	if (n->kind == K_CONST)
+		return 2; // the - of a negative one
+	for (int a = 0; a < arity(n->kind) && k <= FMAXOPS; a++)
+		k += size(e, n->args[a]);
+	return k;
+}
+
+// the value of node i at input x, with *bad set if any node would leave the
+// range of an int or divide by zero, which the parser's every-lane
+// evaluation does even where C would short-circuit
+static int64_t eval(const struct expr * e, int i, int x, int * bad)
+{
+	const struct node * n = &e->nodes[i];
+	int64_t a = 0, b = 0, c = 0, v;
+
+	if (n->kind == K_VAR)
+		return x >> e->argc - 1 - n->val & 1;
+	if (n->kind == K_CONST)
+		return n->val;
+	if (arity(n->kind) > 0)
+		a = eval(e, n->args[0], x, bad);
+	if (arity(n->kind) > 1)
+		b = eval(e, n->args[1], x, bad);
+	if (arity(n->kind) > 2)
+		c = eval(e, n->args[2], x, bad);
+
+	switch (n->kind)
+	{
+		case K_POW:
+			// as intpow() does it, squaring the base as it goes
+			v = 1;
+			for (; b > 0; b >>= 1)
+			{
+				if (b & 1)
+					v *= a;
+				a *= a;
+				if (v < INT_MIN || v > INT_MAX || a < INT_MIN || a > INT_MAX)
+				{
+					*bad = 1;
+					return 0;
+				}
+			}
+			break;
+		case K_NEG: v = -a; break;
+		case K_BNOT: v = ~a; break;
+		case K_NOT: v = !a; break;
+		case K_MUL: v = a * b; break;
+		case K_DIV:
+		case K_MOD:
+			if (!b)
+			{
+				*bad = 1;
+				return 0;
+			}
+			v = n->kind == K_DIV? a / b: a % b;
+			break;
+		case K_ADD: v = a + b; break;
+		case K_SUB: v = a - b; break;
+		case K_LT: v = a < b; break;
+		case K_LTE: v = a <= b; break;
+		case K_GT: v = a > b; break;
+		case K_GTE: v = a >= b; break;
+		case K_EQ: v = a == b; break;
+		case K_NEQ: v = a != b; break;
+		case K_BAND: v = a & b; break;
+		case K_BXOR: v = a ^ b; break;
+		case K_BOR: v = a | b; break;
+		case K_AND: v = a && b; break;
+		case K_OR: v = a || b; break;
+		default: v = a? b: c;
+	}
+	if (v < INT_MIN || v > INT_MAX)
+		*bad = 1;
+	return v;
+}
+
+int main(int argc, char ** argv)
+{
+	long count = argc > 1? atol(argv[1]): 20000;
+	uint64_t seed = argc > 2? strtoull(argv[2], NULL, 0): 1;
+	long tested = 0, skipped = 0, failed = 0;
+	struct qsim_ctx * ctx;
+	const struct func * f;
+	static struct expr e;
+
+	rng_seed(&e.rng, seed);
+	for (long t = 0; t < count && failed < 10; t++)
+	{
+		int root, bad = 0, wrong = -1;
+		int64_t want[NAMPS];
+
+		e.nnodes = e.argc = 0;
+		root = gen(&e, MAXDEPTH);
+		if (size(&e, root) > FMAXOPS)
+		{
+			skipped++;
+			continue;
+		}
+		memcpy(e.text, "f = ", 4);
+		e.len = 4;
+		print(&e, root, 0);
+		if (e.len >= EXPRSIZ)
+		{
+			skipped++;
+			continue;
+		}
+		e.text[e.len] = 0;
+
+		for (int x = 0; x < 1 << e.argc && !bad; x++)
+			want[x] = eval(&e, root, x, &bad);
+		if (bad)
+		{
+			skipped++;
+			continue;
+		}
+
+		if (!(ctx = ctx_new()))
+			error("Out of memory");
+		if (setjmp(ctx->jmp))
+		{
+			printf("%s\n\t%s\n", e.text, ctx->errmsg);
+			failed++;
+			qsim_active = NULL;
+			ctx_free(ctx);
+			continue;
+		}
+		qsim_active = ctx;
+		parse_func(ctx, e.text, 1);
+		qsim_active = NULL;
+		f = &ctx->funcs['f' - 'a'];
+
+		for (int x = 0; x < 1 << e.argc && wrong < 0; x++)
+			if (func_val(f, x) != want[x])
+				wrong = x;
+		if (f->argc != e.argc)
+			wrong = 0;
+		if (wrong >= 0)
+		{
+			printf("%s\n\tinput %d: got %d, expected %lld\n", e.text, wrong,
+					func_val(f, wrong), (long long)want[wrong]);
+			failed++;
+		}
+		tested++;
+		ctx_free(ctx);
+	}
+
+	printf("%ld expressions: %ld checked, %ld skipped for being too big, dividing by zero or overflowing, %ld wrong\n",
+			tested + skipped, tested, skipped, failed);
+	return failed? EXIT_FAILURE: EXIT_SUCCESS;
+}